@@ -0,0 +1,361 @@
+/**
+ * @file
+ * benchmark runner for the three examples
+ *
+ * Runs video_encode, video_decode and video_hw_decode over a corpus, measures
+ * wall time, CPU time and peak RSS of every run and merges them with the
+ * per-stage statistics each tool writes with --stats into one JSON report.
+ *
+ * @example bench.cpp
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <dirent.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+
+// 每个用例默认运行的次数
+#define DEFAULT_REPEAT 3
+// 合成测试图案的默认帧数
+#define DEFAULT_FRAMES 250
+
+typedef struct BenchConfig {
+    const char *video_decode;
+    const char *video_hw_decode;
+    const char *video_encode;
+    const char *corpus;
+    const char *hw_device;
+    const char *encoder;
+    const char *size;
+    int frames;
+    int repeat;
+    std::string workdir;
+} BenchConfig;
+
+// 一个用例：用同一组参数运行某个工具 repeat 次
+typedef struct BenchCase {
+    std::string name;
+    std::string tool;
+    std::string input;
+    std::vector<std::string> args;
+    // 输出文件，每次运行后删除，保留时作为后续用例的输入
+    std::string output;
+    bool keep_output;
+} BenchCase;
+
+typedef struct BenchRun {
+    int status;
+    double wall;
+    double user;
+    double sys;
+    long peak_rss_kb;
+    long long frames;
+    long long bytes_written;
+    // 工具以 --stats 写出的 JSON，原样嵌入报告
+    std::string stats;
+} BenchRun;
+
+static double now_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static std::string read_file(const std::string &path) {
+    std::string data;
+    char buf[4096];
+    size_t n;
+    FILE *f = fopen(path.c_str(), "r");
+
+    if (!f)
+        return data;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        data.append(buf, n);
+    fclose(f);
+    while (!data.empty() && (data.back() == '\n' || data.back() == '\r'))
+        data.pop_back();
+    return data;
+}
+
+// 在工具输出的 JSON 顶层取一个整数字段，统计文件的格式固定，不需要完整的 JSON 解析
+static long long json_int_field(const std::string &json, const char *key) {
+    std::string pattern = std::string("\"") + key + "\": ";
+    size_t pos = json.find(pattern);
+
+    if (pos == std::string::npos)
+        return -1;
+    return strtoll(json.c_str() + pos + pattern.size(), NULL, 10);
+}
+
+static const char *file_extension(const std::string &name) {
+    size_t dot = name.rfind('.');
+    return dot == std::string::npos ? "" : name.c_str() + dot + 1;
+}
+
+static bool is_container(const char *ext) {
+    static const char *const containers[] = {"mp4", "mkv", "mov", "ts", "webm", "flv", "avi"};
+
+    for (const char *c : containers)
+        if (!strcasecmp(ext, c))
+            return true;
+    return false;
+}
+
+static std::vector<std::string> list_corpus(const char *dir) {
+    std::vector<std::string> files;
+    struct dirent *entry;
+    struct stat st;
+    DIR *d;
+
+    if (!dir || !*dir)
+        return files;
+    if (!(d = opendir(dir))) {
+        fprintf(stderr, "Could not open corpus directory %s: %s\n", dir, strerror(errno));
+        return files;
+    }
+    while ((entry = readdir(d))) {
+        std::string path = std::string(dir) + "/" + entry->d_name;
+        if (entry->d_name[0] != '.' && stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode))
+            files.push_back(path);
+    }
+    closedir(d);
+    // 固定用例顺序，方便比较两次报告
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+static std::string base_name(const std::string &path) {
+    size_t slash = path.rfind('/');
+    return slash == std::string::npos ? path : path.substr(slash + 1);
+}
+
+/*
+ * 运行一次工具，子进程的标准输出和标准错误都重定向到日志文件。
+ * 时间和资源占用通过 wait4() 取得，只统计这一个子进程。
+ */
+static BenchRun run_once(const BenchCase &bc, const std::string &stats_path, const std::string &log_path) {
+    BenchRun run = {-1, 0, 0, 0, 0, -1, -1, ""};
+    std::vector<std::string> args;
+    struct rusage ru;
+    double start;
+
+    args.push_back(bc.tool);
+    args.insert(args.end(), bc.args.begin(), bc.args.end());
+    args.push_back("--stats");
+    args.push_back(stats_path);
+
+    unlink(stats_path.c_str());
+    start = now_seconds();
+    // 同一个用例的多次运行追加到同一个日志
+    if ((run.status = bench_spawn(args, log_path, true, &ru)) < 0)
+        return run;
+    run.wall = now_seconds() - start;
+    run.user = ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6;
+    run.sys = ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+    // Linux 上 ru_maxrss 的单位是 KB
+    run.peak_rss_kb = ru.ru_maxrss;
+    run.stats = read_file(stats_path);
+    if (!run.stats.empty()) {
+        run.frames = json_int_field(run.stats, "frames");
+        run.bytes_written = json_int_field(run.stats, "bytes_written");
+    }
+    return run;
+}
+
+static bool run_case(FILE *out, const BenchConfig *cfg, const BenchCase &bc, bool first) {
+    std::string stats_path = cfg->workdir + "/" + bc.name + ".stats.json";
+    std::string log_path = cfg->workdir + "/" + bc.name + ".log";
+    std::vector<double> fps;
+    bool ok = true;
+
+    unlink(log_path.c_str());
+    fprintf(stderr, "bench: %s\n", bc.name.c_str());
+    fprintf(out, "%s\n    {\"name\": %s, \"tool\": %s, \"input\": %s, \"args\": [",
+            first ? "" : ",", json_string(bc.name).c_str(), json_string(base_name(bc.tool)).c_str(),
+            json_string(bc.input).c_str());
+    for (size_t i = 0; i < bc.args.size(); i++)
+        fprintf(out, "%s%s", i ? ", " : "", json_string(bc.args[i]).c_str());
+    fprintf(out, "], \"runs\": [");
+
+    for (int r = 0; r < cfg->repeat; r++) {
+        BenchRun run = run_once(bc, stats_path, log_path);
+        if (run.status != 0) {
+            fprintf(stderr, "bench: %s exited with status %d, see %s\n", bc.name.c_str(), run.status, log_path.c_str());
+            ok = false;
+        } else if (run.frames >= 0 && run.wall > 0) {
+            fps.push_back(run.frames / run.wall);
+        }
+        fprintf(out, "%s\n      {\"exit_status\": %d, \"wall_s\": %.6f, \"cpu_user_s\": %.6f, \"cpu_sys_s\": %.6f, "
+                     "\"peak_rss_kb\": %ld, \"frames\": %lld, \"bytes_written\": %lld, \"fps\": %.3f, \"stats\": %s}",
+                r ? "," : "", run.status, run.wall, run.user, run.sys, run.peak_rss_kb, run.frames,
+                run.bytes_written, run.frames >= 0 && run.wall > 0 ? run.frames / run.wall : 0.0,
+                run.stats.empty() ? "null" : run.stats.c_str());
+        if (!bc.keep_output && !bc.output.empty())
+            unlink(bc.output.c_str());
+        if (run.status != 0)
+            break;
+    }
+
+    // 多次运行取中位数，减少偶发抖动的影响
+    std::sort(fps.begin(), fps.end());
+    fprintf(out, "\n    ], \"median_fps\": %.3f}", fps.empty() ? 0.0 : fps[fps.size() / 2]);
+    fflush(out);
+    return ok;
+}
+
+static void add_decode_cases(std::vector<BenchCase> *cases, const BenchConfig *cfg, const std::string &input,
+                             const char *decoder) {
+    std::string stem = base_name(input);
+
+    if (decoder && cfg->video_decode) {
+        BenchCase bc;
+        bc.name = "decode-" + stem;
+        bc.tool = cfg->video_decode;
+        bc.input = input;
+        bc.output = cfg->workdir + "/" + stem + ".decode.y";
+        bc.args = {input, bc.output, decoder, "--input", "mmap", "--output", "raw"};
+        bc.keep_output = false;
+        cases->push_back(bc);
+    }
+    if (cfg->hw_device && *cfg->hw_device && cfg->video_hw_decode) {
+        BenchCase bc;
+        bc.name = "hw_decode-" + stem;
+        bc.tool = cfg->video_hw_decode;
+        bc.input = input;
+        bc.output = cfg->workdir + "/" + stem + ".hw_decode.yuv";
+        bc.args = {cfg->hw_device, input, bc.output, "--pipeline", "--output-mode", "direct"};
+        bc.keep_output = false;
+        cases->push_back(bc);
+    }
+}
+
+int main(int argc, char **argv) {
+    BenchConfig cfg = {NULL, NULL, NULL, NULL, NULL, "mpeg1video", "1920x1080", DEFAULT_FRAMES, DEFAULT_REPEAT,
+                       "bench_work"};
+    const char *output = NULL;
+    std::vector<BenchCase> cases;
+    FILE *out = stdout;
+    bool ok = true;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--video-decode") && i + 1 < argc) {
+            cfg.video_decode = argv[++i];
+        } else if (!strcmp(argv[i], "--video-hw-decode") && i + 1 < argc) {
+            cfg.video_hw_decode = argv[++i];
+        } else if (!strcmp(argv[i], "--video-encode") && i + 1 < argc) {
+            cfg.video_encode = argv[++i];
+        } else if (!strcmp(argv[i], "--corpus") && i + 1 < argc) {
+            cfg.corpus = argv[++i];
+        } else if (!strcmp(argv[i], "--hw-device") && i + 1 < argc) {
+            cfg.hw_device = argv[++i];
+        } else if (!strcmp(argv[i], "--encoder") && i + 1 < argc) {
+            cfg.encoder = argv[++i];
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            cfg.size = argv[++i];
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            cfg.frames = atoi(argv[++i]);
+        } else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            cfg.repeat = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+        } else if (!strcmp(argv[i], "--workdir") && i + 1 < argc) {
+            cfg.workdir = argv[++i];
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [options]\n"
+                            "  --video-decode <path>     video_decode executable\n"
+                            "  --video-hw-decode <path>  video_hw_decode executable\n"
+                            "  --video-encode <path>     video_encode executable\n"
+                            "  --corpus <dir>            media files to run: Y4M files are encoded, elementary\n"
+                            "                            streams (.h264, .hevc, .m1v, .m2v, .m4v) are decoded,\n"
+                            "                            containers (.mp4, .mkv, .ts, ...) are hw decoded\n"
+                            "  --hw-device <type>        device type for video_hw_decode runs (default: skip)\n"
+                            "  --encoder <name>          encoder for video_encode runs (default: mpeg1video)\n"
+                            "  --size <w>x<h>            synthetic test pattern size (default: 1920x1080)\n"
+                            "  --frames <n>              synthetic test pattern frames, 0 to skip (default: %d)\n"
+                            "  --repeat <n>              runs per case (default: %d)\n"
+                            "  --workdir <dir>           outputs, logs and per-run statistics (default: bench_work)\n"
+                            "  --output <file>           JSON report (default: stdout)\n",
+                    argv[0], DEFAULT_FRAMES, DEFAULT_REPEAT);
+            return 1;
+        }
+    }
+
+    if (mkdir(cfg.workdir.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", cfg.workdir.c_str(), strerror(errno));
+        return 1;
+    }
+
+    /*
+     * 没有语料时也能跑：先用测试图案编码出一段码流，再把它作为解码用例的输入。
+     * 编码用例的输出要保留到解码用例运行之后。
+     */
+    std::vector<std::string> corpus = list_corpus(cfg.corpus);
+    std::vector<std::string> to_decode;
+    if (cfg.video_encode && cfg.frames > 0) {
+        BenchCase bc;
+        const char *ext = encoder_extension(cfg.encoder);
+        bc.name = std::string("encode-bars-") + cfg.size;
+        bc.tool = cfg.video_encode;
+        bc.input = std::string("pattern:bars:") + cfg.size;
+        bc.output = cfg.workdir + "/synthetic." + ext;
+        bc.args = {bc.output, cfg.encoder, "--pattern", "bars", "--size", cfg.size,
+                   "--frames", std::to_string(cfg.frames)};
+        bc.keep_output = true;
+        cases.push_back(bc);
+        to_decode.push_back(bc.output);
+    }
+    for (const std::string &path : corpus) {
+        const char *ext = file_extension(path);
+        if (!strcasecmp(ext, "y4m") && cfg.video_encode) {
+            BenchCase bc;
+            bc.name = "encode-" + base_name(path);
+            bc.tool = cfg.video_encode;
+            bc.input = path;
+            bc.output = cfg.workdir + "/" + base_name(path) + "." + encoder_extension(cfg.encoder);
+            bc.args = {bc.output, cfg.encoder, "--input", path};
+            bc.keep_output = false;
+            cases.push_back(bc);
+        } else if (decoder_for_extension(ext) || is_container(ext)) {
+            to_decode.push_back(path);
+        }
+    }
+    for (const std::string &path : to_decode)
+        add_decode_cases(&cases, &cfg, path, decoder_for_extension(file_extension(path)));
+
+    if (cases.empty()) {
+        fprintf(stderr, "Nothing to benchmark\n");
+        return 1;
+    }
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Could not open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+
+    fprintf(out, "{\"repeat\": %d, \"cpus\": %ld, \"cases\": [", cfg.repeat, sysconf(_SC_NPROCESSORS_ONLN));
+    for (size_t i = 0; i < cases.size(); i++)
+        ok = run_case(out, &cfg, cases[i], i == 0) && ok;
+    fprintf(out, "\n]}\n");
+
+    // 保留下来的编码输出只是解码用例的输入，跑完后删除
+    for (const BenchCase &bc : cases)
+        if (bc.keep_output)
+            unlink(bc.output.c_str());
+    if (out != stdout)
+        fclose(out);
+    if (output)
+        fprintf(stderr, "bench: report written to %s\n", output);
+    return ok ? 0 : 1;
+}
@@ -0,0 +1,107 @@
+/**
+ * @file
+ * JSON, stream naming and child process helpers shared by the benchmark runners
+ */
+
+#ifndef FFMPEG_EXAMPLE_BENCH_UTIL_H
+#define FFMPEG_EXAMPLE_BENCH_UTIL_H
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+static inline std::string json_string(const std::string &s) {
+    std::string out = "\"";
+    for (char ch : s) {
+        if (ch == '"' || ch == '\\') {
+            out += '\\';
+            out += ch;
+        } else if (static_cast<unsigned char>(ch) < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", ch);
+            out += buf;
+        } else {
+            out += ch;
+        }
+    }
+    return out + "\"";
+}
+
+// 裸码流没有封装信息，video_decode 需要按扩展名选择解码器；返回 NULL 表示不是裸码流
+static inline const char *decoder_for_extension(const char *ext) {
+    if (!strcasecmp(ext, "h264") || !strcasecmp(ext, "264"))
+        return "h264";
+    if (!strcasecmp(ext, "hevc") || !strcasecmp(ext, "h265") || !strcasecmp(ext, "265"))
+        return "hevc";
+    if (!strcasecmp(ext, "m1v") || !strcasecmp(ext, "mpg"))
+        return "mpeg1video";
+    if (!strcasecmp(ext, "m2v"))
+        return "mpeg2video";
+    if (!strcasecmp(ext, "m4v"))
+        return "mpeg4";
+    return NULL;
+}
+
+// 编码器输出的裸码流对应的扩展名，解码器由 decoder_for_extension() 得到
+static inline const char *encoder_extension(const char *encoder) {
+    if (strstr(encoder, "264"))
+        return "h264";
+    if (strstr(encoder, "265") || strstr(encoder, "hevc"))
+        return "hevc";
+    if (!strcmp(encoder, "mpeg2video"))
+        return "m2v";
+    if (!strcmp(encoder, "mpeg4") || !strcmp(encoder, "libxvid"))
+        return "m4v";
+    return "m1v";
+}
+
+/*
+ * 在子进程中运行 args，标准输出和标准错误重定向到 log_path（append 为真时追加，否则覆盖）。
+ * 等待子进程结束并返回退出状态，被信号终止时为 128 + 信号值，无法启动时返回 -1。
+ * ru 不为空时通过 wait4() 取得这一个子进程的资源占用。
+ */
+static inline int bench_spawn(const std::vector<std::string> &args, const std::string &log_path, bool append,
+                              struct rusage *ru) {
+    std::vector<char *> argv;
+    struct rusage usage;
+    int status;
+    pid_t pid;
+
+    for (const std::string &arg : args)
+        argv.push_back(const_cast<char *>(arg.c_str()));
+    argv.push_back(NULL);
+
+    if ((pid = fork()) < 0) {
+        fprintf(stderr, "fork failed: %s\n", strerror(errno));
+        return -1;
+    }
+    if (pid == 0) {
+        int fd = open(log_path.c_str(), O_WRONLY | O_CREAT | (append ? O_APPEND : O_TRUNC), 0644);
+        if (fd >= 0) {
+            dup2(fd, STDOUT_FILENO);
+            dup2(fd, STDERR_FILENO);
+            close(fd);
+        }
+        execv(argv[0], argv.data());
+        fprintf(stderr, "Could not run %s: %s\n", argv[0], strerror(errno));
+        _exit(127);
+    }
+    while (wait4(pid, &status, 0, ru ? ru : &usage) < 0) {
+        if (errno != EINTR) {
+            fprintf(stderr, "wait4 failed: %s\n", strerror(errno));
+            return -1;
+        }
+    }
+    return WIFEXITED(status) ? WEXITSTATUS(status) : 128 + WTERMSIG(status);
+}
+
+#endif // FFMPEG_EXAMPLE_BENCH_UTIL_H
@@ -0,0 +1,810 @@
+/**
+ * @file
+ * micro-benchmarks for the hot paths of the examples
+ *
+ * Generates a deterministic corpus with video_encode (fixed test patterns,
+ * sizes and frame counts, one encoder thread), then times av_parser_parse2()
+ * for several input window sizes, the send_packet/receive_frame loop,
+ * av_hwframe_transfer_data() per device type and av_image_copy_to_buffer()
+ * against per-plane writes. Before any of that, the SIMD kernels are
+ * compared with their C versions (--check runs only this step). Every
+ * benchmark is calibrated to a minimum run time and repeated; the JSON
+ * report keeps the median per iteration together with the corpus checksums,
+ * so reports from different machines can be compared.
+ *
+ * @example micro_bench.cpp
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "bench_util.h"
+#include "core.h"
+#include "postproc.h"
+#include "test_pattern.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+#include <libavutil/cpu.h>
+#include <libavutil/hwcontext.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// 每个基准默认重复的次数
+#define DEFAULT_REPEAT 5
+// 每次重复至少运行的秒数，迭代次数按第一次的耗时放大到这个时间
+#define DEFAULT_MIN_TIME 0.5
+
+/*
+ * 语料中的一段码流。
+ * 图案、尺寸、帧数固定，video_encode 以单线程编码：多线程编码时切片的划分随线程数变化，
+ * 不同核数的机器会编出不同的码流。同一版本的 FFmpeg 和编码器在任何机器上都得到相同的文件，
+ * 报告中的校验和用来确认这一点。
+ */
+typedef struct CorpusEntry {
+    const char *name;
+    const char *pattern;
+    const char *size;
+    int frames;
+} CorpusEntry;
+
+static const CorpusEntry corpus_entries[] = {
+    // 分辨率很小，解码本身几乎不花时间，测的主要是收发循环每个包的固定开销
+    {"gradient-64x64", "gradient", "64x64", 1000},
+    {"bars-1280x720", "bars", "1280x720", 120},
+    // 噪声几乎不可压缩，包最大，解析器在每个窗口中找到的起始码最少
+    {"noise-1920x1080", "noise", "1920x1080", 30},
+};
+
+/*
+ * av_parser_parse2() 每次的输入窗口大小。
+ * 4096 是 video_decode 按块读取时的 INBUF_SIZE，1 MiB 是 mmap 输入的默认窗口（--window）。
+ */
+static const int parse_windows[] = {4096, 16384, 65536, 262144, 1 << 20};
+
+typedef struct MicroConfig {
+    const char *video_encode;
+    const char *encoder;
+    const char *hw_devices;
+    const char *write_target;
+    const char *filter;
+    int transfer_width, transfer_height;
+    int copy_width, copy_height;
+    int decode_threads;
+    int repeat;
+    double min_time;
+    bool regenerate;
+    bool corpus_only;
+    bool check_only;
+    std::string workdir;
+} MicroConfig;
+
+// 生成好的一段语料，data 末尾带 AV_INPUT_BUFFER_PADDING_SIZE 个 0 字节
+typedef struct Corpus {
+    const CorpusEntry *entry;
+    std::string path;
+    std::vector<uint8_t> data;
+    size_t size;
+    uint64_t checksum;
+    std::vector<PacketPtr> packets;
+} Corpus;
+
+typedef struct MicroResult {
+    std::string name;
+    int64_t iterations;
+    // 每次迭代的耗时（纳秒），repeat 次重复的中位数、最小值和最大值
+    double ns_median, ns_min, ns_max;
+    // 每次迭代处理的字节数和个数（包、帧），用来换算吞吐，0 表示不适用
+    double bytes, items;
+    // 跳过或者出错时的原因
+    std::string error;
+} MicroResult;
+
+// 运行 iterations 次迭代，返回负数表示出错
+typedef std::function<int(int64_t iterations)> MicroBody;
+
+static double now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static std::string error_string(int err) {
+    char buf[AV_ERROR_MAX_STRING_SIZE];
+    return av_make_error_string(buf, sizeof(buf), err);
+}
+
+// 64 位 FNV-1a，只用来比较不同机器上生成的语料是否相同
+static uint64_t fnv1a64(const uint8_t *data, size_t size) {
+    uint64_t h = 0xcbf29ce484222325ULL;
+
+    for (size_t i = 0; i < size; i++) {
+        h ^= data[i];
+        h *= 0x100000001b3ULL;
+    }
+    return h;
+}
+
+static bool read_corpus_file(Corpus *c) {
+    struct stat st;
+    FILE *f;
+
+    if (stat(c->path.c_str(), &st) < 0 || !S_ISREG(st.st_mode) || st.st_size <= 0)
+        return false;
+    if (!(f = fopen(c->path.c_str(), "rb")))
+        return false;
+    c->size = static_cast<size_t>(st.st_size);
+    c->data.assign(c->size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+    if (fread(c->data.data(), 1, c->size, f) != c->size) {
+        fclose(f);
+        return false;
+    }
+    fclose(f);
+    c->checksum = fnv1a64(c->data.data(), c->size);
+    return true;
+}
+
+/*
+ * 生成（或者复用已经生成的）语料。
+ * 已有的文件默认直接使用，这样整个机群可以分发同一份语料；--regenerate 时重新编码。
+ */
+static bool corpus_prepare(std::vector<Corpus> *corpus, const MicroConfig *cfg) {
+    const char *ext = encoder_extension(cfg->encoder);
+
+    for (const CorpusEntry &e : corpus_entries) {
+        Corpus c;
+        c.entry = &e;
+        c.path = cfg->workdir + "/" + e.name + "." + ext;
+        c.size = 0;
+        c.checksum = 0;
+
+        if (cfg->regenerate || !read_corpus_file(&c)) {
+            std::string log_path = cfg->workdir + "/" + e.name + ".log";
+            int status;
+            if (!cfg->video_encode) {
+                fprintf(stderr, "%s is missing and no --video-encode was given\n", c.path.c_str());
+                return false;
+            }
+            fprintf(stderr, "micro_bench: encoding %s\n", c.path.c_str());
+            status = bench_spawn({cfg->video_encode, c.path, cfg->encoder, "--threads", "1", "--format", "es",
+                                  "--pattern", e.pattern, "--size", e.size, "--frames", std::to_string(e.frames)},
+                                 log_path, false, NULL);
+            if (status != 0 || !read_corpus_file(&c)) {
+                fprintf(stderr, "video_encode exited with status %d, see %s\n", status, log_path.c_str());
+                return false;
+            }
+        }
+        corpus->push_back(std::move(c));
+    }
+    return true;
+}
+
+/*
+ * 以 window 字节为单位把整段码流交给解析器，返回切出的包数。
+ * packets 不为空时保存切出的包，供解码基准使用。
+ */
+static int parse_stream(AVCodecContext *c, const Corpus *corpus, size_t window, std::vector<PacketPtr> *packets) {
+    AVCodecParserContext *parser = av_parser_init(c->codec_id);
+    const uint8_t *data = corpus->data.data();
+    size_t left = corpus->size;
+    uint8_t *out;
+    int out_size, nb = 0, ret;
+
+    if (!parser)
+        return AVERROR(ENOSYS);
+    while (true) {
+        int n = static_cast<int>(FFMIN(left, window));
+        // 输入读完后以空输入清空解析器中剩下的数据
+        ret = av_parser_parse2(parser, c, &out, &out_size, n ? data : NULL, n, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+        if (ret < 0)
+            break;
+        data += ret;
+        left -= ret;
+        if (out_size) {
+            if (packets) {
+                PacketPtr pkt = core_packet_alloc();
+                if (!pkt || (ret = av_new_packet(pkt.get(), out_size)) < 0) {
+                    ret = pkt ? ret : AVERROR(ENOMEM);
+                    break;
+                }
+                memcpy(pkt->data, out, out_size);
+                pkt->pts = nb;
+                packets->push_back(std::move(pkt));
+            }
+            nb++;
+        } else if (!n) {
+            break;
+        }
+    }
+    av_parser_close(parser);
+    return ret < 0 ? ret : nb;
+}
+
+/*
+ * 直接调用 avcodec_send_packet() / avcodec_receive_frame()，送完所有包后清空解码器，
+ * 再用 avcodec_flush_buffers() 复位，同一个解码上下文可以重复使用。返回取出的帧数。
+ */
+static int decode_packets(AVCodecContext *c, const std::vector<PacketPtr> &packets, AVFrame *frame) {
+    int frames = 0, ret;
+
+    for (size_t i = 0; i <= packets.size(); i++) {
+        if ((ret = avcodec_send_packet(c, i < packets.size() ? packets[i].get() : NULL)) < 0)
+            return ret;
+        while ((ret = avcodec_receive_frame(c, frame)) >= 0) {
+            frames++;
+            av_frame_unref(frame);
+        }
+        if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF)
+            return ret;
+    }
+    avcodec_flush_buffers(c);
+    return frames;
+}
+
+// 同样的循环经过 core_decode()，和上面的差值就是回调和错误处理这一层的开销
+static int core_decode_packets(AVCodecContext *c, const std::vector<PacketPtr> &packets, AVFrame *frame) {
+    int frames = 0, ret;
+    FrameCallback cb = [&frames](AVFrame *) {
+        frames++;
+        return 0;
+    };
+
+    for (const PacketPtr &pkt : packets)
+        if ((ret = core_decode(c, pkt.get(), frame, cb)) < 0)
+            return ret;
+    if ((ret = core_decode(c, NULL, frame, cb)) < 0)
+        return ret;
+    avcodec_flush_buffers(c);
+    return frames;
+}
+
+struct MicroBench {
+    const MicroConfig *cfg;
+    std::vector<MicroResult> results;
+};
+
+static bool micro_selected(const MicroBench *b, const std::string &name) {
+    return !b->cfg->filter || name.find(b->cfg->filter) != std::string::npos;
+}
+
+// 跳过的基准按名称过滤，和 micro_run() 一样；组内的准备工作出错时 name 是组名
+static void micro_skip(MicroBench *b, const std::string &name, const std::string &reason) {
+    MicroResult r = {name, 0, 0, 0, 0, 0, 0, reason};
+
+    if (!micro_selected(b, name))
+        return;
+    fprintf(stderr, "micro_bench: %-52s skipped: %s\n", name.c_str(), reason.c_str());
+    b->results.push_back(r);
+}
+
+/*
+ * 与 Google Benchmark 相同的计时方式：从 1 次迭代开始，按上一次的耗时放大迭代次数（每次最多 10 倍），
+ * 直到一次运行超过 min_time；之后用这个迭代次数重复 repeat 次，取每次迭代耗时的中位数。
+ * 放大迭代次数的几次运行同时起到预热的作用。
+ */
+static void micro_run(MicroBench *b, const std::string &name, double bytes, double items, const MicroBody &body) {
+    MicroResult r = {name, 1, 0, 0, 0, bytes, items, ""};
+    double min_ns = b->cfg->min_time * 1e9;
+    std::vector<double> ns;
+    double t;
+    int ret;
+
+    if (!micro_selected(b, name))
+        return;
+    while (true) {
+        t = now_ns();
+        if ((ret = body(r.iterations)) < 0) {
+            micro_skip(b, name, error_string(ret));
+            return;
+        }
+        t = now_ns() - t;
+        if (t >= min_ns || r.iterations >= 1000000000)
+            break;
+        r.iterations = static_cast<int64_t>(r.iterations * av_clipd(t > 0 ? min_ns * 1.4 / t : 10, 2, 10));
+    }
+    for (int i = 0; i < b->cfg->repeat; i++) {
+        t = now_ns();
+        if ((ret = body(r.iterations)) < 0) {
+            micro_skip(b, name, error_string(ret));
+            return;
+        }
+        ns.push_back((now_ns() - t) / r.iterations);
+    }
+    std::sort(ns.begin(), ns.end());
+    r.ns_median = ns[ns.size() / 2];
+    r.ns_min = ns.front();
+    r.ns_max = ns.back();
+    fprintf(stderr, "micro_bench: %-52s %10lld it %14.0f ns %10.1f MB/s %12.1f items/s\n", name.c_str(),
+            static_cast<long long>(r.iterations), r.ns_median, bytes ? bytes * 1e3 / r.ns_median : 0.0,
+            items ? items * 1e9 / r.ns_median : 0.0);
+    b->results.push_back(r);
+}
+
+static void bench_parse(MicroBench *b, const Corpus *corpus, const AVCodec *codec) {
+    CodecContextPtr c(avcodec_alloc_context3(codec));
+    int packets = static_cast<int>(corpus->packets.size());
+
+    if (!c) {
+        micro_skip(b, std::string("parse/") + corpus->entry->name, error_string(AVERROR(ENOMEM)));
+        return;
+    }
+    for (int window : parse_windows) {
+        std::string name = std::string("parse/") + corpus->entry->name + "/window:" + std::to_string(window);
+        micro_run(b, name, corpus->size, packets, [&](int64_t iterations) {
+            for (int64_t i = 0; i < iterations; i++) {
+                int ret = parse_stream(c.get(), corpus, window, NULL);
+                if (ret < 0)
+                    return ret;
+            }
+            return 0;
+        });
+    }
+}
+
+static void bench_decode(MicroBench *b, const Corpus *corpus, const AVCodec *codec) {
+    std::string prefix = std::string("decode/") + corpus->entry->name;
+    CodecContextPtr c;
+    FramePtr frame = core_frame_alloc();
+    int frames, ret;
+
+    if (!frame) {
+        micro_skip(b, prefix, error_string(AVERROR(ENOMEM)));
+        return;
+    }
+    if ((ret = core_decoder_alloc(&c, codec, b->cfg->decode_threads, 0)) < 0 ||
+        (ret = avcodec_open2(c.get(), codec, NULL)) < 0) {
+        micro_skip(b, prefix, error_string(ret));
+        return;
+    }
+    // 先完整解码一遍，得到每次迭代的帧数
+    if ((frames = decode_packets(c.get(), corpus->packets, frame.get())) < 0) {
+        micro_skip(b, prefix, error_string(frames));
+        return;
+    }
+
+    micro_run(b, prefix + "/send_receive", corpus->size, frames, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int n = decode_packets(c.get(), corpus->packets, frame.get());
+            if (n < 0)
+                return n;
+        }
+        return 0;
+    });
+    micro_run(b, prefix + "/core_decode", corpus->size, frames, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int n = core_decode_packets(c.get(), corpus->packets, frame.get());
+            if (n < 0)
+                return n;
+        }
+        return 0;
+    });
+}
+
+// 设备支持的软件格式中优先选择 NV12，大多数硬件解码器输出的就是它
+static enum AVPixelFormat transfer_sw_format(const AVHWFramesConstraints *cons) {
+    if (!cons->valid_sw_formats)
+        return AV_PIX_FMT_NV12;
+    for (const enum AVPixelFormat *p = cons->valid_sw_formats; *p != AV_PIX_FMT_NONE; p++)
+        if (*p == AV_PIX_FMT_NV12)
+            return *p;
+    return cons->valid_sw_formats[0];
+}
+
+/*
+ * 一种设备上 av_hwframe_transfer_data() 两个方向的带宽。
+ * 内存中的帧预先分配好缓存，每次迭代只有传输本身，不包含分配。
+ */
+static void bench_hw_transfer(MicroBench *b, const char *type_name) {
+    const MicroConfig *cfg = b->cfg;
+    std::string prefix = std::string("hwframe_transfer/") + type_name;
+    enum AVHWDeviceType type = av_hwdevice_find_type_by_name(type_name);
+    AVBufferRef *device = NULL, *frames_ref = NULL;
+    AVHWFramesConstraints *cons;
+    AVHWFramesContext *frames_ctx;
+    FramePtr hw_frame = core_frame_alloc(), sw_frame = core_frame_alloc();
+    enum AVPixelFormat hw_format, sw_format;
+    int size, ret;
+
+    if (type == AV_HWDEVICE_TYPE_NONE) {
+        micro_skip(b, prefix, "unknown device type");
+        return;
+    }
+    if (!hw_frame || !sw_frame) {
+        micro_skip(b, prefix, error_string(AVERROR(ENOMEM)));
+        return;
+    }
+    if ((ret = av_hwdevice_ctx_create(&device, type, NULL, NULL, 0)) < 0) {
+        micro_skip(b, prefix, "no device: " + error_string(ret));
+        return;
+    }
+    BufferRefPtr device_ref(device);
+
+    if (!(cons = av_hwdevice_get_hwframe_constraints(device, NULL)) || !cons->valid_hw_formats) {
+        av_hwframe_constraints_free(&cons);
+        micro_skip(b, prefix, "no frame constraints");
+        return;
+    }
+    hw_format = cons->valid_hw_formats[0];
+    sw_format = transfer_sw_format(cons);
+    av_hwframe_constraints_free(&cons);
+
+    if (!(frames_ref = av_hwframe_ctx_alloc(device))) {
+        micro_skip(b, prefix, error_string(AVERROR(ENOMEM)));
+        return;
+    }
+    BufferRefPtr frames(frames_ref);
+    frames_ctx = reinterpret_cast<AVHWFramesContext *>(frames->data);
+    frames_ctx->format = hw_format;
+    frames_ctx->sw_format = sw_format;
+    frames_ctx->width = cfg->transfer_width;
+    frames_ctx->height = cfg->transfer_height;
+    // VAAPI、QSV 等设备的帧池大小固定，需要预先分配
+    frames_ctx->initial_pool_size = 2;
+    if ((ret = av_hwframe_ctx_init(frames.get())) < 0 ||
+        (ret = av_hwframe_get_buffer(frames.get(), hw_frame.get(), 0)) < 0) {
+        micro_skip(b, prefix, error_string(ret));
+        return;
+    }
+
+    sw_frame->format = sw_format;
+    sw_frame->width = cfg->transfer_width;
+    sw_frame->height = cfg->transfer_height;
+    if ((ret = av_frame_get_buffer(sw_frame.get(), 32)) < 0) {
+        micro_skip(b, prefix, error_string(ret));
+        return;
+    }
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && sw_frame->buf[i]; i++)
+        memset(sw_frame->buf[i]->data, 0x80, sw_frame->buf[i]->size);
+    size = av_image_get_buffer_size(sw_format, cfg->transfer_width, cfg->transfer_height, 1);
+
+    std::string suffix = std::string("/") + av_get_pix_fmt_name(sw_format) + "/" +
+                         std::to_string(cfg->transfer_width) + "x" + std::to_string(cfg->transfer_height);
+    micro_run(b, prefix + "/upload" + suffix, size, 1, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int err = av_hwframe_transfer_data(hw_frame.get(), sw_frame.get(), 0);
+            if (err < 0)
+                return err;
+        }
+        return 0;
+    });
+    micro_run(b, prefix + "/download" + suffix, size, 1, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int err = av_hwframe_transfer_data(sw_frame.get(), hw_frame.get(), 0);
+            if (err < 0)
+                return err;
+        }
+        return 0;
+    });
+}
+
+static void bench_hw_transfers(MicroBench *b) {
+    const char *list = b->cfg->hw_devices;
+    std::vector<std::string> types;
+
+    if (!list || !strcmp(list, "none"))
+        return;
+    if (!strcmp(list, "all")) {
+        // 编进 FFmpeg 的所有设备类型，机器上没有的设备在报告中记为跳过
+        for (enum AVHWDeviceType t = av_hwdevice_iterate_types(AV_HWDEVICE_TYPE_NONE); t != AV_HWDEVICE_TYPE_NONE;
+             t = av_hwdevice_iterate_types(t))
+            types.push_back(av_hwdevice_get_type_name(t));
+    } else {
+        for (const char *p = list; *p;) {
+            const char *end = strchr(p, ',');
+            size_t len = end ? static_cast<size_t>(end - p) : strlen(p);
+            if (len)
+                types.push_back(std::string(p, len));
+            p += end ? len + 1 : len;
+        }
+    }
+    for (const std::string &type : types)
+        bench_hw_transfer(b, type.c_str());
+}
+
+/*
+ * 写出一帧的两种方式，与 video_hw_decode 的 copy 和 direct 输出模式对应：
+ * copy_write 先用 av_image_copy_to_buffer() 拷贝成紧凑排列的缓存再整块写入，
+ * plane_write 像 write_planes() 那样把各个平面（linesize 有填充时每行）作为 iovec 直接写入。
+ * 都写到同一个偏移上，写入目标是普通文件时只测页缓存的拷贝，/dev/null 时只剩系统调用的开销。
+ */
+static void bench_copy(MicroBench *b, enum AVPixelFormat format, bool padded, int fd) {
+    const MicroConfig *cfg = b->cfg;
+    std::string prefix = std::string("copy/") + av_get_pix_fmt_name(format) + "/" +
+                         std::to_string(cfg->copy_width) + "x" + std::to_string(cfg->copy_height) +
+                         (padded ? "/padded" : "/packed");
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    FramePtr frame = core_frame_alloc();
+    int bytewidth[4], height[4];
+    int nb_planes, size, ret;
+
+    if (!frame) {
+        micro_skip(b, prefix, error_string(AVERROR(ENOMEM)));
+        return;
+    }
+    /*
+     * padded 模拟解码器输出的帧：按更宽的尺寸分配，linesize 大于平面的有效宽度，每行末尾有对齐填充；
+     * packed 的 linesize 与有效宽度相同，每个平面是连续的一块。
+     */
+    frame->format = format;
+    frame->width = padded ? FFALIGN(cfg->copy_width, 64) + 64 : cfg->copy_width;
+    frame->height = cfg->copy_height;
+    if ((ret = av_frame_get_buffer(frame.get(), padded ? 64 : 1)) < 0) {
+        micro_skip(b, prefix, error_string(ret));
+        return;
+    }
+    frame->width = cfg->copy_width;
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++)
+        memset(frame->buf[i]->data, 0x80, frame->buf[i]->size);
+
+    size = av_image_get_buffer_size(format, frame->width, frame->height, 1);
+    std::vector<uint8_t> buffer(static_cast<size_t>(size));
+    av_image_fill_linesizes(bytewidth, format, frame->width);
+    nb_planes = av_pix_fmt_count_planes(format);
+    for (int i = 0; i < nb_planes; i++) {
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        height[i] = -((-frame->height) >> shift);
+    }
+
+    micro_run(b, prefix + "/copy_to_buffer", size, 1, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int err = av_image_copy_to_buffer(buffer.data(), size, (const uint8_t *const *) frame->data,
+                                              (const int *) frame->linesize, format, frame->width,
+                                              frame->height, 1);
+            if (err < 0)
+                return err;
+        }
+        return 0;
+    });
+    micro_run(b, prefix + "/copy_write", size, 1, [&](int64_t iterations) {
+        for (int64_t i = 0; i < iterations; i++) {
+            int err = av_image_copy_to_buffer(buffer.data(), size, (const uint8_t *const *) frame->data,
+                                              (const int *) frame->linesize, format, frame->width,
+                                              frame->height, 1);
+            if (err < 0)
+                return err;
+            if (pwrite(fd, buffer.data(), size, 0) != size)
+                return AVERROR(errno ? errno : EIO);
+        }
+        return 0;
+    });
+    micro_run(b, prefix + "/plane_write", size, 1, [&](int64_t iterations) {
+        std::vector<struct iovec> iov;
+        for (int64_t i = 0; i < iterations; i++) {
+            iov.clear();
+            for (int p = 0; p < nb_planes; p++) {
+                int rows = frame->linesize[p] == bytewidth[p] ? 1 : height[p];
+                size_t len = rows == 1 ? static_cast<size_t>(bytewidth[p]) * height[p] : bytewidth[p];
+                for (int y = 0; y < rows; y++)
+                    iov.push_back({frame->data[p] + static_cast<ptrdiff_t>(y) * frame->linesize[p], len});
+            }
+            // 一次提交的 iovec 个数有上限，分批写入
+            off_t offset = 0;
+            for (size_t done = 0; done < iov.size();) {
+                int cnt = static_cast<int>(FFMIN(iov.size() - done, static_cast<size_t>(IOV_MAX)));
+                ssize_t n = pwritev(fd, &iov[done], cnt, offset);
+                if (n < 0)
+                    return AVERROR(errno);
+                offset += n;
+                done += cnt;
+            }
+            if (offset != size)
+                return AVERROR(EIO);
+        }
+        return 0;
+    });
+}
+
+/*
+ * 对比当前 CPU 上各 SIMD 版本内核和 C 版本的输出。
+ * 不同机器选中的版本不同，测试图案的内核输出不一致时，语料的校验和在不同机器上对不上。
+ */
+static bool check_kernels(void) {
+    int failed = test_pattern_check_kernels();
+    failed += postproc_check_kernels();
+    return failed == 0;
+}
+
+// CPU 型号写进报告，方便按机型比较
+static std::string cpu_model(void) {
+    char line[256];
+    std::string model;
+    FILE *f = fopen("/proc/cpuinfo", "r");
+
+    if (!f)
+        return model;
+    while (fgets(line, sizeof(line), f)) {
+        char *colon = strchr(line, ':');
+        if (colon && !strncmp(line, "model name", 10)) {
+            model = colon + 1 + strspn(colon + 1, " \t");
+            while (!model.empty() && (model.back() == '\n' || model.back() == '\r'))
+                model.pop_back();
+            break;
+        }
+    }
+    fclose(f);
+    return model;
+}
+
+static void write_report(FILE *out, const MicroConfig *cfg, const std::vector<Corpus> &corpus,
+                         const std::vector<MicroResult> &results) {
+    fprintf(out, "{\"ffmpeg\": %s, \"cpu\": %s, \"cpus\": %ld, \"cpu_flags\": %d, \"encoder\": %s, "
+                 "\"min_time_s\": %.3f, \"repeat\": %d, \"decode_threads\": %d, \"write_target\": %s, "
+                 "\"test_pattern_impl\": %s, \"postproc_impl\": %s,\n \"corpus\": [",
+            json_string(av_version_info()).c_str(), json_string(cpu_model()).c_str(), sysconf(_SC_NPROCESSORS_ONLN),
+            av_get_cpu_flags(), json_string(cfg->encoder).c_str(), cfg->min_time, cfg->repeat, cfg->decode_threads,
+            json_string(cfg->write_target).c_str(), json_string(test_pattern_impl()).c_str(),
+            json_string(postproc_impl()).c_str());
+    for (size_t i = 0; i < corpus.size(); i++) {
+        const Corpus &c = corpus[i];
+        fprintf(out, "%s\n    {\"name\": %s, \"pattern\": %s, \"size\": %s, \"frames\": %d, \"bytes\": %zu, "
+                     "\"packets\": %zu, \"fnv1a64\": \"%016llx\"}",
+                i ? "," : "", json_string(c.entry->name).c_str(), json_string(c.entry->pattern).c_str(),
+                json_string(c.entry->size).c_str(), c.entry->frames, c.size, c.packets.size(),
+                static_cast<unsigned long long>(c.checksum));
+    }
+    fprintf(out, "\n ],\n \"benchmarks\": [");
+    for (size_t i = 0; i < results.size(); i++) {
+        const MicroResult &r = results[i];
+        fprintf(out, "%s\n    {\"name\": %s, ", i ? "," : "", json_string(r.name).c_str());
+        if (!r.error.empty()) {
+            fprintf(out, "\"skipped\": %s}", json_string(r.error).c_str());
+            continue;
+        }
+        fprintf(out, "\"iterations\": %lld, \"ns_per_iter\": %.1f, \"ns_per_iter_min\": %.1f, "
+                     "\"ns_per_iter_max\": %.1f, \"bytes_per_s\": %.0f, \"items_per_s\": %.1f}",
+                static_cast<long long>(r.iterations), r.ns_median, r.ns_min, r.ns_max,
+                r.bytes * 1e9 / r.ns_median, r.items * 1e9 / r.ns_median);
+    }
+    fprintf(out, "\n]}\n");
+}
+
+static bool parse_size(const char *arg, int *width, int *height) {
+    return sscanf(arg, "%dx%d", width, height) == 2 && *width > 0 && *height > 0;
+}
+
+int main(int argc, char **argv) {
+    MicroConfig cfg = {NULL, "mpeg1video", "all", "/dev/null", NULL, 1920, 1080, 1920, 1080, 1, DEFAULT_REPEAT,
+                       DEFAULT_MIN_TIME, false, false, false, "micro_bench_work"};
+    const char *output = NULL;
+    std::vector<Corpus> corpus;
+    MicroBench bench;
+    const AVCodec *codec;
+    const char *decoder;
+    FILE *out = stdout;
+    int fd, ret;
+
+    for (int i = 1; i < argc; i++) {
+        if (!strcmp(argv[i], "--video-encode") && i + 1 < argc) {
+            cfg.video_encode = argv[++i];
+        } else if (!strcmp(argv[i], "--encoder") && i + 1 < argc) {
+            cfg.encoder = argv[++i];
+        } else if (!strcmp(argv[i], "--workdir") && i + 1 < argc) {
+            cfg.workdir = argv[++i];
+        } else if (!strcmp(argv[i], "--regenerate")) {
+            cfg.regenerate = true;
+        } else if (!strcmp(argv[i], "--corpus-only")) {
+            cfg.corpus_only = true;
+        } else if (!strcmp(argv[i], "--check")) {
+            cfg.check_only = true;
+        } else if (!strcmp(argv[i], "--filter") && i + 1 < argc) {
+            cfg.filter = argv[++i];
+        } else if (!strcmp(argv[i], "--min-time") && i + 1 < argc) {
+            cfg.min_time = atof(argv[++i]) > 0 ? atof(argv[i]) : DEFAULT_MIN_TIME;
+        } else if (!strcmp(argv[i], "--repeat") && i + 1 < argc) {
+            cfg.repeat = atoi(argv[++i]) > 0 ? atoi(argv[i]) : 1;
+        } else if (!strcmp(argv[i], "--decode-threads") && i + 1 < argc) {
+            cfg.decode_threads = FFMAX(atoi(argv[++i]), 0);
+        } else if (!strcmp(argv[i], "--hw-device") && i + 1 < argc) {
+            cfg.hw_devices = argv[++i];
+        } else if (!strcmp(argv[i], "--transfer-size") && i + 1 < argc &&
+                   parse_size(argv[i + 1], &cfg.transfer_width, &cfg.transfer_height)) {
+            i++;
+        } else if (!strcmp(argv[i], "--copy-size") && i + 1 < argc &&
+                   parse_size(argv[i + 1], &cfg.copy_width, &cfg.copy_height)) {
+            i++;
+        } else if (!strcmp(argv[i], "--write-target") && i + 1 < argc) {
+            cfg.write_target = argv[++i];
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            output = argv[++i];
+        } else {
+            fprintf(stderr, "Usage: %s [options]\n"
+                            "  --video-encode <path>      video_encode executable, generates missing corpus files\n"
+                            "  --encoder <name>           encoder of the corpus (default: mpeg1video)\n"
+                            "  --workdir <dir>            corpus and encoder logs (default: micro_bench_work)\n"
+                            "  --regenerate               encode the corpus again even if the files exist\n"
+                            "  --corpus-only              generate the corpus and report its checksums only\n"
+                            "  --check                    only compare the SIMD kernels with their C versions\n"
+                            "  --filter <text>            run only benchmarks whose name contains text\n"
+                            "  --min-time <s>             minimum time of each repetition (default: %.1f)\n"
+                            "  --repeat <n>               repetitions per benchmark, the median is reported\n"
+                            "                             (default: %d)\n"
+                            "  --decode-threads <n>       decoder threads of the decode benchmarks, 0 lets\n"
+                            "                             libavcodec decide (default: 1)\n"
+                            "  --hw-device <types|all|none>  comma separated device types for the hwframe\n"
+                            "                             transfer benchmarks (default: all)\n"
+                            "  --transfer-size <w>x<h>    hwframe transfer frame size (default: 1920x1080)\n"
+                            "  --copy-size <w>x<h>        frame size of the copy benchmarks (default: 1920x1080)\n"
+                            "  --write-target <path>      file the copy benchmarks write to (default: /dev/null)\n"
+                            "  --output <file>            JSON report (default: stdout)\n",
+                    argv[0], DEFAULT_MIN_TIME, DEFAULT_REPEAT);
+            return 1;
+        }
+    }
+
+    if (!check_kernels()) {
+        fprintf(stderr, "SIMD kernels do not match their C versions\n");
+        return 1;
+    }
+    if (cfg.check_only)
+        return 0;
+
+    if (mkdir(cfg.workdir.c_str(), 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Could not create %s: %s\n", cfg.workdir.c_str(), strerror(errno));
+        return 1;
+    }
+    if (!corpus_prepare(&corpus, &cfg))
+        return 1;
+    if (!(decoder = decoder_for_extension(encoder_extension(cfg.encoder))) ||
+        (ret = core_find_codec(decoder, false, &codec)) < 0) {
+        fprintf(stderr, "Codec not found for %s\n", cfg.encoder);
+        return 1;
+    }
+    // 切出的包只依赖码流本身，与窗口大小无关，解码基准都使用这一份
+    for (Corpus &c : corpus) {
+        CodecContextPtr ctx(avcodec_alloc_context3(codec));
+        if (!ctx || (ret = parse_stream(ctx.get(), &c, parse_windows[0], &c.packets)) < 0) {
+            fprintf(stderr, "Could not parse %s: %s\n", c.path.c_str(), error_string(ctx ? ret : AVERROR(ENOMEM)).c_str());
+            return 1;
+        }
+    }
+
+    bench.cfg = &cfg;
+    if (!cfg.corpus_only) {
+        if ((fd = open(cfg.write_target, O_WRONLY | O_CREAT, 0644)) < 0) {
+            fprintf(stderr, "Could not open %s: %s\n", cfg.write_target, strerror(errno));
+            return 1;
+        }
+        for (const Corpus &c : corpus)
+            bench_parse(&bench, &c, codec);
+        for (const Corpus &c : corpus)
+            bench_decode(&bench, &c, codec);
+        bench_hw_transfers(&bench);
+        for (enum AVPixelFormat format : {AV_PIX_FMT_YUV420P, AV_PIX_FMT_NV12}) {
+            bench_copy(&bench, format, false, fd);
+            bench_copy(&bench, format, true, fd);
+        }
+        close(fd);
+    }
+
+    if (output && !(out = fopen(output, "w"))) {
+        fprintf(stderr, "Could not open %s: %s\n", output, strerror(errno));
+        return 1;
+    }
+    write_report(out, &cfg, corpus, bench.results);
+    if (out != stdout)
+        fclose(out);
+    if (output)
+        fprintf(stderr, "micro_bench: report written to %s\n", output);
+    return 0;
+}
@@ -0,0 +1,685 @@
+/**
+ * @file
+ * asynchronous output writer shared by video_encode and video_hw_decode
+ */
+
+#ifndef FFMPEG_EXAMPLE_ASYNC_WRITER_H
+#define FFMPEG_EXAMPLE_ASYNC_WRITER_H
+
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include "spsc_queue.h"
+#include "stats.h"
+
+#ifndef _WIN32
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#endif
+
+// io_uring 直接走系统调用，不依赖 liburing；编译环境的内核头文件太旧时只有线程后端
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define HAVE_IO_URING 1
+#endif
+#endif
+#endif
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+#ifdef _WIN32
+struct iovec {
+    void *iov_base;
+    size_t iov_len;
+};
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+#define WRITER_DEFAULT_DEPTH 8
+
+#define WRITER_OPTIONS_HELP \
+    "  --writer <mode>      how output data is written: sync (on the calling thread), thread (a writer\n" \
+    "                       thread), uring (io_uring, Linux only; the default, falls back to thread)\n" \
+    "  --write-depth <n>    writes that may be in flight at once (default " AV_STRINGIFY(WRITER_DEFAULT_DEPTH) ")\n"
+
+/*
+ * 写文件的方式：
+ * WRITER_SYNC   在调用线程上直接写，写完才返回
+ * WRITER_THREAD 把写请求交给专门的写线程，调用线程只在在途请求达到上限时等待
+ * WRITER_URING  把写请求提交到 io_uring，由内核异步完成，不需要额外的线程
+ */
+enum WriterBackend {
+    WRITER_SYNC,
+    WRITER_THREAD,
+    WRITER_URING,
+};
+
+typedef struct WriterConfig {
+    enum WriterBackend backend;
+    // 同时在途的写请求个数上限
+    int depth;
+} WriterConfig;
+
+static inline const char *writer_backend_name(enum WriterBackend backend) {
+    switch (backend) {
+    case WRITER_SYNC:
+        return "sync";
+    case WRITER_THREAD:
+        return "thread";
+    case WRITER_URING:
+        return "uring";
+    }
+    return "unknown";
+}
+
+/*
+ * 处理写文件相关的命令行参数，*i 指向当前参数，消耗了参数值时前移。
+ * 不是写文件参数时返回 0；参数值不合法时直接退出。
+ */
+static inline int writer_parse_option(int argc, char **argv, int *i, WriterConfig *cfg) {
+    if (!strcmp(argv[*i], "--writer") && *i + 1 < argc) {
+        const char *mode = argv[++*i];
+        if (!strcmp(mode, "sync")) {
+            cfg->backend = WRITER_SYNC;
+        } else if (!strcmp(mode, "thread")) {
+            cfg->backend = WRITER_THREAD;
+        } else if (!strcmp(mode, "uring")) {
+            cfg->backend = WRITER_URING;
+        } else {
+            fprintf(stderr, "Unknown writer '%s'\n", mode);
+            exit(1);
+        }
+    } else if (!strcmp(argv[*i], "--write-depth") && *i + 1 < argc) {
+        cfg->depth = atoi(argv[++*i]);
+        cfg->depth = FFMAX(cfg->depth, 1);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * 一次写请求：按顺序写出的若干段数据，以及保证这些数据在写完之前不被释放的缓存引用。
+ * 数据本身不拷贝，引用在写完成后才释放，缓存随后回到各自的缓存池。
+ */
+typedef struct WriteRequest {
+    std::vector<struct iovec> iov;
+    AVBufferRef *refs[AV_NUM_DATA_POINTERS];
+    int nb_refs;
+    // 写入位置；输出不可定位（管道等）时为 -1，按提交顺序写在当前位置
+    int64_t offset;
+    // 已经写完的 iovec 个数，部分完成时从这里继续
+    size_t done;
+} WriteRequest;
+
+#ifdef HAVE_IO_URING
+// 映射到用户态的提交队列和完成队列
+typedef struct UringRing {
+    int fd;
+    void *sq_map, *cq_map, *sqe_map;
+    size_t sq_map_size, cq_map_size, sqe_map_size;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+} UringRing;
+#endif
+
+/*
+ * 异步写文件。每个请求提交时就按已提交的总字节数确定了在文件中的位置，
+ * 所以多个请求可以同时在途、以任意顺序完成，写出的文件内容与顺序写入一致。
+ * 提交请求只能在同一个线程上进行。
+ */
+typedef struct AsyncWriter {
+    explicit AsyncWriter(int depth) : requests(depth), free_requests(depth), pending(depth + 1) {}
+
+    enum WriterBackend backend = WRITER_SYNC;
+    FILE *file = NULL;
+    int fd = -1;
+    // 下一个请求的写入位置，-1 表示输出不可定位
+    int64_t offset = -1;
+    // 已写数据的末尾，writer_seek() 回到前面改写时 offset 会小于它
+    int64_t end = -1;
+    std::vector<WriteRequest> requests;
+
+    // 线程后端：调用线程从 free_requests 取请求、放进 pending，写线程写完后放回 free_requests
+    SpscQueue<WriteRequest *> free_requests;
+    SpscQueue<WriteRequest *> pending;
+    std::thread worker;
+    std::atomic<bool> abort{false};
+
+#ifdef HAVE_IO_URING
+    // io_uring 后端：空闲的请求和已提交还没完成的请求数，都只由调用线程访问
+    UringRing ring{};
+    std::vector<WriteRequest *> idle;
+    int inflight = 0;
+#endif
+
+    // 第一个写失败的错误码；出错之后的请求不再写入，只释放引用
+    std::atomic<int> error{0};
+} AsyncWriter;
+
+static inline size_t writer_request_size(const WriteRequest *r) {
+    size_t size = 0;
+
+    for (size_t i = r->done; i < r->iov.size(); i++)
+        size += r->iov[i].iov_len;
+    return size;
+}
+
+// 写完 n 个字节后前移 iovec，返回请求是否已经全部写完
+static inline bool writer_advance(WriteRequest *r, size_t n) {
+    while (r->done < r->iov.size() && n >= r->iov[r->done].iov_len) {
+        n -= r->iov[r->done].iov_len;
+        r->done++;
+    }
+    if (r->done < r->iov.size()) {
+        r->iov[r->done].iov_base = static_cast<uint8_t *>(r->iov[r->done].iov_base) + n;
+        r->iov[r->done].iov_len -= n;
+        return false;
+    }
+    return true;
+}
+
+static inline void writer_release(WriteRequest *r) {
+    for (int i = 0; i < r->nb_refs; i++)
+        av_buffer_unref(&r->refs[i]);
+    r->nb_refs = 0;
+    r->iov.clear();
+    r->done = 0;
+}
+
+// 在当前线程上把请求全部写出
+static inline int writer_write_request(AsyncWriter *w, WriteRequest *r) {
+#ifndef _WIN32
+    while (r->done < r->iov.size()) {
+        int cnt = static_cast<int>(FFMIN(r->iov.size() - r->done, static_cast<size_t>(IOV_MAX)));
+        ssize_t n = r->offset >= 0 ? pwritev(w->fd, &r->iov[r->done], cnt, r->offset)
+                                   : writev(w->fd, &r->iov[r->done], cnt);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return AVERROR(errno);
+        }
+        if (r->offset >= 0)
+            r->offset += n;
+        writer_advance(r, static_cast<size_t>(n));
+    }
+#else
+    for (; r->done < r->iov.size(); r->done++) {
+        if (fwrite(r->iov[r->done].iov_base, 1, r->iov[r->done].iov_len, w->file) != r->iov[r->done].iov_len)
+            return AVERROR(EIO);
+    }
+#endif
+    return 0;
+}
+
+static inline void writer_set_error(AsyncWriter *w, int err) {
+    int expected = 0;
+    w->error.compare_exchange_strong(expected, err);
+}
+
+static inline void writer_thread(AsyncWriter *w) {
+    WriteRequest *r;
+    int ret;
+
+    trace_thread_name("writer");
+    while (w->pending.pop(&r, w->abort) && r) {
+        if (!w->error.load(std::memory_order_relaxed) && (ret = writer_write_request(w, r)) < 0)
+            writer_set_error(w, ret);
+        writer_release(r);
+        w->free_requests.push(r, w->abort);
+    }
+}
+
+#ifdef HAVE_IO_URING
+static inline void uring_teardown(UringRing *ring) {
+    if (ring->sqe_map && ring->sqe_map != MAP_FAILED)
+        munmap(ring->sqe_map, ring->sqe_map_size);
+    if (ring->cq_map && ring->cq_map != MAP_FAILED && ring->cq_map != ring->sq_map)
+        munmap(ring->cq_map, ring->cq_map_size);
+    if (ring->sq_map && ring->sq_map != MAP_FAILED)
+        munmap(ring->sq_map, ring->sq_map_size);
+    if (ring->fd >= 0)
+        close(ring->fd);
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+static inline int uring_setup(UringRing *ring, unsigned entries) {
+    struct io_uring_params p;
+    bool single_map = false;
+    uint8_t *sq, *cq;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    if ((ring->fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p))) < 0)
+        return AVERROR(errno);
+
+    ring->sq_map_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring->cq_map_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+#ifdef IORING_FEAT_SINGLE_MMAP
+    // 较新的内核上提交队列和完成队列在同一块映射里
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        single_map = true;
+        ring->sq_map_size = ring->cq_map_size = FFMAX(ring->sq_map_size, ring->cq_map_size);
+    }
+#endif
+    ring->sq_map = mmap(NULL, ring->sq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    ring->cq_map = single_map ? ring->sq_map
+                              : mmap(NULL, ring->cq_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring->fd, IORING_OFF_CQ_RING);
+    ring->sqe_map_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqe_map = mmap(NULL, ring->sqe_map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                         ring->fd, IORING_OFF_SQES);
+    if (ring->sq_map == MAP_FAILED || ring->cq_map == MAP_FAILED || ring->sqe_map == MAP_FAILED) {
+        int ret = AVERROR(errno);
+        uring_teardown(ring);
+        return ret;
+    }
+
+    sq = static_cast<uint8_t *>(ring->sq_map);
+    cq = static_cast<uint8_t *>(ring->cq_map);
+    ring->sq_tail = reinterpret_cast<unsigned *>(sq + p.sq_off.tail);
+    ring->sq_mask = reinterpret_cast<unsigned *>(sq + p.sq_off.ring_mask);
+    ring->sq_array = reinterpret_cast<unsigned *>(sq + p.sq_off.array);
+    ring->sqes = static_cast<struct io_uring_sqe *>(ring->sqe_map);
+    ring->cq_head = reinterpret_cast<unsigned *>(cq + p.cq_off.head);
+    ring->cq_tail = reinterpret_cast<unsigned *>(cq + p.cq_off.tail);
+    ring->cq_mask = reinterpret_cast<unsigned *>(cq + p.cq_off.ring_mask);
+    ring->cqes = reinterpret_cast<struct io_uring_cqe *>(cq + p.cq_off.cqes);
+    return 0;
+}
+
+static inline int uring_enter(UringRing *ring, unsigned to_submit, unsigned min_complete, unsigned flags) {
+    while (syscall(__NR_io_uring_enter, ring->fd, to_submit, min_complete, flags, NULL, 0) < 0) {
+        if (errno != EINTR)
+            return AVERROR(errno);
+    }
+    return 0;
+}
+
+/*
+ * 把请求剩下的部分提交到 io_uring。
+ * 在途请求数不超过 depth，而提交队列至少有 depth 项，所以提交队列不会满。
+ */
+static inline int uring_queue(AsyncWriter *w, WriteRequest *r) {
+    UringRing *ring = &w->ring;
+    unsigned tail = *ring->sq_tail;
+    unsigned idx = tail & *ring->sq_mask;
+    struct io_uring_sqe *sqe = &ring->sqes[idx];
+    int ret;
+
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_WRITEV;
+    sqe->fd = w->fd;
+    sqe->off = static_cast<uint64_t>(r->offset);
+    sqe->addr = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&r->iov[r->done]));
+    sqe->len = static_cast<unsigned>(FFMIN(r->iov.size() - r->done, static_cast<size_t>(IOV_MAX)));
+    sqe->user_data = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(r));
+    ring->sq_array[idx] = idx;
+    // 内核看到新的 tail 之前，提交项的内容必须已经写好
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    if ((ret = uring_enter(ring, 1, 0, 0)) < 0)
+        return ret;
+    w->inflight++;
+    return 0;
+}
+
+// 处理已经完成的写请求；wait 为真时至少等到一个请求完成
+static inline int uring_reap(AsyncWriter *w, bool wait) {
+    UringRing *ring = &w->ring;
+    unsigned head, tail;
+    int ret;
+
+    if (wait && (ret = uring_enter(ring, 0, 1, IORING_ENTER_GETEVENTS)) < 0)
+        return ret;
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        const struct io_uring_cqe *cqe = &ring->cqes[head & *ring->cq_mask];
+        WriteRequest *r = reinterpret_cast<WriteRequest *>(static_cast<uintptr_t>(cqe->user_data));
+        int res = cqe->res;
+
+        w->inflight--;
+        if (res == -EINTR || res == -EAGAIN)
+            res = 0;
+        else if (res == 0)
+            res = AVERROR(EIO);
+        if (res < 0) {
+            writer_set_error(w, res);
+        } else {
+            r->offset += res;
+            // 只写了一部分，或者 iovec 超过了一次提交的上限，接着提交剩下的
+            if (!writer_advance(r, static_cast<size_t>(res)) && !w->error.load(std::memory_order_relaxed)) {
+                if ((ret = uring_queue(w, r)) >= 0)
+                    continue;
+                writer_set_error(w, ret);
+            }
+        }
+        writer_release(r);
+        w->idle.push_back(r);
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    return 0;
+}
+#endif
+
+/*
+ * 为已经打开的文件创建写入器，之后这个文件的所有输出都要经过写入器。
+ * io_uring 需要按位置写入，输出不是普通文件或者内核不支持 io_uring 时改用写线程。
+ */
+static inline int writer_open(AsyncWriter **out, FILE *file, const WriterConfig *cfg) {
+    AsyncWriter *w = new AsyncWriter(FFMAX(cfg->depth, 1));
+
+    w->backend = cfg->backend;
+    w->file = file;
+#ifndef _WIN32
+    struct stat st;
+    // 之前经过 FILE 缓存写入的数据先落到文件里，之后直接写文件描述符
+    fflush(file);
+    w->fd = fileno(file);
+    if (fstat(w->fd, &st) == 0 && S_ISREG(st.st_mode))
+        w->offset = w->end = lseek(w->fd, 0, SEEK_CUR);
+#else
+    // Windows 上没有 pwritev()，都在写线程上按顺序经过 FILE 写入
+    if (w->backend == WRITER_URING)
+        w->backend = WRITER_THREAD;
+#endif
+
+    if (w->backend == WRITER_URING) {
+#ifdef HAVE_IO_URING
+        if (w->offset < 0) {
+            fprintf(stderr, "io_uring needs a regular output file, using a writer thread\n");
+            w->backend = WRITER_THREAD;
+        } else if (int ret = uring_setup(&w->ring, static_cast<unsigned>(w->requests.size()))) {
+            char errbuf[AV_ERROR_MAX_STRING_SIZE];
+            fprintf(stderr, "io_uring unavailable (%s), using a writer thread\n",
+                    av_make_error_string(errbuf, sizeof(errbuf), ret));
+            w->backend = WRITER_THREAD;
+        } else {
+            for (WriteRequest &r : w->requests)
+                w->idle.push_back(&r);
+        }
+#else
+        fprintf(stderr, "io_uring is not supported on this platform, using a writer thread\n");
+        w->backend = WRITER_THREAD;
+#endif
+    }
+
+    if (w->backend == WRITER_THREAD) {
+        for (WriteRequest &r : w->requests)
+            w->free_requests.push(&r, w->abort);
+        w->worker = std::thread(writer_thread, w);
+    }
+    *out = w;
+    return 0;
+}
+
+/*
+ * 取出一个空闲的写请求。在途请求达到 depth 时等待其中一个完成。
+ * 写入出错后返回 NULL，错误码由 writer_error() 取得。
+ */
+static inline WriteRequest *writer_request(AsyncWriter *w) {
+    WriteRequest *r = NULL;
+
+    switch (w->backend) {
+    case WRITER_SYNC:
+        r = &w->requests[0];
+        break;
+    case WRITER_THREAD:
+        w->free_requests.pop(&r, w->abort);
+        break;
+    case WRITER_URING:
+#ifdef HAVE_IO_URING
+        while (w->idle.empty()) {
+            int ret = uring_reap(w, true);
+            if (ret < 0) {
+                writer_set_error(w, ret);
+                return NULL;
+            }
+        }
+        r = w->idle.back();
+        w->idle.pop_back();
+#endif
+        break;
+    }
+    return r;
+}
+
+static inline int writer_error(const AsyncWriter *w) {
+    return w->error.load();
+}
+
+// 引用 buf，保证请求写完之前缓存不被释放
+static inline int writer_ref(WriteRequest *r, AVBufferRef *buf) {
+    if (r->nb_refs == AV_NUM_DATA_POINTERS)
+        return AVERROR(EINVAL);
+    if (!(r->refs[r->nb_refs] = av_buffer_ref(buf)))
+        return AVERROR(ENOMEM);
+    r->nb_refs++;
+    return 0;
+}
+
+// 引用帧的全部缓存；映射出来的硬件帧的缓存还持有映射，写完之前映射不会解除
+static inline int writer_ref_frame(WriteRequest *r, const AVFrame *frame) {
+    int ret;
+
+    for (int i = 0; i < AV_NUM_DATA_POINTERS && frame->buf[i]; i++) {
+        if ((ret = writer_ref(r, frame->buf[i])) < 0)
+            return ret;
+    }
+    return 0;
+}
+
+static inline void writer_add(WriteRequest *r, const void *data, size_t size) {
+    struct iovec iov;
+
+    if (!size)
+        return;
+    iov.iov_base = const_cast<void *>(data);
+    iov.iov_len = size;
+    r->iov.push_back(iov);
+}
+
+/*
+ * 提交写请求，请求交给写入器后调用方不能再访问。
+ * 返回之前的写请求中出现的第一个错误，这个请求本身的结果要到后面的调用或者 writer_close() 才知道。
+ */
+static inline int writer_submit(AsyncWriter *w, WriteRequest *r) {
+    int ret;
+
+    r->done = 0;
+    r->offset = w->offset;
+    if (w->offset >= 0) {
+        w->offset += static_cast<int64_t>(writer_request_size(r));
+        w->end = FFMAX(w->end, w->offset);
+    }
+    if (w->error.load(std::memory_order_relaxed) || r->iov.empty()) {
+        writer_release(r);
+        if (w->backend == WRITER_THREAD)
+            w->free_requests.push(r, w->abort);
+#ifdef HAVE_IO_URING
+        else if (w->backend == WRITER_URING)
+            w->idle.push_back(r);
+#endif
+        return writer_error(w);
+    }
+
+    switch (w->backend) {
+    case WRITER_SYNC:
+        if ((ret = writer_write_request(w, r)) < 0)
+            writer_set_error(w, ret);
+        writer_release(r);
+        break;
+    case WRITER_THREAD:
+        w->pending.push(r, w->abort);
+        break;
+    case WRITER_URING:
+#ifdef HAVE_IO_URING
+        if ((ret = uring_queue(w, r)) < 0) {
+            writer_set_error(w, ret);
+            writer_release(r);
+            w->idle.push_back(r);
+        }
+        // 顺便处理已经完成的请求，尽早把缓存还给缓存池
+        else if ((ret = uring_reap(w, false)) < 0) {
+            writer_set_error(w, ret);
+        }
+#endif
+        break;
+    }
+    return writer_error(w);
+}
+
+// 引用压缩包的数据写出；数据没有引用计数时拷贝一份
+static inline int writer_write_packet(AsyncWriter *w, const AVPacket *pkt) {
+    WriteRequest *r;
+    int ret;
+
+    if (!(r = writer_request(w)))
+        return writer_error(w);
+    if (pkt->buf) {
+        ret = writer_ref(r, pkt->buf);
+    } else {
+        AVBufferRef *buf = av_buffer_alloc(pkt->size);
+        ret = buf ? writer_ref(r, buf) : AVERROR(ENOMEM);
+        if (buf)
+            memcpy(buf->data, pkt->data, pkt->size);
+        av_buffer_unref(&buf);
+    }
+    if (ret < 0) {
+        writer_submit(w, r);
+        return ret;
+    }
+    writer_add(r, pkt->buf ? pkt->data : r->refs[0]->data, pkt->size);
+    return writer_submit(w, r);
+}
+
+// 写出 buf 中从 data 开始的 size 个字节
+static inline int writer_write_buffer(AsyncWriter *w, AVBufferRef *buf, const uint8_t *data, size_t size) {
+    WriteRequest *r;
+    int ret;
+
+    if (!(r = writer_request(w)))
+        return writer_error(w);
+    if ((ret = writer_ref(r, buf)) < 0) {
+        writer_submit(w, r);
+        return ret;
+    }
+    writer_add(r, data, size);
+    return writer_submit(w, r);
+}
+
+// 拷贝一份数据再写出，用于文件头尾等调用方不保留的小块数据
+static inline int writer_write_data(AsyncWriter *w, const void *data, size_t size) {
+    AVBufferRef *buf = av_buffer_alloc(static_cast<int>(size));
+    int ret;
+
+    if (!buf)
+        return AVERROR(ENOMEM);
+    memcpy(buf->data, data, size);
+    ret = writer_write_buffer(w, buf, buf->data, size);
+    av_buffer_unref(&buf);
+    return ret;
+}
+
+// 等待全部在途的写请求完成，返回写入过程中的第一个错误
+static inline int writer_drain(AsyncWriter *w) {
+    if (w->backend == WRITER_THREAD) {
+        // 取回全部请求就说明写线程手上已经没有请求了，再原样放回去
+        std::vector<WriteRequest *> held;
+        WriteRequest *r;
+        while (held.size() < w->requests.size() && w->free_requests.pop(&r, w->abort))
+            held.push_back(r);
+        for (WriteRequest *req : held)
+            w->free_requests.push(req, w->abort);
+    }
+#ifdef HAVE_IO_URING
+    if (w->backend == WRITER_URING) {
+        while (w->inflight > 0) {
+            int ret = uring_reap(w, true);
+            if (ret < 0) {
+                writer_set_error(w, ret);
+                break;
+            }
+        }
+    }
+#endif
+    return writer_error(w);
+}
+
+/*
+ * 把之后的写请求移到 offset 处，用于改写已经写出的文件头等。
+ * 先等在途的写全部完成：请求可能以任意顺序完成，新请求与在途请求的写入范围重叠时内容就不确定了。
+ * 输出不可定位时返回 AVERROR(ESPIPE)。
+ */
+static inline int writer_seek(AsyncWriter *w, int64_t offset) {
+    int ret;
+
+    if (w->offset < 0)
+        return AVERROR(ESPIPE);
+    if ((ret = writer_drain(w)) < 0)
+        return ret;
+    w->offset = offset;
+    return 0;
+}
+
+/*
+ * 等待全部在途的写请求完成，释放写入器。
+ * 返回写入过程中的第一个错误；文件本身仍由调用方关闭。
+ */
+static inline int writer_close(AsyncWriter **pw) {
+    AsyncWriter *w = *pw;
+    int ret;
+
+    if (!w)
+        return 0;
+    if (w->backend == WRITER_THREAD) {
+        w->pending.push(NULL, w->abort);
+        w->worker.join();
+    }
+#ifdef HAVE_IO_URING
+    if (w->backend == WRITER_URING) {
+        while (w->inflight > 0) {
+            if ((ret = uring_reap(w, true)) < 0) {
+                writer_set_error(w, ret);
+                break;
+            }
+        }
+        uring_teardown(&w->ring);
+    }
+#endif
+#ifndef _WIN32
+    // pwritev() 不移动文件位置，关闭前移到已写数据的末尾
+    if (w->end >= 0)
+        lseek(w->fd, w->end, SEEK_SET);
+#endif
+    ret = writer_error(w);
+    delete w;
+    *pw = NULL;
+    return ret;
+}
+
+#endif // FFMPEG_EXAMPLE_ASYNC_WRITER_H
@@ -0,0 +1,130 @@
+/**
+ * @file
+ * ffmpeg_example_core: warm codec context and hardware device cache
+ */
+
+#include <stdio.h>
+
+#include "context_pool.h"
+
+// 查找解码器，结果缓存在池中，调用时必须持有 pool->lock
+static int pool_find_codec(ContextPool *pool, const ContextKey *key, const AVCodec **codec) {
+    auto it = pool->codecs.find(key->codec);
+    int ret;
+
+    if (it != pool->codecs.end()) {
+        *codec = it->second;
+        return 0;
+    }
+    if ((ret = core_find_codec(key->codec.c_str(), false, codec)) < 0)
+        return ret;
+    pool->codecs[key->codec] = *codec;
+    return 0;
+}
+
+// 创建并打开一个上下文，可能很慢，不能持有 pool->lock
+static int pool_open(const ContextKey *key, const AVCodec *codec, WarmContext *out) {
+    CodecContextPtr c;
+    ParserPtr parser;
+    int ret;
+
+    if ((ret = core_decoder_alloc(&c, codec, key->thread_count, key->thread_type)) < 0)
+        return ret;
+    if ((ret = avcodec_open2(c.get(), codec, NULL)) < 0)
+        return ret;
+    if (key->parser && !(parser = ParserPtr(av_parser_init(codec->id))))
+        return AVERROR(ENOSYS);
+
+    out->key = *key;
+    out->codec = codec;
+    out->ctx = std::move(c);
+    out->parser = std::move(parser);
+    return 0;
+}
+
+// 放进空闲列表，超过 max_idle 时丢弃，调用时必须持有 pool->lock
+static void pool_keep(ContextPool *pool, WarmContext *ctx) {
+    std::vector<WarmContext> &list = pool->idle[ctx->key];
+
+    if (list.size() < pool->max_idle)
+        list.push_back(std::move(*ctx));
+}
+
+int context_pool_alloc(ContextPool **pool, size_t max_idle) {
+    ContextPool *p = new ContextPool;
+
+    p->max_idle = FFMAX(max_idle, static_cast<size_t>(1));
+    *pool = p;
+    return 0;
+}
+
+int context_pool_get(ContextPool *pool, const ContextKey *key, WarmContext *out) {
+    const AVCodec *codec;
+    int ret;
+
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        auto it = pool->idle.find(*key);
+        if (it != pool->idle.end() && !it->second.empty()) {
+            *out = std::move(it->second.back());
+            it->second.pop_back();
+            pool->hits++;
+            return 0;
+        }
+        pool->misses++;
+        if ((ret = pool_find_codec(pool, key, &codec)) < 0)
+            return ret;
+    }
+    return pool_open(key, codec, out);
+}
+
+void context_pool_put(ContextPool *pool, WarmContext *ctx) {
+    AVCodecContext *c = ctx->ctx.get();
+
+    if (!c)
+        return;
+
+    avcodec_flush_buffers(c);
+    c->skip_frame = AVDISCARD_DEFAULT;
+    c->skip_loop_filter = AVDISCARD_DEFAULT;
+    c->skip_idct = AVDISCARD_DEFAULT;
+    c->opaque = NULL;
+    // parser 没有清空的接口，换一个新的，这一步在归还时做，不占用下一次取出的时间
+    if (ctx->key.parser && !(ctx->parser = ParserPtr(av_parser_init(ctx->codec->id))))
+        return;
+
+    std::lock_guard<std::mutex> guard(pool->lock);
+    pool_keep(pool, ctx);
+}
+
+int context_pool_hw_device(ContextPool *pool, enum AVHWDeviceType type, const char *device, AVBufferRef **ref) {
+    std::lock_guard<std::mutex> guard(pool->device_lock);
+    std::string name = std::string(av_hwdevice_get_type_name(type)) + ":" + (device ? device : "");
+    AVBufferRef *&cached = pool->devices[name];
+    int ret;
+
+    // 设备创建很慢，同一个设备并发请求时后来的线程等待第一个创建完成
+    if (!cached && (ret = av_hwdevice_ctx_create(&cached, type, device, NULL, 0)) < 0) {
+        pool->devices.erase(name);
+        return ret;
+    }
+    if (!(*ref = av_buffer_ref(cached)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+void context_pool_report(const ContextPool *pool, const char *prefix) {
+    fprintf(stderr, "%s: context pool %llu hits, %llu misses\n", prefix,
+            static_cast<unsigned long long>(pool->hits), static_cast<unsigned long long>(pool->misses));
+}
+
+void context_pool_free(ContextPool **pool) {
+    ContextPool *p = *pool;
+
+    if (!p)
+        return;
+    for (auto &it : p->devices)
+        av_buffer_unref(&it.second);
+    delete p;
+    *pool = NULL;
+}
@@ -0,0 +1,106 @@
+/**
+ * @file
+ * warm codec context and hardware device cache of the ffmpeg_example_core library
+ */
+
+#ifndef FFMPEG_EXAMPLE_CONTEXT_POOL_H
+#define FFMPEG_EXAMPLE_CONTEXT_POOL_H
+
+#include <stdint.h>
+
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "core.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/hwcontext.h>
+}
+
+struct ParserDeleter {
+    void operator()(AVCodecParserContext *parser) const { av_parser_close(parser); }
+};
+
+typedef std::unique_ptr<AVCodecParserContext, ParserDeleter> ParserPtr;
+
+/*
+ * 池中解码上下文的键，键相同的上下文可以互相替换。
+ * 打开之后还能修改的参数（skip_frame、opaque 等）不在键里，由调用方每次取出后重新设置。
+ * FFmpeg 4.1 的编码器清空之后不能再送入新的帧，没有可以复用的状态，所以池中只有解码器。
+ */
+typedef struct ContextKey {
+    std::string codec;
+    // 是否同时需要一个 parser
+    bool parser;
+    int thread_count;
+    int thread_type;
+} ContextKey;
+
+static inline bool operator<(const ContextKey &a, const ContextKey &b) {
+    return std::tie(a.codec, a.parser, a.thread_count, a.thread_type) <
+           std::tie(b.codec, b.parser, b.thread_count, b.thread_type);
+}
+
+static inline ContextKey decoder_key(const char *codec, bool parser, int thread_count, int thread_type) {
+    return {codec, parser, thread_count, thread_type};
+}
+
+// 从池中取出的已打开的上下文，用完后整个交回 context_pool_put()
+typedef struct WarmContext {
+    ContextKey key;
+    const AVCodec *codec;
+    CodecContextPtr ctx;
+    ParserPtr parser;
+} WarmContext;
+
+struct ContextPool {
+    std::mutex lock;
+    // 空闲的上下文，每个键最多保留 max_idle 个
+    std::map<ContextKey, std::vector<WarmContext>> idle;
+    size_t max_idle = 0;
+    // 按名称查找过的解码器，avcodec_find_decoder_by_name() 每次都要遍历全部编解码器
+    std::map<std::string, const AVCodec *> codecs;
+
+    // 硬件设备按 "类型:设备" 缓存，池本身持有一个引用
+    std::mutex device_lock;
+    std::map<std::string, AVBufferRef *> devices;
+
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+};
+
+// 创建上下文池，每个键最多缓存 max_idle 个空闲上下文
+int context_pool_alloc(ContextPool **pool, size_t max_idle);
+
+/*
+ * 取出一个键为 key 的已打开的上下文，没有空闲的就当场创建并打开。
+ * 出错时返回错误码；取出的上下文用 context_pool_put() 归还，出了错的上下文直接丢弃即可，析构时释放。
+ */
+int context_pool_get(ContextPool *pool, const ContextKey *key, WarmContext *out);
+
+/*
+ * 归还一个上下文。
+ * 用 avcodec_flush_buffers() 清空（清空之后可以继续解码下一段码流），skip_frame 等恢复默认值，
+ * parser 换成新的，留给下一次取出。
+ */
+void context_pool_put(ContextPool *pool, WarmContext *ctx);
+
+/*
+ * 取得一个硬件设备的新引用（调用方负责 av_buffer_unref()），同一类型和设备只创建一次。
+ * device 为空时使用默认设备。
+ */
+int context_pool_hw_device(ContextPool *pool, enum AVHWDeviceType type, const char *device, AVBufferRef **ref);
+
+// 输出命中次数统计
+void context_pool_report(const ContextPool *pool, const char *prefix);
+
+// 释放池中的全部上下文和设备，*pool 置空
+void context_pool_free(ContextPool **pool);
+
+#endif // FFMPEG_EXAMPLE_CONTEXT_POOL_H
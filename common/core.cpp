@@ -0,0 +1,262 @@
+/**
+ * @file
+ * ffmpeg_example_core: shared codec code linked by the examples
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "core.h"
+
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+extern "C" {
+#include <libavutil/cpu.h>
+#include <libavutil/opt.h>
+}
+
+#ifdef __linux__
+// 解析 /sys 下 "0-7,16-23" 形式的 CPU 列表
+static void parse_cpulist(const char *list, cpu_set_t *set) {
+    const char *p = list;
+
+    CPU_ZERO(set);
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last;
+        if (end == p)
+            break;
+        last = first;
+        if (*end == '-')
+            last = strtol(end + 1, &end, 10);
+        for (long cpu = first; cpu <= last && cpu < CPU_SETSIZE; cpu++)
+            CPU_SET(cpu, set);
+        p = *end == ',' ? end + 1 : end;
+        if (*p == '\n')
+            break;
+    }
+}
+
+/*
+ * 把当前线程绑定到它所在 NUMA 节点的 CPU 上，返回绑定后可用的 CPU 个数，失败时返回 -1。
+ * 之后由 avcodec_open2() 创建的编解码线程会继承这个绑定关系。
+ */
+static int bind_numa_node(void) {
+    cpu_set_t allowed, node_cpus;
+    char path[64], list[4096];
+    int cpu = sched_getcpu();
+
+    if (cpu < 0 || sched_getaffinity(0, sizeof(allowed), &allowed) < 0)
+        return -1;
+    for (int node = 0;; node++) {
+        FILE *f;
+        snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist", node);
+        if (!(f = fopen(path, "r")))
+            return -1;
+        if (!fgets(list, sizeof(list), f))
+            list[0] = 0;
+        fclose(f);
+        parse_cpulist(list, &node_cpus);
+        if (!CPU_ISSET(cpu, &node_cpus))
+            continue;
+        CPU_AND(&node_cpus, &node_cpus, &allowed);
+        if (sched_setaffinity(0, sizeof(node_cpus), &node_cpus) < 0)
+            return -1;
+        return CPU_COUNT(&node_cpus);
+    }
+}
+#endif
+
+int resolve_thread_count(const char *arg) {
+#ifdef __linux__
+    cpu_set_t allowed;
+    int n;
+
+    if (!strcmp(arg, "numa")) {
+        if ((n = bind_numa_node()) > 0)
+            return n;
+        fprintf(stderr, "Could not bind to the current NUMA node, using all available CPUs\n");
+        arg = "auto";
+    }
+    if (!strcmp(arg, "auto")) {
+        if (sched_getaffinity(0, sizeof(allowed), &allowed) == 0)
+            return CPU_COUNT(&allowed);
+        return av_cpu_count();
+    }
+#else
+    if (!strcmp(arg, "auto") || !strcmp(arg, "numa"))
+        return av_cpu_count();
+#endif
+    return atoi(arg);
+}
+
+int parse_thread_type(const char *arg) {
+    if (!strcmp(arg, "frame"))
+        return FF_THREAD_FRAME;
+    if (!strcmp(arg, "slice"))
+        return FF_THREAD_SLICE;
+    if (!strcmp(arg, "both"))
+        return FF_THREAD_FRAME | FF_THREAD_SLICE;
+    return -1;
+}
+
+const char *thread_type_name(int thread_type) {
+    switch (thread_type) {
+    case FF_THREAD_FRAME:
+        return "frame";
+    case FF_THREAD_SLICE:
+        return "slice";
+    case FF_THREAD_FRAME | FF_THREAD_SLICE:
+        return "both";
+    default:
+        return "none";
+    }
+}
+
+bool thread_type_supported(const AVCodec *codec, int thread_type) {
+    return !(thread_type & FF_THREAD_FRAME && !(codec->capabilities & AV_CODEC_CAP_FRAME_THREADS)) &&
+           !(thread_type & FF_THREAD_SLICE && !(codec->capabilities & AV_CODEC_CAP_SLICE_THREADS));
+}
+
+int core_find_codec(const char *name, bool encoder, const AVCodec **codec) {
+    *codec = encoder ? avcodec_find_encoder_by_name(name) : avcodec_find_decoder_by_name(name);
+    if (!*codec)
+        return encoder ? AVERROR_ENCODER_NOT_FOUND : AVERROR_DECODER_NOT_FOUND;
+    return 0;
+}
+
+void encoder_set_defaults(AVCodecContext *c, const AVCodec *codec, int width, int height, AVRational framerate) {
+    /* 设置比特率 */
+    c->bit_rate = 400000;
+    /* 设置分辨率 */
+    c->width = width;
+    c->height = height;
+    // 设置fps，time_base 是 framerate 的倒数
+    c->time_base = av_inv_q(framerate);
+    c->framerate = framerate;
+    // GOP大小
+    c->gop_size = 10;
+    // 两个非B帧之间的B帧最大数目（设为0表示不会有B帧）
+    c->max_b_frames = 0;
+
+    // H264编码时还可以调节编码速度从而调整压缩质量，这里把编码速度设置为slow
+    if (codec->id == AV_CODEC_ID_H264)
+        av_opt_set(c->priv_data, "preset", "slow", 0);
+}
+
+void encoder_set_low_latency(AVCodecContext *c, const AVCodec *codec) {
+    // 没有 B 帧时编码器不需要为重排序缓存后面的帧，送入一帧就能取出这一帧的压缩包
+    c->max_b_frames = 0;
+    // 只有 mpeg2video 编码器支持 LOW_DELAY，mpeg1video、mpeg4、h263 等遇到这个标志时 avcodec_open2() 会失败
+    if (codec->id == AV_CODEC_ID_MPEG2VIDEO)
+        c->flags |= AV_CODEC_FLAG_LOW_DELAY;
+    // 帧级多线程每个线程都要多缓存一帧，片级多线程把一帧切成多个 slice 并行编码，不增加延迟
+    c->thread_type = FF_THREAD_SLICE;
+
+    if (codec->id != AV_CODEC_ID_H264)
+        return;
+    if (strstr(codec->name, "nvenc")) {
+        // h264_nvenc 的私有选项与 libx264 不同：zerolatency 不缓存重排序用的帧，delay 为 0 时送入一帧就输出
+        av_opt_set_int(c->priv_data, "zerolatency", 1, 0);
+        av_opt_set_int(c->priv_data, "delay", 0, 0);
+    } else if (!strcmp(codec->name, "libx264")) {
+        // libx264：zerolatency 关闭前瞻和 B 帧，并使用 sliced threads；slow 预设单帧耗时太长
+        av_opt_set(c->priv_data, "preset", "veryfast", 0);
+        av_opt_set(c->priv_data, "tune", "zerolatency", 0);
+        av_opt_set_int(c->priv_data, "rc-lookahead", 0, 0);
+        // 帧内刷新把 I 帧的码率摊到整个 GOP 的各帧上，不会每隔 gop_size 帧出现一个大包
+        av_opt_set_int(c->priv_data, "intra-refresh", 1, 0);
+    }
+}
+
+int core_encoder_alloc(CodecContextPtr *out, const AVCodec *codec, int width, int height, AVRational framerate) {
+    CodecContextPtr c(avcodec_alloc_context3(codec));
+
+    if (!c)
+        return AVERROR(ENOMEM);
+    encoder_set_defaults(c.get(), codec, width, height, framerate);
+    *out = std::move(c);
+    return 0;
+}
+
+int core_decoder_alloc(CodecContextPtr *out, const AVCodec *codec, int thread_count, int thread_type) {
+    CodecContextPtr c(avcodec_alloc_context3(codec));
+
+    if (!c)
+        return AVERROR(ENOMEM);
+    c->thread_count = thread_count;
+    if (thread_type)
+        c->thread_type = thread_type;
+    *out = std::move(c);
+    return 0;
+}
+
+int core_encode(AVCodecContext *c, const AVFrame *frame, AVPacket *pkt, const PacketCallback &cb,
+                const CodecTimers *timers) {
+    int64_t t;
+    int ret;
+
+    // 发送帧到编码器
+    t = stats_now();
+    ret = avcodec_send_frame(c, frame);
+    if (timers && timers->send)
+        latency_record(timers->send, t);
+    if (ret < 0)
+        return ret;
+
+    while (true) {
+        /*
+         * 当函数返回 0，表示编码成功，此时pkt中存储了压缩帧数据。
+         * 当函数返回 AVERROR(EAGAIN)，表示编码器需要接收更多的输入帧以填满缓冲区为止，再对缓冲区进行压缩
+         * 当函数返回 AVERROR_EOF，表示到达了数据流末尾，没有可编码的数据了
+         */
+        t = stats_now();
+        ret = avcodec_receive_packet(c, pkt);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
+        if (timers && timers->receive)
+            latency_record(timers->receive, t);
+        ret = cb(pkt);
+        av_packet_unref(pkt);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+int core_decode(AVCodecContext *c, const AVPacket *pkt, AVFrame *frame, const FrameCallback &cb,
+                const CodecTimers *timers) {
+    int64_t t;
+    int ret;
+
+    // 向解码器发送压缩包
+    t = stats_now();
+    ret = avcodec_send_packet(c, pkt);
+    if (timers && timers->send)
+        latency_record(timers->send, t);
+    if (ret < 0)
+        return ret;
+
+    while (true) {
+        /*
+         * 当函数返回 0，表示解码成功，此时frame中存储了帧数据。
+         * 当函数返回 AVERROR(EAGAIN)，表示解码器需要接收更多的压缩包才能进行下一帧解码。
+         * 当函数返回 AVERROR_EOF，表示解码器缓冲区已经被清空，没有任何数据可以解码成帧。
+         * 其余返回值都是解码异常。
+         */
+        t = stats_now();
+        ret = avcodec_receive_frame(c, frame);
+        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+            return 0;
+        if (ret < 0)
+            return ret;
+        if (timers && timers->receive)
+            latency_record(timers->receive, t);
+        if ((ret = cb(frame)) < 0)
+            return ret;
+    }
+}
@@ -0,0 +1,126 @@
+/**
+ * @file
+ * codec setup, send/receive loops and ownership wrappers of the ffmpeg_example_core library
+ */
+
+#ifndef FFMPEG_EXAMPLE_CORE_H
+#define FFMPEG_EXAMPLE_CORE_H
+
+#include <functional>
+#include <memory>
+
+#include "stats.h"
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+}
+
+/*
+ * FFmpeg 对象的所有权包装。
+ * 都是 std::unique_ptr，只能移动不能复制，离开作用域时用对应的释放函数释放；
+ * 传给 FFmpeg 函数时用 get()，把所有权交给别处时用 release()。
+ */
+struct CodecContextDeleter {
+    void operator()(AVCodecContext *c) const { avcodec_free_context(&c); }
+};
+
+struct FrameDeleter {
+    void operator()(AVFrame *frame) const { av_frame_free(&frame); }
+};
+
+struct PacketDeleter {
+    void operator()(AVPacket *pkt) const { av_packet_free(&pkt); }
+};
+
+struct BufferRefDeleter {
+    void operator()(AVBufferRef *buf) const { av_buffer_unref(&buf); }
+};
+
+typedef std::unique_ptr<AVCodecContext, CodecContextDeleter> CodecContextPtr;
+typedef std::unique_ptr<AVFrame, FrameDeleter> FramePtr;
+typedef std::unique_ptr<AVPacket, PacketDeleter> PacketPtr;
+typedef std::unique_ptr<AVBufferRef, BufferRefDeleter> BufferRefPtr;
+
+// 分配失败时返回空指针
+static inline FramePtr core_frame_alloc() {
+    return FramePtr(av_frame_alloc());
+}
+
+static inline PacketPtr core_packet_alloc() {
+    return PacketPtr(av_packet_alloc());
+}
+
+static inline BufferRefPtr core_buffer_ref(AVBufferRef *buf) {
+    return BufferRefPtr(av_buffer_ref(buf));
+}
+
+/*
+ * 根据命令行参数确定线程数：
+ * "auto" 按进程实际可用的 CPU 个数（会受 taskset、cgroup cpuset 等限制）；
+ * "numa" 先把当前线程绑定到所在的 NUMA 节点，再按该节点上的 CPU 个数；
+ * 数字则直接使用，0 表示交给 libavcodec 自己决定。
+ */
+int resolve_thread_count(const char *arg);
+
+// "frame" / "slice" / "both" 转成 FF_THREAD_* 组合，不认识时返回 -1
+int parse_thread_type(const char *arg);
+const char *thread_type_name(int thread_type);
+// 编解码器是否支持 thread_type 中的全部多线程方式
+bool thread_type_supported(const AVCodec *codec, int thread_type);
+
+/*
+ * 按名称查找编码器或解码器。
+ * 找不到时返回 AVERROR_ENCODER_NOT_FOUND / AVERROR_DECODER_NOT_FOUND。
+ */
+int core_find_codec(const char *name, bool encoder, const AVCodec **codec);
+
+/*
+ * 设置 video_encode 和 video_hw_decode 转码模式共用的编码参数，必须在 avcodec_open2() 之前调用。
+ * 像素格式（以及硬件编码时的 hw_frames_ctx）由调用方根据输入帧设置。
+ */
+void encoder_set_defaults(AVCodecContext *c, const AVCodec *codec, int width, int height, AVRational framerate);
+
+/*
+ * 低延迟直播用的编码参数，在 encoder_set_defaults() 之后、avcodec_open2() 之前调用：
+ * 不用 B 帧和前瞻，片级多线程代替帧级多线程；libx264 用 zerolatency 调优并以帧内刷新代替周期性的 IDR 帧，
+ * h264_nvenc 等硬件编码器设置各自的零延迟选项。私有选项按编码器名字选择，其他编码器只设置通用参数。
+ */
+void encoder_set_low_latency(AVCodecContext *c, const AVCodec *codec);
+
+// 创建编码上下文并设置默认编码参数，调用方补充像素格式等参数后自己调用 avcodec_open2()
+int core_encoder_alloc(CodecContextPtr *out, const AVCodec *codec, int width, int height, AVRational framerate);
+
+/*
+ * 创建解码上下文并设置多线程参数，thread_type 为 0 时保持 libavcodec 的默认值。
+ * 调用方补充 skip_frame 等参数后自己调用 avcodec_open2()。
+ */
+int core_decoder_alloc(CodecContextPtr *out, const AVCodec *codec, int thread_count, int thread_type);
+
+// 收到一个压缩包或一帧时的回调，返回负数时停止收取并把这个值作为结果返回
+typedef std::function<int(AVPacket *)> PacketCallback;
+typedef std::function<int(AVFrame *)> FrameCallback;
+
+// 送入和取出两步的耗时统计，为空的直方图不记录
+typedef struct CodecTimers {
+    LatencyHistogram *send;
+    LatencyHistogram *receive;
+} CodecTimers;
+
+/*
+ * 把一帧送进编码器，并取出全部可用的压缩包，每个包调用一次 cb，回调返回后包被解除引用。
+ * frame 为空时清空编码器。成功返回 0，失败返回错误码，不会退出进程。
+ */
+int core_encode(AVCodecContext *c, const AVFrame *frame, AVPacket *pkt, const PacketCallback &cb,
+                const CodecTimers *timers = NULL);
+
+/*
+ * 把压缩包送进解码器，并取出全部可用的帧，每帧调用一次 cb。
+ * 回调之后 frame 会被下一次 avcodec_receive_frame() 覆盖，要保留时用 av_frame_move_ref() 取走。
+ * pkt 为空时清空解码器。成功返回 0，失败返回错误码，不会退出进程。
+ */
+int core_decode(AVCodecContext *c, const AVPacket *pkt, AVFrame *frame, const FrameCallback &cb,
+                const CodecTimers *timers = NULL);
+
+#endif // FFMPEG_EXAMPLE_CORE_H
@@ -0,0 +1,55 @@
+/**
+ * @file
+ * runtime selection of C, AVX2 and NEON kernel tables, shared by the examples
+ */
+
+#ifndef FFMPEG_EXAMPLE_CPU_DISPATCH_H
+#define FFMPEG_EXAMPLE_CPU_DISPATCH_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_AVX2_KERNELS 1
+#endif
+#if defined(__ARM_NEON) || defined(__aarch64__)
+#include <arm_neon.h>
+#define HAVE_NEON_KERNELS 1
+#endif
+
+extern "C" {
+#include <libavutil/cpu.h>
+}
+
+/*
+ * 内核表中的每一项都以 name（"avx2"、"neon"、"c"）和 cpu_flags（需要的 AV_CPU_FLAG_*，C 版本为 0）开头，
+ * 按优先顺序排列，最后一项是 C 版本。
+ */
+template <typename DSP>
+static inline bool cpu_dispatch_usable(const DSP &dsp) {
+    return (av_get_cpu_flags() & dsp.cpu_flags) == dsp.cpu_flags;
+}
+
+// 返回当前 CPU 能运行的第一项，调用方用函数内的静态变量保存，只选一次
+template <typename DSP, size_t N>
+static inline const DSP *cpu_dispatch(const DSP (&dsps)[N]) {
+    for (const DSP &dsp : dsps)
+        if (cpu_dispatch_usable(dsp))
+            return &dsp;
+    return &dsps[N - 1];
+}
+
+// 对比各版本内核输出时使用的确定性输入
+static inline void cpu_check_fill(uint8_t *buf, size_t n, uint64_t seed) {
+    uint64_t x = seed * 0x9e3779b97f4a7c15ULL + 1;
+
+    for (size_t i = 0; i < n; i++) {
+        x ^= x << 13;
+        x ^= x >> 7;
+        x ^= x << 17;
+        buf[i] = static_cast<uint8_t>(x >> 56);
+    }
+}
+
+#endif // FFMPEG_EXAMPLE_CPU_DISPATCH_H
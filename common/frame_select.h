@@ -0,0 +1,127 @@
+/**
+ * @file
+ * output frame selection shared by video_decode and video_hw_decode
+ */
+
+#ifndef FFMPEG_EXAMPLE_FRAME_SELECT_H
+#define FFMPEG_EXAMPLE_FRAME_SELECT_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+#define FRAME_SELECT_OPTIONS_HELP \
+    "  --keyframes          only decode and output keyframes; the decoder skips every other frame\n" \
+    "  --every <n>          output every n-th frame; non-reference frames are dropped at the decoder\n" \
+    "                       first, so n counts the frames the decoder still produces\n" \
+    "  --range <a-b,...>    only output frames whose time (seconds) is in one of the ranges;\n" \
+    "                       decoding stops after the last range\n"
+
+typedef struct FrameRange {
+    double start, end;
+} FrameRange;
+
+/*
+ * 选择要输出的帧。
+ * 能在解码器里丢掉的帧（非关键帧、非参考帧）通过 skip_frame 直接不解码，其余不需要的帧解码后不下载、不写出。
+ */
+typedef struct FrameSelect {
+    int keyframes_only;
+    int every;
+    // 按开始时间排序的时间段（秒）
+    std::vector<FrameRange> ranges;
+    double last_end;
+
+    // 经过关键帧和时间段筛选后的帧数，用于 --every 计数
+    int64_t candidates;
+    // 已经过了最后一个时间段，后面的帧都不再需要
+    bool finished;
+} FrameSelect;
+
+static inline bool frame_select_active(const FrameSelect *sel) {
+    return sel->keyframes_only || sel->every > 1 || !sel->ranges.empty();
+}
+
+static inline int frame_select_parse_ranges(const char *arg, std::vector<FrameRange> *ranges) {
+    const char *p = arg;
+
+    while (*p) {
+        char *end;
+        FrameRange r;
+        r.start = strtod(p, &end);
+        if (end == p || *end != '-')
+            return -1;
+        p = end + 1;
+        r.end = strtod(p, &end);
+        if (end == p || r.end < r.start || (*end && *end != ','))
+            return -1;
+        ranges->push_back(r);
+        p = *end ? end + 1 : end;
+    }
+    std::sort(ranges->begin(), ranges->end(),
+              [](const FrameRange &a, const FrameRange &b) { return a.start < b.start; });
+    return ranges->empty() ? -1 : 0;
+}
+
+/*
+ * 处理帧选择相关的命令行参数，*i 指向当前参数，消耗了参数值时前移。
+ * 不是帧选择参数时返回 0；参数值不合法时直接退出。
+ */
+static inline int frame_select_parse_option(int argc, char **argv, int *i, FrameSelect *sel) {
+    if (!strcmp(argv[*i], "--keyframes")) {
+        sel->keyframes_only = 1;
+    } else if (!strcmp(argv[*i], "--every") && *i + 1 < argc) {
+        sel->every = atoi(argv[++*i]);
+    } else if (!strcmp(argv[*i], "--range") && *i + 1 < argc) {
+        if (frame_select_parse_ranges(argv[++*i], &sel->ranges) < 0) {
+            fprintf(stderr, "Invalid range list '%s'\n", argv[*i]);
+            exit(1);
+        }
+        for (const FrameRange &r : sel->ranges)
+            sel->last_end = FFMAX(sel->last_end, r.end);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// 在 avcodec_open2() 之前调用，把能在解码器里丢掉的帧交给 skip_frame
+static inline void frame_select_apply(const FrameSelect *sel, AVCodecContext *c) {
+    if (sel->keyframes_only)
+        c->skip_frame = AVDISCARD_NONKEY;
+    else if (sel->every > 1)
+        c->skip_frame = AVDISCARD_NONREF;
+}
+
+/*
+ * 判断一帧是否需要输出。time 为帧的显示时间（秒），无法得到时传负数，此时不按时间段筛选。
+ * 过了最后一个时间段后设置 finished，调用方据此停止读取输入。
+ */
+static inline bool frame_select_want(FrameSelect *sel, const AVFrame *frame, double time) {
+    if (sel->keyframes_only && !frame->key_frame)
+        return false;
+    if (!sel->ranges.empty() && time >= 0) {
+        bool in_range = false;
+        for (const FrameRange &r : sel->ranges) {
+            if (time >= r.start && time <= r.end) {
+                in_range = true;
+                break;
+            }
+        }
+        if (time > sel->last_end)
+            sel->finished = true;
+        if (!in_range)
+            return false;
+    }
+    return sel->every <= 1 || sel->candidates++ % sel->every == 0;
+}
+
+#endif // FFMPEG_EXAMPLE_FRAME_SELECT_H
@@ -0,0 +1,217 @@
+/**
+ * @file
+ * persistent packet index shared by video_decode and video_hw_decode
+ */
+
+#ifndef FFMPEG_EXAMPLE_PACKET_INDEX_H
+#define FFMPEG_EXAMPLE_PACKET_INDEX_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavutil/avutil.h>
+}
+
+#define INDEX_FLAG_KEY 1
+
+// 索引文件默认放在输入文件旁边，文件名为 "<输入文件>.idx"
+#define INDEX_SUFFIX ".idx"
+
+/*
+ * 一个压缩包在输入中的位置：字节偏移、显示时间戳（PacketIndex.time_base 单位）、长度和标志位。
+ * 裸码流中没有时间戳，pts 为按解码顺序的包序号。
+ */
+typedef struct IndexEntry {
+    int64_t offset;
+    int64_t pts;
+    int32_t size;
+    int32_t flags;
+} IndexEntry;
+
+typedef struct PacketIndex {
+    // 建立索引时输入文件的大小和修改时间，文件变化后索引作废
+    int64_t file_size;
+    int64_t mtime;
+    AVRational time_base;
+    // 容器中视频流的下标，裸码流为 0
+    int32_t stream_index;
+    std::vector<IndexEntry> entries;
+} PacketIndex;
+
+/*
+ * 文件格式，所有字段都按小端序存储：
+ * "FFEXIDX1" | file_size(8) | mtime(8) | time_base(4 + 4) | stream_index(4) | count(8) | entries[count]
+ * 每个 entry 依次是 offset(8) | pts(8) | size(4) | flags(4)。
+ */
+static const char index_magic[8] = {'F', 'F', 'E', 'X', 'I', 'D', 'X', '1'};
+#define INDEX_HEADER_SIZE 44
+#define INDEX_ENTRY_SIZE 24
+
+static inline std::string index_path(const char *input) {
+    return std::string(input) + INDEX_SUFFIX;
+}
+
+static inline int index_stat(const char *input, int64_t *size, int64_t *mtime) {
+    struct stat st;
+
+    if (stat(input, &st) < 0)
+        return -1;
+    *size = static_cast<int64_t>(st.st_size);
+    *mtime = static_cast<int64_t>(st.st_mtime);
+    return 0;
+}
+
+static inline void index_put(uint8_t **p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        *(*p)++ = static_cast<uint8_t>(v >> (8 * i));
+}
+
+static inline uint64_t index_get(const uint8_t **p, int bytes) {
+    uint64_t v = 0;
+
+    for (int i = 0; i < bytes; i++)
+        v |= static_cast<uint64_t>(*(*p)++) << (8 * i);
+    return v;
+}
+
+// 记录输入文件当前的大小和修改时间，清空索引，准备重新建立
+static inline int index_reset(PacketIndex *index, const char *input, AVRational time_base, int stream_index) {
+    index->time_base = time_base;
+    index->stream_index = stream_index;
+    index->entries.clear();
+    return index_stat(input, &index->file_size, &index->mtime);
+}
+
+static inline void index_add(PacketIndex *index, int64_t offset, int64_t pts, int size, int key) {
+    index->entries.push_back({offset, pts, size, key ? INDEX_FLAG_KEY : 0});
+}
+
+static inline int index_save(const PacketIndex *index, const char *path) {
+    uint8_t header[INDEX_HEADER_SIZE], entry[INDEX_ENTRY_SIZE], *p = header;
+    FILE *f = fopen(path, "wb");
+    int ret = 0;
+
+    if (!f)
+        return -1;
+    memcpy(p, index_magic, sizeof(index_magic));
+    p += sizeof(index_magic);
+    index_put(&p, index->file_size, 8);
+    index_put(&p, index->mtime, 8);
+    index_put(&p, static_cast<uint32_t>(index->time_base.num), 4);
+    index_put(&p, static_cast<uint32_t>(index->time_base.den), 4);
+    index_put(&p, static_cast<uint32_t>(index->stream_index), 4);
+    index_put(&p, index->entries.size(), 8);
+    if (fwrite(header, 1, sizeof(header), f) != sizeof(header))
+        ret = -1;
+    for (size_t i = 0; !ret && i < index->entries.size(); i++) {
+        const IndexEntry &e = index->entries[i];
+        p = entry;
+        index_put(&p, e.offset, 8);
+        index_put(&p, e.pts, 8);
+        index_put(&p, static_cast<uint32_t>(e.size), 4);
+        index_put(&p, static_cast<uint32_t>(e.flags), 4);
+        if (fwrite(entry, 1, sizeof(entry), f) != sizeof(entry))
+            ret = -1;
+    }
+    if (fclose(f) != 0)
+        ret = -1;
+    if (ret < 0)
+        remove(path);
+    return ret;
+}
+
+/*
+ * 读取索引文件。文件不存在、格式不对，或者输入文件的大小、修改时间与建立索引时不一致都返回 -1，
+ * 由调用方重新建立索引。
+ */
+static inline int index_load(PacketIndex *index, const char *path, const char *input) {
+    uint8_t header[INDEX_HEADER_SIZE], entry[INDEX_ENTRY_SIZE];
+    const uint8_t *p = header;
+    int64_t size, mtime;
+    uint64_t count;
+    FILE *f;
+
+    if (index_stat(input, &size, &mtime) < 0 || !(f = fopen(path, "rb")))
+        return -1;
+    if (fread(header, 1, sizeof(header), f) != sizeof(header) || memcmp(header, index_magic, sizeof(index_magic))) {
+        fclose(f);
+        return -1;
+    }
+    p += sizeof(index_magic);
+    index->file_size = static_cast<int64_t>(index_get(&p, 8));
+    index->mtime = static_cast<int64_t>(index_get(&p, 8));
+    index->time_base.num = static_cast<int32_t>(index_get(&p, 4));
+    index->time_base.den = static_cast<int32_t>(index_get(&p, 4));
+    index->stream_index = static_cast<int32_t>(index_get(&p, 4));
+    count = index_get(&p, 8);
+    if (index->file_size != size || index->mtime != mtime || index->time_base.den <= 0 ||
+        count > static_cast<uint64_t>(size)) {
+        fclose(f);
+        return -1;
+    }
+
+    index->entries.resize(count);
+    for (uint64_t i = 0; i < count; i++) {
+        IndexEntry &e = index->entries[i];
+        if (fread(entry, 1, sizeof(entry), f) != sizeof(entry)) {
+            index->entries.clear();
+            fclose(f);
+            return -1;
+        }
+        p = entry;
+        e.offset = static_cast<int64_t>(index_get(&p, 8));
+        e.pts = static_cast<int64_t>(index_get(&p, 8));
+        e.size = static_cast<int32_t>(index_get(&p, 4));
+        e.flags = static_cast<int32_t>(index_get(&p, 4));
+    }
+    fclose(f);
+    return 0;
+}
+
+/*
+ * 查找显示时间不晚于 pts 的最后一个关键帧，返回它在 entries 中的下标；没有这样的关键帧时返回第一个关键帧，
+ * 索引中没有关键帧时返回 -1。
+ * 有 B 帧时包的 pts 不是单调的，所以顺序扫描而不是二分查找，索引一般只有几万项。
+ */
+static inline int64_t index_seek_key(const PacketIndex *index, int64_t pts) {
+    int64_t found = -1, first = -1;
+
+    for (size_t i = 0; i < index->entries.size(); i++) {
+        const IndexEntry &e = index->entries[i];
+        if (!(e.flags & INDEX_FLAG_KEY))
+            continue;
+        if (first < 0)
+            first = static_cast<int64_t>(i);
+        if (e.pts != AV_NOPTS_VALUE && e.pts <= pts)
+            found = static_cast<int64_t>(i);
+    }
+    return found >= 0 ? found : first;
+}
+
+// 把 "10,20.5,30" 形式的秒数列表解析成递增的时间点
+static inline int index_parse_times(const char *arg, std::vector<double> *times) {
+    const char *p = arg;
+
+    while (*p) {
+        char *end;
+        double t = strtod(p, &end);
+        if (end == p || t < 0)
+            return -1;
+        times->push_back(t);
+        p = *end == ',' ? end + 1 : end;
+        if (*end && *end != ',')
+            return -1;
+    }
+    std::sort(times->begin(), times->end());
+    return times->empty() ? -1 : 0;
+}
+
+#endif // FFMPEG_EXAMPLE_PACKET_INDEX_H
@@ -0,0 +1,111 @@
+/**
+ * @file
+ * bounded packet queue between a demux thread and a decoder, shared by the examples
+ */
+
+#ifndef FFMPEG_EXAMPLE_PACKET_QUEUE_H
+#define FFMPEG_EXAMPLE_PACKET_QUEUE_H
+
+#include <stdint.h>
+
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libavutil/avutil.h>
+}
+
+// 包队列的上限，任何一项达到上限时解复用等待；0 表示不限制这一项
+typedef struct PacketQueueLimits {
+    int packets;
+    int64_t bytes;
+    // 队列中的包的总时长（微秒），没有时长的包不计入
+    int64_t duration;
+} PacketQueueLimits;
+
+/*
+ * 解复用线程和解码线程之间的有界包队列。
+ * 高码率的流按字节数限制，避免几十个大包占满内存；低码率的流按时长限制，避免攒下几分钟的包。
+ * 队列为空时总能放入一个包，单个超过上限的包不会卡住解复用。
+ * 队列中的空指针表示流结束；packet_queue_abort() 之后两端都立即返回 false。
+ */
+struct PacketQueue {
+    PacketQueueLimits limits{};
+    // 时长上限换算到流的时间基
+    int64_t max_duration = 0;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    std::deque<AVPacket *> packets;
+    int64_t bytes = 0;
+    int64_t duration = 0;
+    bool abort = false;
+};
+
+static inline void packet_queue_init(PacketQueue *q, const PacketQueueLimits *limits, AVRational time_base) {
+    q->limits = *limits;
+    q->max_duration = limits->duration > 0 ? av_rescale_q(limits->duration, AV_TIME_BASE_Q, time_base) : 0;
+}
+
+// 调用时必须持有 q->lock
+static inline bool packet_queue_full(const PacketQueue *q) {
+    if (q->packets.empty())
+        return false;
+    return (q->limits.packets > 0 && static_cast<int64_t>(q->packets.size()) >= q->limits.packets) ||
+           (q->limits.bytes > 0 && q->bytes >= q->limits.bytes) ||
+           (q->max_duration > 0 && q->duration >= q->max_duration);
+}
+
+// 放入一个包并取得它的所有权，队列满时等待；表示结束的空指针不受上限限制
+static inline bool packet_queue_push(PacketQueue *q, AVPacket *pkt) {
+    std::unique_lock<std::mutex> guard(q->lock);
+
+    if (pkt)
+        q->cond.wait(guard, [q] { return q->abort || !packet_queue_full(q); });
+    if (q->abort)
+        return false;
+    if (pkt) {
+        q->bytes += pkt->size;
+        q->duration += FFMAX(pkt->duration, 0);
+    }
+    q->packets.push_back(pkt);
+    q->cond.notify_all();
+    return true;
+}
+
+static inline bool packet_queue_pop(PacketQueue *q, AVPacket **pkt) {
+    std::unique_lock<std::mutex> guard(q->lock);
+
+    q->cond.wait(guard, [q] { return q->abort || !q->packets.empty(); });
+    if (q->abort)
+        return false;
+    *pkt = q->packets.front();
+    q->packets.pop_front();
+    if (*pkt) {
+        q->bytes -= (*pkt)->size;
+        q->duration -= FFMAX((*pkt)->duration, 0);
+    }
+    q->cond.notify_all();
+    return true;
+}
+
+// 唤醒并放走两端所有等待的线程
+static inline void packet_queue_abort(PacketQueue *q) {
+    std::lock_guard<std::mutex> guard(q->lock);
+
+    q->abort = true;
+    q->cond.notify_all();
+}
+
+// 两端的线程都退出之后释放队列中剩下的包
+static inline void packet_queue_uninit(PacketQueue *q) {
+    for (AVPacket *pkt : q->packets)
+        av_packet_free(&pkt);
+    q->packets.clear();
+    q->bytes = 0;
+    q->duration = 0;
+}
+
+#endif // FFMPEG_EXAMPLE_PACKET_QUEUE_H
@@ -0,0 +1,477 @@
+/**
+ * @file
+ * ffmpeg_example_core: CPU post-processing of decoded frames
+ */
+
+#include <stdint.h>
+#include <string.h>
+
+extern "C" {
+#include <libavutil/imgutils.h>
+#include <libavutil/pixdesc.h>
+}
+
+#include "cpu_dispatch.h"
+#include "postproc.h"
+
+// 每次处理的输出行数。一个行带的亮度和色度一起处理，源数据读进缓存之后就用完，不会在下一个平面再读一遍
+#define POSTPROC_BAND_ROWS 16
+
+/*
+ * 与 CPU 相关的内核，dst 可以与 r[0] 指向同一行（就地缩小）。
+ * deinterleave: 把 n 对交错的 UV 拆到 u 和 v
+ * box2: dst[x] = (r0[2x] + r0[2x+1] + r1[2x] + r1[2x+1] + 2) >> 2
+ * box4: dst[x] = 连续 4 行中 4x4 块之和 + 8 再右移 4 位
+ */
+typedef struct PostprocDSP {
+    const char *name;
+    int cpu_flags;
+    void (*deinterleave)(const uint8_t *src, uint8_t *u, uint8_t *v, int n);
+    void (*box2)(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int n);
+    void (*box4)(const uint8_t *const r[4], uint8_t *dst, int n);
+} PostprocDSP;
+
+static void deinterleave_c(const uint8_t *src, uint8_t *u, uint8_t *v, int n) {
+    for (int x = 0; x < n; x++) {
+        u[x] = src[2 * x];
+        v[x] = src[2 * x + 1];
+    }
+}
+
+static void box2_c(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int n) {
+    for (int x = 0; x < n; x++)
+        dst[x] = static_cast<uint8_t>((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] + r1[2 * x + 1] + 2) >> 2);
+}
+
+static void box4_c(const uint8_t *const r[4], uint8_t *dst, int n) {
+    for (int x = 0; x < n; x++) {
+        int sum = 8;
+        for (int i = 0; i < 4; i++)
+            sum += r[i][4 * x] + r[i][4 * x + 1] + r[i][4 * x + 2] + r[i][4 * x + 3];
+        dst[x] = static_cast<uint8_t>(sum >> 4);
+    }
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void deinterleave_avx2(const uint8_t *src, uint8_t *u, uint8_t *v, int n) {
+    // 每个 128 位通道内先排成 8 个 U、8 个 V
+    const __m256i mask = _mm256_setr_epi8(0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15,
+                                          0, 2, 4, 6, 8, 10, 12, 14, 1, 3, 5, 7, 9, 11, 13, 15);
+    int x;
+
+    for (x = 0; x + 32 <= n; x += 32) {
+        __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * x));
+        __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + 2 * x + 32));
+        // [U0-15 | V0-15] 和 [U16-31 | V16-31]
+        a = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, mask), 0xD8);
+        b = _mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, mask), 0xD8);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(u + x), _mm256_permute2x128_si256(a, b, 0x20));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(v + x), _mm256_permute2x128_si256(a, b, 0x31));
+    }
+    deinterleave_c(src + 2 * x, u + x, v + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void box2_avx2(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int n) {
+    const __m256i ones = _mm256_set1_epi8(1), two = _mm256_set1_epi16(2);
+    int x;
+
+    // 每轮读两行各 64 字节，写 32 字节；写入的位置都已经读过，dst 可以与 r0 相同
+    for (x = 0; x + 32 <= n; x += 32) {
+        __m256i a0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r0 + 2 * x));
+        __m256i a1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r0 + 2 * x + 32));
+        __m256i b0 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r1 + 2 * x));
+        __m256i b1 = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r1 + 2 * x + 32));
+        // 相邻两个像素相加得到 16 位的和
+        __m256i s0 = _mm256_add_epi16(_mm256_maddubs_epi16(a0, ones), _mm256_maddubs_epi16(b0, ones));
+        __m256i s1 = _mm256_add_epi16(_mm256_maddubs_epi16(a1, ones), _mm256_maddubs_epi16(b1, ones));
+        s0 = _mm256_srli_epi16(_mm256_add_epi16(s0, two), 2);
+        s1 = _mm256_srli_epi16(_mm256_add_epi16(s1, two), 2);
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x),
+                            _mm256_permute4x64_epi64(_mm256_packus_epi16(s0, s1), 0xD8));
+    }
+    box2_c(r0 + 2 * x, r1 + 2 * x, dst + x, n - x);
+}
+
+__attribute__((target("avx2")))
+static void box4_avx2(const uint8_t *const r[4], uint8_t *dst, int n) {
+    const __m256i ones8 = _mm256_set1_epi8(1), ones16 = _mm256_set1_epi16(1), eight = _mm256_set1_epi32(8);
+    const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 0, 4, 1, 5);
+    const uint8_t *tail[4];
+    int x;
+
+    // 每轮读四行各 64 字节，写 16 字节
+    for (x = 0; x + 16 <= n; x += 16) {
+        __m256i s0 = _mm256_setzero_si256(), s1 = _mm256_setzero_si256();
+        for (int i = 0; i < 4; i++) {
+            s0 = _mm256_add_epi16(s0, _mm256_maddubs_epi16(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r[i] + 4 * x)), ones8));
+            s1 = _mm256_add_epi16(s1, _mm256_maddubs_epi16(
+                    _mm256_loadu_si256(reinterpret_cast<const __m256i *>(r[i] + 4 * x + 32)), ones8));
+        }
+        // 再把相邻两列的和相加，得到每个 4x4 块的 32 位和
+        __m256i t0 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(s0, ones16), eight), 4);
+        __m256i t1 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_madd_epi16(s1, ones16), eight), 4);
+        __m256i p = _mm256_packus_epi32(t0, t1);
+        p = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(p, p), order);
+        _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + x), _mm256_castsi256_si128(p));
+    }
+    for (int i = 0; i < 4; i++)
+        tail[i] = r[i] + 4 * x;
+    box4_c(tail, dst + x, n - x);
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void deinterleave_neon(const uint8_t *src, uint8_t *u, uint8_t *v, int n) {
+    int x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+        uint8x16x2_t uv = vld2q_u8(src + 2 * x);
+        vst1q_u8(u + x, uv.val[0]);
+        vst1q_u8(v + x, uv.val[1]);
+    }
+    deinterleave_c(src + 2 * x, u + x, v + x, n - x);
+}
+
+static void box2_neon(const uint8_t *r0, const uint8_t *r1, uint8_t *dst, int n) {
+    int x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+        uint16x8_t s0 = vaddq_u16(vpaddlq_u8(vld1q_u8(r0 + 2 * x)), vpaddlq_u8(vld1q_u8(r1 + 2 * x)));
+        uint16x8_t s1 = vaddq_u16(vpaddlq_u8(vld1q_u8(r0 + 2 * x + 16)), vpaddlq_u8(vld1q_u8(r1 + 2 * x + 16)));
+        // vrshrn 带舍入，与 C 版本的 + 2 >> 2 一致
+        vst1q_u8(dst + x, vcombine_u8(vrshrn_n_u16(s0, 2), vrshrn_n_u16(s1, 2)));
+    }
+    box2_c(r0 + 2 * x, r1 + 2 * x, dst + x, n - x);
+}
+
+static void box4_neon(const uint8_t *const r[4], uint8_t *dst, int n) {
+    const uint8_t *tail[4];
+    int x;
+
+    for (x = 0; x + 8 <= n; x += 8) {
+        uint16x8_t s0 = vdupq_n_u16(0), s1 = vdupq_n_u16(0);
+        for (int i = 0; i < 4; i++) {
+            s0 = vaddq_u16(s0, vpaddlq_u8(vld1q_u8(r[i] + 4 * x)));
+            s1 = vaddq_u16(s1, vpaddlq_u8(vld1q_u8(r[i] + 4 * x + 16)));
+        }
+        uint16x8_t p = vcombine_u16(vrshrn_n_u32(vpaddlq_u16(s0), 4), vrshrn_n_u32(vpaddlq_u16(s1), 4));
+        vst1_u8(dst + x, vmovn_u16(p));
+    }
+    for (int i = 0; i < 4; i++)
+        tail[i] = r[i] + 4 * x;
+    box4_c(tail, dst + x, n - x);
+}
+#endif
+
+static const PostprocDSP postproc_dsps[] = {
+#ifdef HAVE_AVX2_KERNELS
+    {"avx2", AV_CPU_FLAG_AVX2, deinterleave_avx2, box2_avx2, box4_avx2},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", AV_CPU_FLAG_NEON, deinterleave_neon, box2_neon, box4_neon},
+#endif
+    {"c", 0, deinterleave_c, box2_c, box4_c},
+};
+
+static const PostprocDSP *postproc_dsp(void) {
+    static const PostprocDSP *dsp = cpu_dispatch(postproc_dsps);
+    return dsp;
+}
+
+// 一个平面缩小后的第 y0 到 y1 行；f 为 1 且 dst 与 src 相同时什么也不用做
+static void scale_rows(const uint8_t *src, int src_linesize, uint8_t *dst, int dst_linesize, int width,
+                       int y0, int y1, int f) {
+    const PostprocDSP *dsp = postproc_dsp();
+
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *row = src + static_cast<ptrdiff_t>(f) * y * src_linesize;
+        uint8_t *out = dst + static_cast<ptrdiff_t>(y) * dst_linesize;
+        if (f == 1) {
+            if (out != row)
+                memcpy(out, row, width);
+        } else if (f == 2) {
+            dsp->box2(row, row + src_linesize, out, width);
+        } else {
+            const uint8_t *rows[4] = {row, row + src_linesize, row + 2 * src_linesize, row + 3 * src_linesize};
+            dsp->box4(rows, out, width);
+        }
+    }
+}
+
+/*
+ * NV12 色度平面缩小后的第 y0 到 y1 行，拆成 U、V 两个平面。
+ * 源行先拆到 pp->rows 中再缩小，就地处理时输出行与源行重叠也不会读到已经改写的数据。
+ */
+static void deinterleave_rows(Postproc *pp, const uint8_t *src, int src_linesize, uint8_t *u, uint8_t *v,
+                              int dst_linesize, int width, int y0, int y1, int f, bool direct) {
+    const PostprocDSP *dsp = postproc_dsp();
+    int src_width = width * f, stride = FFALIGN(src_width, 64);
+
+    if (pp->rows.size() < static_cast<size_t>(2 * f * stride))
+        pp->rows.resize(2 * f * stride);
+    for (int y = y0; y < y1; y++) {
+        const uint8_t *row = src + static_cast<ptrdiff_t>(f) * y * src_linesize;
+        uint8_t *du = u + static_cast<ptrdiff_t>(y) * dst_linesize, *dv = v + static_cast<ptrdiff_t>(y) * dst_linesize;
+        uint8_t *tu[4], *tv[4];
+        // 不缩小并且输出到新缓存时直接拆到输出中
+        if (f == 1 && direct) {
+            dsp->deinterleave(row, du, dv, width);
+            continue;
+        }
+        for (int i = 0; i < f; i++) {
+            tu[i] = pp->rows.data() + 2 * i * stride;
+            tv[i] = tu[i] + stride;
+            dsp->deinterleave(row + i * src_linesize, tu[i], tv[i], src_width);
+        }
+        if (f == 1) {
+            memcpy(du, tu[0], width);
+            memcpy(dv, tv[0], width);
+        } else if (f == 2) {
+            dsp->box2(tu[0], tu[1], du, width);
+            dsp->box2(tv[0], tv[1], dv, width);
+        } else {
+            dsp->box4(tu, du, width);
+            dsp->box4(tv, dv, width);
+        }
+    }
+}
+
+// 从缓存池中为 pp->out 取一块输出缓存
+static int postproc_get_buffer(Postproc *pp, enum AVPixelFormat format, int width, int height) {
+    int size = av_image_get_buffer_size(format, width, height, 32);
+    int ret;
+
+    if (size < 0)
+        return size;
+    // 还没归还的缓存在归还时才释放，旧的池可以直接丢掉
+    if (!pp->pool || pp->pool_size != size) {
+        av_buffer_pool_uninit(&pp->pool);
+        if (!(pp->pool = av_buffer_pool_init(size, NULL)))
+            return AVERROR(ENOMEM);
+        pp->pool_size = size;
+    }
+    av_frame_unref(pp->out);
+    if (!(pp->out->buf[0] = av_buffer_pool_get(pp->pool)))
+        return AVERROR(ENOMEM);
+    if ((ret = av_image_fill_arrays(pp->out->data, pp->out->linesize, pp->out->buf[0]->data, format, width, height,
+                                    32)) < 0)
+        return ret;
+    pp->out->format = format;
+    pp->out->width = width;
+    pp->out->height = height;
+    return 0;
+}
+
+// 用 pp->out 替换 frame 的数据，时间戳等属性保留
+static int postproc_output(Postproc *pp, AVFrame *frame) {
+    int ret;
+
+    if ((ret = av_frame_copy_props(pp->out, frame)) < 0)
+        return ret;
+    av_frame_unref(frame);
+    av_frame_move_ref(frame, pp->out);
+    return 0;
+}
+
+// 内核不支持的格式：用 swscale 转换成 YUV420P，同时完成缩小
+static int postproc_sws(Postproc *pp, AVFrame *frame, int width, int height, int f) {
+    int ret;
+
+    if (!pp->sws || pp->sws_format != frame->format || pp->sws_width != width || pp->sws_height != height) {
+        sws_freeContext(pp->sws);
+        pp->sws = sws_getContext(width, height, static_cast<AVPixelFormat>(frame->format), width / f, height / f,
+                                 AV_PIX_FMT_YUV420P, f > 1 ? SWS_AREA : SWS_BICUBIC, NULL, NULL, NULL);
+        if (!pp->sws) {
+            fprintf(stderr, "Can not convert %s frames\n",
+                    av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
+            return AVERROR(ENOSYS);
+        }
+        pp->sws_format = frame->format;
+        pp->sws_width = width;
+        pp->sws_height = height;
+    }
+    if ((ret = postproc_get_buffer(pp, AV_PIX_FMT_YUV420P, width / f, height / f)) < 0)
+        return ret;
+    sws_scale(pp->sws, frame->data, frame->linesize, 0, height, pp->out->data, pp->out->linesize);
+    return postproc_output(pp, frame);
+}
+
+int postproc_alloc(Postproc **pp, const PostprocConfig *cfg) {
+    Postproc *p = new Postproc;
+
+    p->cfg = *cfg;
+    if (!(p->out = av_frame_alloc())) {
+        delete p;
+        return AVERROR(ENOMEM);
+    }
+    *pp = p;
+    return 0;
+}
+
+int postproc_frame(Postproc *pp, AVFrame *frame, int in_place) {
+    const PostprocConfig *cfg = &pp->cfg;
+    enum AVPixelFormat format = static_cast<AVPixelFormat>(frame->format), out_format = format;
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int f = FFMAX(cfg->downscale, 1);
+    int width, height, out_width, out_height, ret;
+    uint8_t *dst[3];
+    int dst_linesize[3];
+    bool nv12 = format == AV_PIX_FMT_NV12, gray = format == AV_PIX_FMT_GRAY8;
+
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+    // 裁剪只移动数据指针。偏移取偶数，色度平面与亮度平面对齐；超出画面的部分不要
+    if (cfg->crop_width > 0 && cfg->crop_height > 0) {
+        int x = FFMIN(cfg->crop_x & ~1, frame->width), y = FFMIN(cfg->crop_y & ~1, frame->height);
+        frame->crop_left = x;
+        frame->crop_top = y;
+        frame->crop_right = frame->width - x - FFMIN(cfg->crop_width, frame->width - x);
+        frame->crop_bottom = frame->height - y - FFMIN(cfg->crop_height, frame->height - y);
+        if ((ret = av_frame_apply_cropping(frame, AV_FRAME_CROP_UNALIGNED)) < 0)
+            return ret;
+    }
+    // 缩小后的色度平面也要是整像素
+    width = frame->width - frame->width % (2 * f);
+    height = frame->height - frame->height % (2 * f);
+    if (width <= 0 || height <= 0)
+        return AVERROR(EINVAL);
+    out_width = width / f;
+    out_height = height / f;
+
+    if (!nv12 && !gray && format != AV_PIX_FMT_YUV420P && format != AV_PIX_FMT_YUVJ420P)
+        return postproc_sws(pp, frame, width, height, f);
+
+    if (nv12)
+        out_format = AV_PIX_FMT_YUV420P;
+    in_place = in_place && av_frame_is_writable(frame);
+    if (in_place) {
+        // 就地处理：每个平面的第 y 行写回源数据的第 y 行，NV12 的 U、V 各占色度行的前后两半
+        for (int p = 0; p < 3; p++) {
+            dst[p] = frame->data[nv12 && p == 2 ? 1 : p];
+            dst_linesize[p] = frame->linesize[nv12 && p == 2 ? 1 : p];
+        }
+        if (nv12)
+            dst[2] += out_width / 2;
+    } else {
+        if ((ret = postproc_get_buffer(pp, out_format, out_width, out_height)) < 0)
+            return ret;
+        for (int p = 0; p < 3; p++) {
+            dst[p] = pp->out->data[p];
+            dst_linesize[p] = pp->out->linesize[p];
+        }
+    }
+
+    // 按行带处理，每个行带的亮度和色度连续完成
+    for (int y0 = 0; y0 < out_height; y0 += POSTPROC_BAND_ROWS) {
+        int y1 = FFMIN(y0 + POSTPROC_BAND_ROWS, out_height);
+        scale_rows(frame->data[0], frame->linesize[0], dst[0], dst_linesize[0], out_width, y0, y1, f);
+        if (gray)
+            continue;
+        if (nv12) {
+            deinterleave_rows(pp, frame->data[1], frame->linesize[1], dst[1], dst[2], dst_linesize[1], out_width / 2,
+                              y0 / 2, y1 / 2, f, !in_place);
+        } else {
+            for (int p = 1; p < 3; p++)
+                scale_rows(frame->data[p], frame->linesize[p], dst[p], dst_linesize[p], out_width / 2, y0 / 2, y1 / 2,
+                           f);
+        }
+    }
+
+    if (!in_place)
+        return postproc_output(pp, frame);
+    // GRAY8 的 data[1] 是伪调色板，保持不变
+    for (int p = 0; p < (gray ? 1 : 3); p++) {
+        frame->data[p] = dst[p];
+        frame->linesize[p] = dst_linesize[p];
+    }
+    frame->format = out_format;
+    frame->width = out_width;
+    frame->height = out_height;
+    return 0;
+}
+
+void postproc_free(Postproc **pp) {
+    Postproc *p = *pp;
+
+    if (!p)
+        return;
+    av_frame_free(&p->out);
+    av_buffer_pool_uninit(&p->pool);
+    sws_freeContext(p->sws);
+    delete p;
+    *pp = NULL;
+}
+
+const char *postproc_impl(void) {
+    return postproc_dsp()->name;
+}
+
+// 对比一个版本和 C 版本在 n 个输出像素上的结果，dst 后面的字节也不能被改写
+static bool check_kernels(const PostprocDSP *dsp, const PostprocDSP *ref, int n) {
+    size_t row = static_cast<size_t>(4 * n + 64);
+    std::vector<uint8_t> src(4 * row), a(row), b(row), a2(row), b2(row);
+    const uint8_t *r[4];
+    uint8_t *ra[4], *rb[4];
+    bool ok = true;
+
+    cpu_check_fill(src.data(), src.size(), static_cast<uint64_t>(n));
+    for (int i = 0; i < 4; i++)
+        r[i] = src.data() + i * row;
+
+    // 输出缓存预先填上相同的内容，越界写入会让两边不同
+    cpu_check_fill(a.data(), row, ~static_cast<uint64_t>(n));
+    b = a2 = b2 = a;
+    ref->deinterleave(r[0], a.data(), a2.data(), n);
+    dsp->deinterleave(r[0], b.data(), b2.data(), n);
+    ok = ok && a == b && a2 == b2;
+
+    ref->box2(r[0], r[1], a.data(), n);
+    dsp->box2(r[0], r[1], b.data(), n);
+    ok = ok && a == b;
+    ref->box4(r, a.data(), n);
+    dsp->box4(r, b.data(), n);
+    ok = ok && a == b;
+
+    // 就地缩小：dst 与第一行相同
+    a.assign(src.begin(), src.begin() + row);
+    b = a;
+    ref->box2(a.data(), r[1], a.data(), n);
+    dsp->box2(b.data(), r[1], b.data(), n);
+    ok = ok && a == b;
+    a.assign(src.begin(), src.begin() + row);
+    b = a;
+    ra[0] = a.data();
+    rb[0] = b.data();
+    for (int i = 1; i < 4; i++)
+        ra[i] = rb[i] = src.data() + i * row;
+    ref->box4(ra, a.data(), n);
+    dsp->box4(rb, b.data(), n);
+    return ok && a == b;
+}
+
+int postproc_check_kernels(void) {
+    const PostprocDSP *ref = &postproc_dsps[FF_ARRAY_ELEMS(postproc_dsps) - 1];
+    // 所有短于一轮 SIMD 的尾巴和奇数宽度，再加几个常见的色度、亮度行宽
+    static const int widths[] = {127, 128, 129, 255, 319, 320, 321, 479, 480, 481, 959, 960, 961, 1919};
+    int failed = 0;
+
+    for (const PostprocDSP &dsp : postproc_dsps) {
+        int bad = 0;
+        if (&dsp == ref)
+            continue;
+        if (!cpu_dispatch_usable(dsp)) {
+            fprintf(stderr, "postproc: %s kernels not supported by this CPU, skipped\n", dsp.name);
+            continue;
+        }
+        for (int n = 0; n <= 100; n++)
+            bad += !check_kernels(&dsp, ref, n);
+        for (int n : widths)
+            bad += !check_kernels(&dsp, ref, n);
+        fprintf(stderr, "postproc: %s kernels %s the C kernels\n", dsp.name, bad ? "differ from" : "match");
+        failed += bad != 0;
+    }
+    return failed;
+}
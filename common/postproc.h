@@ -0,0 +1,114 @@
+/**
+ * @file
+ * CPU post-processing of decoded frames (crop, NV12 deinterleave, box downscale) in ffmpeg_example_core
+ */
+
+#ifndef FFMPEG_EXAMPLE_POSTPROC_H
+#define FFMPEG_EXAMPLE_POSTPROC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+extern "C" {
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libswscale/swscale.h>
+}
+
+#define POSTPROC_OPTIONS_HELP \
+    "  --crop <w>x<h>+<x>+<y>  crop decoded frames before writing them; offsets are rounded down to\n" \
+    "                          even values\n" \
+    "  --downscale 2|4      shrink decoded frames by averaging 2x2 or 4x4 blocks; the cropped size is\n" \
+    "                       rounded down to a multiple of twice the factor\n" \
+    "  --planar             write NV12 frames as YUV420P; implied by --crop and --downscale, whose\n" \
+    "                       output is always planar (formats other than NV12, YUV420P and GRAY8 go\n" \
+    "                       through swscale)\n"
+
+typedef struct PostprocConfig {
+    // 裁剪区域，宽或高为 0 表示不裁剪
+    int crop_x, crop_y, crop_width, crop_height;
+    // 缩小倍数：1、2 或 4
+    int downscale;
+    // 没有裁剪和缩小时也把 NV12 转换成 YUV420P
+    int planar;
+} PostprocConfig;
+
+/*
+ * 处理后处理相关的命令行参数，*i 指向当前参数，消耗了参数值时前移。
+ * 不是后处理参数时返回 0，参数值无效时退出。
+ */
+static inline int postproc_parse_option(int argc, char **argv, int *i, PostprocConfig *cfg) {
+    if (!strcmp(argv[*i], "--planar")) {
+        cfg->planar = 1;
+        return 1;
+    }
+    if (*i + 1 >= argc)
+        return 0;
+    if (!strcmp(argv[*i], "--crop")) {
+        if (sscanf(argv[++*i], "%dx%d+%d+%d", &cfg->crop_width, &cfg->crop_height, &cfg->crop_x, &cfg->crop_y) != 4 ||
+            cfg->crop_width <= 0 || cfg->crop_height <= 0 || cfg->crop_x < 0 || cfg->crop_y < 0) {
+            fprintf(stderr, "Invalid crop '%s'\n", argv[*i]);
+            exit(1);
+        }
+    } else if (!strcmp(argv[*i], "--downscale")) {
+        cfg->downscale = atoi(argv[++*i]);
+        if (cfg->downscale != 1 && cfg->downscale != 2 && cfg->downscale != 4) {
+            fprintf(stderr, "Invalid downscale factor '%s'\n", argv[*i]);
+            exit(1);
+        }
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+static inline bool postproc_enabled(const PostprocConfig *cfg) {
+    return cfg->planar || cfg->downscale > 1 || (cfg->crop_width > 0 && cfg->crop_height > 0);
+}
+
+/*
+ * 一路输出的后处理上下文，只能由一个线程使用。
+ * 帧可写时就地处理：裁剪只移动数据指针，缩小和拆分色度都写回原来的缓存，输出的行不会覆盖还没读到的行；
+ * 不可写的帧（软件解码器还作为参考帧持有）处理到缓存池中取出的新缓存里，同样只读一遍源数据。
+ */
+struct Postproc {
+    PostprocConfig cfg{};
+
+    // 不能就地处理时输出帧的缓存，输出尺寸变化时重建
+    AVBufferPool *pool = NULL;
+    int pool_size = 0;
+    AVFrame *out = NULL;
+
+    // 其他像素格式交给 swscale
+    SwsContext *sws = NULL;
+    int sws_format = -1, sws_width = 0, sws_height = 0;
+
+    // 拆分 NV12 色度时暂存 downscale 行 U 和 V
+    std::vector<uint8_t> rows;
+};
+
+int postproc_alloc(Postproc **pp, const PostprocConfig *cfg);
+
+/*
+ * 裁剪、缩小 frame，并把 NV12 拆成 YUV420P，结果仍然保存在 frame 中。
+ * in_place 为假时（如映射的硬件表面，读取以外的访问很慢）总是输出到新缓存。
+ * 出错时 frame 可能已经被裁剪，但数据没有改变。
+ */
+int postproc_frame(Postproc *pp, AVFrame *frame, int in_place);
+
+void postproc_free(Postproc **pp);
+
+// 当前 CPU 上使用的实现："avx2"、"neon" 或 "c"
+const char *postproc_impl(void);
+
+/*
+ * 对比当前 CPU 能运行的每个 SIMD 版本和 C 版本的输出（奇数宽度、不足一轮的尾巴、就地缩小），
+ * 各版本必须逐字节相同。返回输出不同的版本个数。
+ */
+int postproc_check_kernels(void);
+
+#endif // FFMPEG_EXAMPLE_POSTPROC_H
@@ -0,0 +1,305 @@
+/**
+ * @file
+ * read-ahead AVIOContext input backed by a prefetch thread, shared by the examples
+ */
+
+#ifndef FFMPEG_EXAMPLE_PREFETCH_INPUT_H
+#define FFMPEG_EXAMPLE_PREFETCH_INPUT_H
+
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "stats.h"
+
+extern "C" {
+#include <libavformat/avio.h>
+#include <libavutil/avutil.h>
+}
+
+#define PREFETCH_DEFAULT_CHUNK_KB 4096
+// 交给 libavformat 的 AVIOContext 的缓存大小，数据已经在内存中，这一层只是拷贝
+#define PREFETCH_IO_BUFFER_SIZE (256 * 1024)
+
+#define PREFETCH_OPTIONS_HELP \
+    "  --read-ahead <MiB>   read the input on a prefetch thread that keeps up to this much data in\n" \
+    "                       memory ahead of the demuxer (default 0, off)\n" \
+    "  --read-chunk <KiB>   bytes requested from the source per read (default " AV_STRINGIFY(PREFETCH_DEFAULT_CHUNK_KB) ")\n" \
+    "  --read-retain <MiB>  data kept behind the read position, so that backward seeks are served\n" \
+    "                       from memory (default: one chunk)\n"
+
+typedef struct PrefetchConfig {
+    // 预读窗口的字节数，0 表示不使用预读
+    int64_t window;
+    // 每次从源读取的字节数
+    int chunk;
+    // 读位置之前保留的字节数，-1 表示保留一块
+    int64_t retain;
+} PrefetchConfig;
+
+/*
+ * 处理预读相关的命令行参数，*i 指向当前参数，消耗了参数值时前移。
+ * 不是预读参数时返回 0。
+ */
+static inline int prefetch_parse_option(int argc, char **argv, int *i, PrefetchConfig *cfg) {
+    if (*i + 1 >= argc)
+        return 0;
+    if (!strcmp(argv[*i], "--read-ahead")) {
+        cfg->window = static_cast<int64_t>(atof(argv[++*i]) * 1024 * 1024);
+        cfg->window = FFMAX(cfg->window, 0);
+    } else if (!strcmp(argv[*i], "--read-chunk")) {
+        cfg->chunk = atoi(argv[++*i]);
+        cfg->chunk = av_clip(cfg->chunk, 4, INT_MAX / 1024) * 1024;
+    } else if (!strcmp(argv[*i], "--read-retain")) {
+        cfg->retain = static_cast<int64_t>(atof(argv[++*i]) * 1024 * 1024);
+        cfg->retain = FFMAX(cfg->retain, 0);
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+// 一次从源读入的连续数据
+typedef struct PrefetchChunk {
+    int64_t pos;
+    std::vector<uint8_t> data;
+} PrefetchChunk;
+
+/*
+ * 带预读的输入。
+ * 后台线程按 chunk 大小从源（avio_open2() 打开的文件、NFS、HTTP/S3 等）连续读取，
+ * 在读位置之前保持最多 window 字节的数据，网络往返和磁盘延迟被预读掩盖，读取只受带宽限制。
+ * 读位置之后的数据和之前 retain 字节内的数据都留在内存中，落在这个范围内的 seek（探测格式、
+ * 回头读 moov 等）只移动读位置；范围之外的 seek 丢弃缓存，预读线程从新位置重新开始。
+ * read/seek 回调只由 libavformat 所在的一个线程调用。
+ */
+struct PrefetchInput {
+    PrefetchConfig cfg{};
+    AVIOContext *src = NULL;
+    // 源的大小，未知时为负数
+    int64_t size = -1;
+
+    std::mutex lock;
+    std::condition_variable cond;
+    // 按位置排列的连续数据，最后一块的末尾就是 fetch_pos
+    std::deque<PrefetchChunk> chunks;
+    // 下一次 read 回调开始的位置
+    int64_t pos = 0;
+    // 预读线程下一次读取的位置
+    int64_t fetch_pos = 0;
+    // 缓存之外的 seek 递增 generation，预读线程丢弃旧位置上正在进行的读取，并先移动源的位置
+    uint64_t generation = 0;
+    bool need_seek = false;
+    bool eof = false;
+    int error = 0;
+    std::atomic<bool> stop{false};
+    std::thread worker;
+
+    // 每次从源读取一块的耗时，由打开时的调用方提供并汇总，只由预读线程写入；为空时不统计
+    LatencyHistogram *read_latency = NULL;
+    // 只由持有 lock 的线程更新
+    int64_t bytes_fetched = 0;
+    int64_t seek_hits = 0;
+    int64_t seek_misses = 0;
+};
+
+// 关闭时打断预读线程中阻塞的网络读取
+static inline int prefetch_interrupt(void *opaque) {
+    return static_cast<PrefetchInput *>(opaque)->stop.load();
+}
+
+// 丢弃读位置之前 retain 字节以外的数据，调用时必须持有 lock
+static inline void prefetch_trim(PrefetchInput *p) {
+    int64_t retain = p->cfg.retain >= 0 ? p->cfg.retain : p->cfg.chunk;
+
+    while (p->chunks.size() > 1) {
+        const PrefetchChunk &c = p->chunks.front();
+        if (c.pos + static_cast<int64_t>(c.data.size()) + retain > p->pos)
+            break;
+        p->chunks.pop_front();
+    }
+}
+
+static inline void prefetch_thread(PrefetchInput *p) {
+    std::unique_lock<std::mutex> guard(p->lock);
+
+    trace_thread_name("prefetch");
+    while (true) {
+        // 预读到窗口末尾、源读完或者出错时等待读位置前移或者 seek
+        p->cond.wait(guard, [p] {
+            return p->stop.load() || (!p->eof && !p->error && p->fetch_pos - p->pos < p->cfg.window);
+        });
+        if (p->stop.load())
+            return;
+
+        uint64_t generation = p->generation;
+        bool need_seek = p->need_seek;
+        PrefetchChunk chunk;
+        size_t got = 0;
+        int ret = 0;
+        chunk.pos = p->fetch_pos;
+        guard.unlock();
+
+        // 锁外读取，读的同时 libavformat 继续消费已经在内存中的数据
+        int64_t t = stats_now();
+        chunk.data.resize(static_cast<size_t>(p->cfg.chunk));
+        if (need_seek && avio_seek(p->src, chunk.pos, SEEK_SET) < 0)
+            ret = AVERROR(EIO);
+        while (ret >= 0 && got < chunk.data.size()) {
+            ret = avio_read(p->src, chunk.data.data() + got, static_cast<int>(chunk.data.size() - got));
+            if (ret > 0)
+                got += ret;
+            else if (ret == 0)
+                ret = AVERROR_EOF;
+        }
+        chunk.data.resize(got);
+
+        guard.lock();
+        // 读取期间发生了缓存之外的 seek，这次读到的数据作废
+        if (generation != p->generation)
+            continue;
+        p->need_seek = false;
+        if (got) {
+            p->fetch_pos += static_cast<int64_t>(got);
+            p->bytes_fetched += static_cast<int64_t>(got);
+            p->chunks.push_back(std::move(chunk));
+            if (p->read_latency)
+                latency_record(p->read_latency, t);
+        }
+        if (ret == AVERROR_EOF)
+            p->eof = true;
+        else if (ret < 0)
+            p->error = ret;
+        p->cond.notify_all();
+    }
+}
+
+static inline int prefetch_read(void *opaque, uint8_t *buf, int size) {
+    PrefetchInput *p = static_cast<PrefetchInput *>(opaque);
+    std::unique_lock<std::mutex> guard(p->lock);
+
+    while (true) {
+        for (const PrefetchChunk &c : p->chunks) {
+            int64_t end = c.pos + static_cast<int64_t>(c.data.size());
+            if (p->pos < c.pos || p->pos >= end)
+                continue;
+            int n = static_cast<int>(FFMIN(static_cast<int64_t>(size), end - p->pos));
+            memcpy(buf, c.data.data() + (p->pos - c.pos), n);
+            p->pos += n;
+            prefetch_trim(p);
+            // 读位置前移，窗口空出来了
+            p->cond.notify_all();
+            return n;
+        }
+        if (p->error)
+            return p->error;
+        if (p->eof && p->pos >= p->fetch_pos)
+            return AVERROR_EOF;
+        p->cond.wait(guard);
+    }
+}
+
+static inline int64_t prefetch_seek(void *opaque, int64_t offset, int whence) {
+    PrefetchInput *p = static_cast<PrefetchInput *>(opaque);
+    std::lock_guard<std::mutex> guard(p->lock);
+    int64_t start;
+
+    whence &= ~AVSEEK_FORCE;
+    if (whence == AVSEEK_SIZE)
+        return p->size >= 0 ? p->size : AVERROR(ENOSYS);
+    if (whence == SEEK_CUR)
+        offset += p->pos;
+    else if (whence == SEEK_END && p->size >= 0)
+        offset += p->size;
+    else if (whence != SEEK_SET)
+        return AVERROR(EINVAL);
+    if (offset < 0)
+        return AVERROR(EINVAL);
+
+    // 落在保留的数据、已经预读的数据或者下一块之内时，只移动读位置
+    start = p->chunks.empty() ? p->fetch_pos : p->chunks.front().pos;
+    if (offset >= start && offset <= p->fetch_pos + p->cfg.chunk) {
+        p->pos = offset;
+        p->seek_hits++;
+        prefetch_trim(p);
+        p->cond.notify_all();
+        return offset;
+    }
+    if (!(p->src->seekable & AVIO_SEEKABLE_NORMAL))
+        return AVERROR(ESPIPE);
+
+    p->chunks.clear();
+    p->pos = p->fetch_pos = offset;
+    p->generation++;
+    p->need_seek = true;
+    p->eof = false;
+    p->error = 0;
+    p->seek_misses++;
+    p->cond.notify_all();
+    return offset;
+}
+
+/*
+ * 打开 url 并启动预读线程，*pb 为交给 AVFormatContext 的 AVIOContext。
+ * 使用时把 *pb 设为 AVFormatContext 的 pb 并置上 AVFMT_FLAG_CUSTOM_IO，关闭输入之后再调用 prefetch_close()。
+ * read_latency 不为空时记录每次从源读取一块的耗时，必须比预读线程活得久。
+ */
+static inline int prefetch_open(PrefetchInput **out, AVIOContext **pb, const char *url, const PrefetchConfig *cfg,
+                                LatencyHistogram *read_latency) {
+    PrefetchInput *p = new PrefetchInput;
+    AVIOInterruptCB int_cb = {prefetch_interrupt, p};
+    uint8_t *buf;
+    int ret;
+
+    p->cfg = *cfg;
+    p->read_latency = read_latency;
+    if ((ret = avio_open2(&p->src, url, AVIO_FLAG_READ, &int_cb, NULL)) < 0) {
+        delete p;
+        return ret;
+    }
+    p->size = avio_size(p->src);
+    if (!(buf = static_cast<uint8_t *>(av_malloc(PREFETCH_IO_BUFFER_SIZE))) ||
+        !(*pb = avio_alloc_context(buf, PREFETCH_IO_BUFFER_SIZE, 0, p, prefetch_read, NULL, prefetch_seek))) {
+        av_free(buf);
+        avio_closep(&p->src);
+        delete p;
+        return AVERROR(ENOMEM);
+    }
+    // 源支持定位时，缓存之外的 seek 才能完成
+    (*pb)->seekable = p->src->seekable;
+    p->worker = std::thread(prefetch_thread, p);
+    *out = p;
+    return 0;
+}
+
+// 停止预读线程并释放，pb 为 prefetch_open() 给出的 AVIOContext
+static inline void prefetch_close(PrefetchInput **pp, AVIOContext **pb) {
+    PrefetchInput *p = *pp;
+
+    if (*pb) {
+        av_freep(&(*pb)->buffer);
+        avio_context_free(pb);
+    }
+    if (!p)
+        return;
+    {
+        std::lock_guard<std::mutex> guard(p->lock);
+        p->stop = true;
+    }
+    p->cond.notify_all();
+    p->worker.join();
+    avio_closep(&p->src);
+    delete p;
+    *pp = NULL;
+}
+
+#endif // FFMPEG_EXAMPLE_PREFETCH_INPUT_H
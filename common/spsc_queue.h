@@ -0,0 +1,78 @@
+/**
+ * @file
+ * bounded single-producer single-consumer queue shared by the examples
+ */
+
+#ifndef FFMPEG_EXAMPLE_SPSC_QUEUE_H
+#define FFMPEG_EXAMPLE_SPSC_QUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*
+ * 单生产者单消费者的有界无锁队列。
+ * 队列满时生产者等待、队列空时消费者等待，形成流水线各级之间的背压；abort 置位后两端都立即返回 false。
+ */
+template<typename T>
+class SpscQueue {
+public:
+    explicit SpscQueue(size_t capacity) : slots(capacity > 0 ? capacity : 1) {}
+
+    bool push(T value, const std::atomic<bool> &abort) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        unsigned spins = 0;
+
+        while (t - head.load(std::memory_order_acquire) == slots.size()) {
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(&spins);
+        }
+        slots[t % slots.size()] = value;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(T *value, const std::atomic<bool> &abort) {
+        unsigned spins = 0;
+
+        while (!try_pop(value)) {
+            if (abort.load(std::memory_order_relaxed))
+                return false;
+            backoff(&spins);
+        }
+        return true;
+    }
+
+    bool try_pop(T *value) {
+        size_t h = head.load(std::memory_order_relaxed);
+
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        *value = slots[h % slots.size()];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    // 先自旋，再让出时间片，长时间等不到才休眠
+    static void backoff(unsigned *spins) {
+        ++*spins;
+        if (*spins < 64)
+            return;
+        if (*spins < 128)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+
+    std::vector<T> slots;
+    // head 只由消费者修改，tail 只由生产者修改，分开放在不同的缓存行避免伪共享
+    alignas(64) std::atomic<size_t> head{0};
+    alignas(64) std::atomic<size_t> tail{0};
+};
+
+#endif // FFMPEG_EXAMPLE_SPSC_QUEUE_H
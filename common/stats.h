@@ -0,0 +1,473 @@
+/**
+ * @file
+ * per-stage instrumentation shared by the examples
+ *
+ * Each tool times its hot-path calls into one LatencyHistogram per stage.
+ * Histograms and counters are written by a single thread without locks and
+ * may be read by any thread, so periodic summaries (--log-interval), the JSON
+ * report (--stats) and a Chrome trace (--trace, loadable in Perfetto or
+ * chrome://tracing) all come from the same records. Building with
+ * FFMPEG_EXAMPLE_INSTRUMENTATION=0 compiles the timers out.
+ */
+
+#ifndef FFMPEG_EXAMPLE_STATS_H
+#define FFMPEG_EXAMPLE_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#ifndef FFMPEG_EXAMPLE_INSTRUMENTATION
+#define FFMPEG_EXAMPLE_INSTRUMENTATION 1
+#endif
+
+#if FFMPEG_EXAMPLE_INSTRUMENTATION && (defined(__x86_64__) || defined(__i386__) || defined(_M_X64))
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#define STATS_HAVE_TSC 1
+#else
+#define STATS_HAVE_TSC 0
+#endif
+
+// 每个 2 的幂区间再细分成 16 个桶，百分位的相对误差不超过 1/16
+#define LATENCY_SUB_BUCKET_BITS 4
+#define LATENCY_SUB_BUCKETS (1 << LATENCY_SUB_BUCKET_BITS)
+#define LATENCY_BUCKETS (64 * LATENCY_SUB_BUCKETS)
+// 每个线程最多记录的 trace 事件数，超出后丢弃
+#define TRACE_MAX_EVENTS (1 << 20)
+
+// 各个工具用法说明中的统计选项部分
+#define STATS_OPTIONS_HELP \
+    "  --stats <file>                 write per-stage latency statistics as JSON ('-' for stdout)\n" \
+    "  --log-interval <seconds>       print a per-stage summary to stderr periodically\n" \
+    "  --trace <file>                 write a Chrome trace of every timed call (Perfetto, chrome://tracing)\n"
+
+/*
+ * 单写者计数器：只有一个线程写入，写入时不需要原子的读改写指令，其他线程可以随时读取。
+ */
+typedef std::atomic<int64_t> StatsCounter;
+
+static inline void stats_count(StatsCounter *c, int64_t n) {
+    c->store(c->load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+}
+
+static inline void stats_count_max(std::atomic<uint64_t> *c, uint64_t v) {
+    if (v > c->load(std::memory_order_relaxed))
+        c->store(v, std::memory_order_relaxed);
+}
+
+/*
+ * 对数分桶的延迟直方图，单位为时钟周期（见 stats_ticks()），输出时再换算成时间。
+ * 只能由一个线程写入；流水线模式下每一级各自使用自己的直方图。
+ */
+struct LatencyHistogram {
+    explicit LatencyHistogram(const char *name) : name(name) {}
+
+    const char *name;
+    std::atomic<uint64_t> counts[LATENCY_BUCKETS] = {};
+    std::atomic<uint64_t> count{0};
+    std::atomic<uint64_t> sum{0};
+    std::atomic<uint64_t> max{0};
+    // 上一次周期汇总时的 count 和 sum，只由输出汇总的线程使用
+    uint64_t reported_count = 0;
+    uint64_t reported_sum = 0;
+};
+
+// 是否记录统计信息，由各个工具的 --stats、--log-interval、--trace 选项打开
+inline bool stats_enabled = false;
+inline bool trace_enabled = false;
+// 周期汇总的间隔，单位为秒，0 表示不输出
+inline double stats_interval = 0;
+inline const char *stats_file = NULL;
+inline const char *trace_file = NULL;
+
+// stats_init() 时记录的时钟起点，用于把时钟周期换算成纳秒
+inline int64_t stats_base_ticks = 0;
+inline int64_t stats_base_ns = 0;
+
+// 周期汇总的状态：上一次汇总的时间（纳秒）和帧数。每个输出汇总的线程各用一个
+typedef struct StatsReporter {
+    int64_t last_report;
+    int64_t last_frames;
+} StatsReporter;
+
+// 单路处理的工具共用这一个
+inline StatsReporter stats_reporter = {0, 0};
+
+static inline int64_t stats_clock_ns(void) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*
+ * 读取计时用的时钟。x86 上直接读 TSC，比 clock_gettime() 便宜一个数量级；
+ * 这里假定 TSC 是恒定频率的（近十年的 x86 处理器都是），其他平台退回 steady_clock。
+ */
+static inline int64_t stats_ticks(void) {
+#if STATS_HAVE_TSC
+    return static_cast<int64_t>(__rdtsc());
+#else
+    return stats_clock_ns();
+#endif
+}
+
+static inline void stats_init(void) {
+    stats_base_ns = stats_clock_ns();
+    stats_base_ticks = stats_ticks();
+    stats_reporter.last_report = stats_base_ns;
+}
+
+static inline void stats_reporter_init(StatsReporter *r) {
+    r->last_report = stats_clock_ns();
+    r->last_frames = 0;
+}
+
+// 每个时钟周期对应的纳秒数，用 stats_init() 以来 TSC 与 steady_clock 的增量校准
+static inline double stats_ns_per_tick(void) {
+#if STATS_HAVE_TSC
+    int64_t ns = stats_clock_ns() - stats_base_ns;
+    // 校准区间太短时误差太大，至少等 10ms
+    if (ns < 10000000) {
+        std::this_thread::sleep_for(std::chrono::nanoseconds(10000000 - ns));
+        ns = stats_clock_ns() - stats_base_ns;
+    }
+    int64_t ticks = stats_ticks() - stats_base_ticks;
+    return ticks > 0 ? static_cast<double>(ns) / ticks : 1.0;
+#else
+    return 1.0;
+#endif
+}
+
+// 计时开始，返回值交给 latency_record()
+static inline int64_t stats_now(void) {
+#if FFMPEG_EXAMPLE_INSTRUMENTATION
+    if (stats_enabled)
+        return stats_ticks();
+#endif
+    return 0;
+}
+
+static inline int latency_bucket(uint64_t v) {
+    int exp;
+
+    if (v < LATENCY_SUB_BUCKETS)
+        return static_cast<int>(v);
+    exp = 63 - __builtin_clzll(v);
+    return (exp - LATENCY_SUB_BUCKET_BITS + 1) * LATENCY_SUB_BUCKETS +
+           static_cast<int>((v >> (exp - LATENCY_SUB_BUCKET_BITS)) & (LATENCY_SUB_BUCKETS - 1));
+}
+
+// 桶内数值的上界
+static inline uint64_t latency_bucket_value(int bucket) {
+    int exp = bucket / LATENCY_SUB_BUCKETS + LATENCY_SUB_BUCKET_BITS - 1;
+    uint64_t sub = bucket % LATENCY_SUB_BUCKETS;
+
+    if (bucket < LATENCY_SUB_BUCKETS)
+        return bucket;
+    return ((LATENCY_SUB_BUCKETS + sub + 1) << (exp - LATENCY_SUB_BUCKET_BITS)) - 1;
+}
+
+static inline void latency_add(LatencyHistogram *hist, uint64_t v) {
+    std::atomic<uint64_t> *bucket = &hist->counts[latency_bucket(v)];
+
+    bucket->store(bucket->load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+    hist->sum.store(hist->sum.load(std::memory_order_relaxed) + v, std::memory_order_relaxed);
+    stats_count_max(&hist->max, v);
+    // count 最后更新，读取方看到的 count 不会多于桶里的样本数
+    hist->count.store(hist->count.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+// 返回第 p（0~100）百分位的延迟，单位为时钟周期
+static inline uint64_t latency_percentile(const LatencyHistogram *hist, double p) {
+    uint64_t count = hist->count.load(std::memory_order_acquire);
+    uint64_t max = hist->max.load(std::memory_order_relaxed);
+    uint64_t rank = static_cast<uint64_t>(count * p / 100.0 + 0.5), seen = 0;
+
+    if (!count)
+        return 0;
+    if (rank < 1)
+        rank = 1;
+    for (int i = 0; i < LATENCY_BUCKETS; i++) {
+        seen += hist->counts[i].load(std::memory_order_relaxed);
+        if (seen >= rank)
+            return latency_bucket_value(i) < max ? latency_bucket_value(i) : max;
+    }
+    return max;
+}
+
+typedef struct TraceEvent {
+    const char *name;
+    int64_t start;
+    int64_t end;
+} TraceEvent;
+
+// 每个线程自己的事件缓存，线程第一次记录事件时注册，之后写入不需要加锁
+typedef struct TraceBuffer {
+    int tid;
+    std::string name;
+    std::vector<TraceEvent> events;
+    uint64_t dropped;
+} TraceBuffer;
+
+inline std::mutex trace_lock;
+inline std::vector<TraceBuffer *> trace_buffers;
+
+static inline TraceBuffer *trace_buffer(void) {
+    thread_local TraceBuffer *buf = NULL;
+
+    if (!buf) {
+        std::lock_guard<std::mutex> lock(trace_lock);
+        buf = new TraceBuffer();
+        buf->tid = static_cast<int>(trace_buffers.size()) + 1;
+        buf->dropped = 0;
+        buf->events.reserve(4096);
+        trace_buffers.push_back(buf);
+    }
+    return buf;
+}
+
+// 给当前线程在 trace 中起一个名字，name 会被复制
+static inline void trace_thread_name(const char *name) {
+#if FFMPEG_EXAMPLE_INSTRUMENTATION
+    if (trace_enabled)
+        trace_buffer()->name = name;
+#endif
+}
+
+// 记录从 start（stats_now() 的返回值）到现在的耗时
+static inline void latency_record(LatencyHistogram *hist, int64_t start) {
+#if FFMPEG_EXAMPLE_INSTRUMENTATION
+    if (!stats_enabled)
+        return;
+    int64_t end = stats_ticks();
+    latency_add(hist, static_cast<uint64_t>(end - start));
+    if (trace_enabled) {
+        TraceBuffer *buf = trace_buffer();
+        if (buf->events.size() < TRACE_MAX_EVENTS)
+            buf->events.push_back({hist->name, start, end});
+        else
+            buf->dropped++;
+    }
+#endif
+}
+
+// 把 src 的样本累加到 dst 中，用来汇总多路流的统计；调用时两边都不应再有写入
+static inline void latency_merge(LatencyHistogram *dst, const LatencyHistogram *src) {
+    for (int i = 0; i < LATENCY_BUCKETS; i++)
+        dst->counts[i] += src->counts[i].load();
+    dst->count += src->count.load();
+    dst->sum += src->sum.load();
+    stats_count_max(&dst->max, src->max.load());
+}
+
+// 按 pts 配对的延迟最多同时跟踪的帧数，超过编码器可能缓存的帧数即可
+#define PTS_LATENCY_SLOTS 512
+
+/*
+ * 按 pts 配对的延迟统计：帧送进编码器时记下时间，同一 pts 的包出来时把这段时间记入直方图，
+ * 得到每一帧在编码器中停留的时间。只由一个线程使用。
+ */
+struct PtsLatency {
+    explicit PtsLatency(const char *name) : hist(name) {}
+
+    LatencyHistogram hist;
+    int64_t start[PTS_LATENCY_SLOTS] = {};
+    // 送入和取出的帧数，两者之差是还在编码器中的帧数
+    int64_t in = 0;
+    int64_t out = 0;
+    int64_t max_in_flight = 0;
+};
+
+// pts 为 INT64_MIN（即 AV_NOPTS_VALUE）时只计数，不记录延迟
+static inline void pts_latency_in(PtsLatency *l, int64_t pts) {
+    if (pts != INT64_MIN)
+        l->start[static_cast<uint64_t>(pts) % PTS_LATENCY_SLOTS] = stats_now();
+    l->in++;
+    if (l->in - l->out > l->max_in_flight)
+        l->max_in_flight = l->in - l->out;
+}
+
+static inline void pts_latency_out(PtsLatency *l, int64_t pts) {
+    if (pts != INT64_MIN)
+        latency_record(&l->hist, l->start[static_cast<uint64_t>(pts) % PTS_LATENCY_SLOTS]);
+    l->out++;
+}
+
+/*
+ * 距上一次汇总超过 stats_interval 秒时，向 stderr 输出一行汇总：
+ * 这段时间内的帧数和帧率，以及每一级的调用次数、平均耗时和累计的 p99。
+ * 每个 StatsReporter 只应由一个线程使用，通常是写文件的循环每处理一帧调用一次。
+ */
+static inline void stats_report_periodic(StatsReporter *r, const char *name, int64_t frames,
+                                         LatencyHistogram *const *stages, int nb_stages) {
+#if FFMPEG_EXAMPLE_INSTRUMENTATION
+    char line[1024];
+    int64_t now;
+    double ns_per_tick, interval;
+    int len;
+
+    if (stats_interval <= 0)
+        return;
+    now = stats_clock_ns();
+    interval = (now - r->last_report) / 1e9;
+    if (interval < stats_interval)
+        return;
+
+    // 多路流同时输出时，整行拼好后一次写出，避免行与行交错
+    ns_per_tick = stats_ns_per_tick();
+    len = snprintf(line, sizeof(line), "[%s] %.1fs: %lld frames, %.1f fps", name, (now - stats_base_ns) / 1e9,
+                   static_cast<long long>(frames), (frames - r->last_frames) / interval);
+    for (int i = 0; i < nb_stages && len < static_cast<int>(sizeof(line)); i++) {
+        LatencyHistogram *h = stages[i];
+        uint64_t count = h->count.load(std::memory_order_acquire);
+        uint64_t sum = h->sum.load(std::memory_order_relaxed);
+        uint64_t n = count - h->reported_count;
+        len += snprintf(line + len, sizeof(line) - len, " | %s %llu x %.1fus p99 %.1fus", h->name,
+                        static_cast<unsigned long long>(n),
+                        n ? (sum - h->reported_sum) * ns_per_tick / 1000.0 / n : 0.0,
+                        latency_percentile(h, 99) * ns_per_tick / 1000.0);
+        h->reported_count = count;
+        h->reported_sum = sum;
+    }
+    fprintf(stderr, "%s\n", line);
+    r->last_report = now;
+    r->last_frames = frames;
+#endif
+}
+
+// 一组统计结果：一个工具的总体结果，或者多路处理中的一路
+typedef struct StatsReport {
+    const char *name;
+    int64_t frames;
+    int64_t bytes_written;
+    double elapsed;
+    LatencyHistogram *const *stages;
+    int nb_stages;
+    // 从启动到写出第一帧的时间（秒），小于 0 表示不统计
+    double first_frame_s = -1;
+} StatsReport;
+
+static inline void stats_print_report(FILE *f, const char *key, const StatsReport *r, double us_per_tick) {
+    fprintf(f, "{\"%s\": \"%s\", \"frames\": %lld, \"bytes_written\": %lld, \"elapsed_s\": %.6f, \"fps\": %.3f, ",
+            key, r->name, static_cast<long long>(r->frames), static_cast<long long>(r->bytes_written), r->elapsed,
+            r->elapsed > 0 ? r->frames / r->elapsed : 0.0);
+    if (r->first_frame_s >= 0)
+        fprintf(f, "\"first_frame_ms\": %.3f, ", r->first_frame_s * 1000.0);
+    fprintf(f, "\"stages\": {");
+    for (int i = 0; i < r->nb_stages; i++) {
+        const LatencyHistogram *h = r->stages[i];
+        uint64_t count = h->count.load();
+        fprintf(f, "%s\"%s\": {\"count\": %llu, \"mean_us\": %.3f, \"p50_us\": %.3f, \"p99_us\": %.3f, \"max_us\": %.3f}",
+                i ? ", " : "", h->name, static_cast<unsigned long long>(count),
+                count ? h->sum.load() * us_per_tick / count : 0.0,
+                latency_percentile(h, 50) * us_per_tick, latency_percentile(h, 99) * us_per_tick,
+                h->max.load() * us_per_tick);
+    }
+    fprintf(f, "}");
+}
+
+/*
+ * 把统计结果以 JSON 的形式写入 path，例如：
+ * {"tool": "video_decode", "frames": 250, "bytes_written": 1234, "elapsed_s": 1.2, "fps": 208.3,
+ *  "stages": {"parse": {"count": 250, "mean_us": 3.1, "p50_us": 2.9, "p99_us": 8.0, "max_us": 20.1}}}
+ * 统计了首帧时间时还有 "first_frame_ms"；有多路流时再附上 "streams": [{"name": ..., 与上面相同的字段}, ...]。
+ */
+static inline int stats_write_json(const char *path, const StatsReport *report,
+                                   const StatsReport *streams, int nb_streams) {
+    FILE *f = strcmp(path, "-") ? fopen(path, "w") : stdout;
+    double us_per_tick = stats_enabled ? stats_ns_per_tick() / 1000.0 : 0.0;
+
+    if (!f)
+        return -1;
+    stats_print_report(f, "tool", report, us_per_tick);
+    if (nb_streams > 0) {
+        fprintf(f, ", \"streams\": [");
+        for (int i = 0; i < nb_streams; i++) {
+            fprintf(f, "%s", i ? ", " : "");
+            stats_print_report(f, "name", &streams[i], us_per_tick);
+            fprintf(f, "}");
+        }
+        fprintf(f, "]");
+    }
+    fprintf(f, "}\n");
+    if (f != stdout)
+        return fclose(f) == 0 ? 0 : -1;
+    return 0;
+}
+
+/*
+ * 以 Chrome trace event 格式写出全部已记录的事件，并释放各线程的事件缓存。
+ * 调用时其他线程都应该已经退出。
+ */
+static inline int trace_write(const char *path, const char *tool) {
+    FILE *f = fopen(path, "w");
+    double us_per_tick = stats_ns_per_tick() / 1000.0;
+    uint64_t dropped = 0;
+
+    if (!f)
+        return -1;
+    fprintf(f, "{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n");
+    fprintf(f, "{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 0, \"args\": {\"name\": \"%s\"}}", tool);
+    std::lock_guard<std::mutex> lock(trace_lock);
+    for (TraceBuffer *buf : trace_buffers) {
+        if (!buf->name.empty())
+            fprintf(f, ",\n{\"name\": \"thread_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": %d, \"args\": {\"name\": \"%s\"}}",
+                    buf->tid, buf->name.c_str());
+        for (const TraceEvent &ev : buf->events)
+            fprintf(f, ",\n{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %d, \"ts\": %.3f, \"dur\": %.3f}",
+                    ev.name, buf->tid, (ev.start - stats_base_ticks) * us_per_tick,
+                    (ev.end - ev.start) * us_per_tick);
+        dropped += buf->dropped;
+        delete buf;
+    }
+    trace_buffers.clear();
+    fprintf(f, "\n]}\n");
+    if (dropped)
+        fprintf(stderr, "trace: dropped %llu events\n", static_cast<unsigned long long>(dropped));
+    return fclose(f) == 0 ? 0 : -1;
+}
+
+/*
+ * 解析统计相关的命令行选项。argv[*i] 是其中之一时返回 1，并把 *i 移到它的参数上；否则返回 0。
+ */
+static inline int stats_parse_option(int argc, char **argv, int *i) {
+    if (*i + 1 >= argc)
+        return 0;
+    if (!strcmp(argv[*i], "--stats")) {
+        stats_file = argv[++*i];
+    } else if (!strcmp(argv[*i], "--log-interval")) {
+        stats_interval = atof(argv[++*i]);
+    } else if (!strcmp(argv[*i], "--trace")) {
+        trace_file = argv[++*i];
+        trace_enabled = true;
+    } else {
+        return 0;
+    }
+    stats_enabled = stats_file || trace_file || stats_interval > 0;
+#if !FFMPEG_EXAMPLE_INSTRUMENTATION
+    if (stats_interval > 0 || trace_file)
+        fprintf(stderr, "%s has no effect, built without instrumentation\n", argv[*i - 1]);
+#endif
+    return 1;
+}
+
+// 处理结束后写出 --stats 和 --trace 指定的文件，streams 可以为空
+static inline void stats_finish(const StatsReport *report, const StatsReport *streams, int nb_streams) {
+    if (stats_file && stats_write_json(stats_file, report, streams, nb_streams) < 0)
+        fprintf(stderr, "Could not write statistics to %s\n", stats_file);
+    if (trace_file && trace_write(trace_file, report->name) < 0)
+        fprintf(stderr, "Could not write trace to %s\n", trace_file);
+}
+
+#endif // FFMPEG_EXAMPLE_STATS_H
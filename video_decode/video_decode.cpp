@@ -5,20 +5,206 @@
  * @example video_decode.cpp
  */
 
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include <errno.h>
+#include <fcntl.h>
+#ifdef _WIN32
+#include <io.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "context_pool.h"
+#include "core.h"
+#include "frame_select.h"
+#include "packet_index.h"
+#include "postproc.h"
+#include "stats.h"
 
 /* C++编译时要添加 extern "C" */
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavutil/time.h>
 }
 
 // 文件流缓存大小
 #define INBUF_SIZE 4096
+// mmap 模式下每次喂给 parser 的窗口大小
+#define MMAP_WINDOW_SIZE (1 << 20)
+// 输出批量写入的缓存大小
+#define OUTBUF_SIZE (4 << 20)
+// O_DIRECT 要求写入的地址、长度和文件偏移都按块对齐
+#define OUTBUF_ALIGN 4096
+// 分段并行解码时每段至少包含的压缩包个数，GOP 较短时把相邻的 GOP 合并成一段
+#define SEGMENT_MIN_PACKETS 64
+// 每个解码线程最多领先写出进度的段数，限制缓存在内存中的解码帧
+#define SEGMENT_WINDOW 2
+// 抽帧时在目标帧之后多送给解码器的压缩包个数，覆盖 B 帧的重排序延迟
+#define EXTRACT_REORDER_PACKETS 16
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+
+// 输入方式：fread 逐块读入缓存，或者把整个文件映射到内存中直接交给 parser
+enum InputMode {
+    INPUT_FREAD,
+    INPUT_MMAP,
+};
+
+typedef struct InputSource {
+    const char *filename;
+    enum InputMode mode;
+    // 每次交给 av_parser_parse2() 的最大字节数
+    size_t window;
+
+    // fread 模式：文件流和带 PADDING 的输入缓存
+    FILE *f;
+    uint8_t *inbuf;
+
+    // mmap 模式：映射区域（末尾至少留有 AV_INPUT_BUFFER_PADDING_SIZE 个 0 字节）
+    uint8_t *map;
+    size_t map_size;
+    size_t file_size;
+    size_t pos;
+} InputSource;
+
+#ifndef _WIN32
+/*
+ * 把整个文件映射到内存。
+ * 先申请一段比文件大 AV_INPUT_BUFFER_PADDING_SIZE 的匿名映射，再把文件用 MAP_FIXED 覆盖到它的开头，
+ * 这样文件末尾之后的内容全部是可读的 0，满足 av_parser_parse2() 对输入数组 PADDING 的要求，不需要额外拷贝。
+ */
+static int input_open_mmap(InputSource *in, const char *filename) {
+    struct stat st;
+    long page = sysconf(_SC_PAGESIZE);
+    void *base, *p;
+    int fd;
+
+    fd = open(filename, O_RDONLY);
+    if (fd < 0)
+        return -1;
+    // 管道、设备等非普通文件无法映射
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return -1;
+    }
+
+    in->file_size = static_cast<size_t>(st.st_size);
+    in->map_size = FFALIGN(in->file_size + AV_INPUT_BUFFER_PADDING_SIZE, static_cast<size_t>(page));
+
+    base = mmap(NULL, in->map_size, PROT_READ, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (base == MAP_FAILED) {
+        close(fd);
+        return -1;
+    }
+    if (in->file_size) {
+        p = mmap(base, in->file_size, PROT_READ, MAP_PRIVATE | MAP_FIXED, fd, 0);
+        if (p == MAP_FAILED) {
+            munmap(base, in->map_size);
+            close(fd);
+            return -1;
+        }
+        // 顺序读取，让内核尽量提前预读
+        madvise(base, in->file_size, MADV_SEQUENTIAL);
+    }
+    // 映射建立后文件描述符就不再需要了
+    close(fd);
+
+    in->map = static_cast<uint8_t *>(base);
+    in->pos = 0;
+    return 0;
+}
+#endif
+
+static int input_open(InputSource *in, const char *filename, enum InputMode mode, size_t window) {
+    memset(in, 0, sizeof(*in));
+    in->filename = filename;
+    in->mode = mode;
+    in->window = window;
+
+#ifndef _WIN32
+    if (mode == INPUT_MMAP) {
+        if (input_open_mmap(in, filename) == 0)
+            return 0;
+        fprintf(stderr, "Could not mmap %s, falling back to fread\n", filename);
+    }
+#endif
+    in->mode = INPUT_FREAD;
+
+    in->f = fopen(filename, "rb");
+    if (!in->f)
+        return -1;
+
+    // 输入缓存，除了指定缓冲区大小，还要多加一个PADDING_SIZE的大小（av_parser_parse2()函数的输入数组需要腾出这个空间）
+    in->inbuf = static_cast<uint8_t *>(av_malloc(window + AV_INPUT_BUFFER_PADDING_SIZE));
+    if (!in->inbuf) {
+        fclose(in->f);
+        return -1;
+    }
+    // 对 PADDING 部分的缓存值都置为0，避免数据干扰
+    memset(in->inbuf + window, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return 0;
+}
+
+/*
+ * 取出下一段待解析的裸数据，返回其长度，返回0表示已经读到文件末尾。
+ * mmap 模式下 *data 直接指向映射区域，fread 模式下指向 inbuf。
+ */
+static size_t input_read(InputSource *in, const uint8_t **data) {
+    size_t size;
+
+    if (in->mode == INPUT_MMAP) {
+        size = FFMIN(in->window, in->file_size - in->pos);
+        *data = in->map + in->pos;
+        in->pos += size;
+#ifndef _WIN32
+        // 提前告知内核下一个窗口即将被访问
+        if (in->pos < in->file_size) {
+            long page = sysconf(_SC_PAGESIZE);
+            size_t start = in->pos & ~static_cast<size_t>(page - 1);
+            madvise(in->map + start, FFMIN(in->window, in->file_size - start), MADV_WILLNEED);
+        }
+#endif
+        return size;
+    }
+
+    if (feof(in->f))
+        return 0;
+    // 从视频文件流中读取裸数据到缓存中
+    size = fread(in->inbuf, 1, in->window, in->f);
+    *data = in->inbuf;
+    return size;
+}
+
+static void input_close(InputSource *in) {
+#ifndef _WIN32
+    if (in->map)
+        munmap(in->map, in->map_size);
+#endif
+    if (in->f)
+        fclose(in->f);
+    av_freep(&in->inbuf);
+}
 
 static void pgm_save(unsigned char *buf, int wrap, int xsize, int ysize,
-                     char *filename) {
+                     const char *filename) {
     FILE *f;
     int i;
 
@@ -29,55 +215,734 @@ static void pgm_save(unsigned char *buf, int wrap, int xsize, int ysize,
     fclose(f);
 }
 
-static void decode(AVCodecContext *dec_ctx, AVFrame *frame, AVPacket *pkt,
-                   const char *filename) {
-    char buf[1024];
-    int ret;
+// 输出方式：每帧一个 PGM 文件（调试用），或者把所有帧的亮度平面写入同一个 raw / Y4M 文件
+enum OutputMode {
+    OUTPUT_PGM,
+    OUTPUT_RAW,
+    OUTPUT_Y4M,
+};
 
-    // 向解码器发送压缩包
-    ret = avcodec_send_packet(dec_ctx, pkt);
-    if (ret < 0) {
-        fprintf(stderr, "Error sending a packet for decoding\n");
-        exit(1);
+typedef struct FrameSink {
+    enum OutputMode mode;
+    // PGM 模式下作为文件名前缀，其余模式下为输出文件名
+    const char *filename;
+
+    int fd;
+    // 是否以 O_DIRECT 打开，绕过页缓存
+    int direct;
+
+    // 批量写入缓存，攒满 buf_size 字节才调用一次 write()
+    uint8_t *buf_mem;
+    uint8_t *buf;
+    size_t buf_size;
+    size_t buf_len;
+    // 已经写入文件的字节数
+    int64_t written;
+
+    // Y4M 文件头在收到第一帧时才能确定
+    int header_written;
+    int width, height;
+    AVRational framerate;
+} FrameSink;
+
+static int write_all(int fd, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
     }
+    return 0;
+}
 
-    while (ret >= 0) {
-        /*
-         * 当函数返回 0，表示解码成功，此时frame中存储了帧数据。
-         * 当函数返回 AVERROR(EAGAIN)，表示解码器需要接收更多的压缩包才能进行下一帧解码。
-         * 当函数返回 AVERROR_EOF，表示解码器缓冲区已经被清空，没有任何数据可以解码成帧。
-         * 其余返回值都是解码异常。
-         */
-        ret = avcodec_receive_frame(dec_ctx, frame);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return;
-        else if (ret < 0) {
-            fprintf(stderr, "Error during decoding\n");
-            exit(1);
+static int sink_open(FrameSink *sink, const char *filename, enum OutputMode mode,
+                     size_t buf_size, int direct) {
+    memset(sink, 0, sizeof(*sink));
+    sink->mode = mode;
+    sink->filename = filename;
+    sink->fd = -1;
+
+    if (mode == OUTPUT_PGM)
+        return 0;
+
+    // 缓存大小必须是对齐单位的整数倍，这样除了最后一次 flush 以外每次写入都是对齐的
+    sink->buf_size = FFALIGN(FFMAX(buf_size, static_cast<size_t>(OUTBUF_ALIGN)), static_cast<size_t>(OUTBUF_ALIGN));
+    sink->buf_mem = static_cast<uint8_t *>(av_malloc(sink->buf_size + OUTBUF_ALIGN));
+    if (!sink->buf_mem)
+        return -1;
+    sink->buf = reinterpret_cast<uint8_t *>(FFALIGN(reinterpret_cast<uintptr_t>(sink->buf_mem),
+                                                    static_cast<uintptr_t>(OUTBUF_ALIGN)));
+
+#ifdef O_DIRECT
+    if (direct) {
+        sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_DIRECT, 0644);
+        if (sink->fd >= 0)
+            sink->direct = 1;
+        else
+            fprintf(stderr, "Could not open %s with O_DIRECT, using buffered writes\n", filename);
+    }
+#else
+    if (direct)
+        fprintf(stderr, "O_DIRECT is not supported on this platform, using buffered writes\n");
+#endif
+    if (sink->fd < 0)
+        sink->fd = open(filename, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, 0644);
+    if (sink->fd < 0) {
+        av_freep(&sink->buf_mem);
+        return -1;
+    }
+    return 0;
+}
+
+// 把缓存中已对齐的数据全部写出，剩余不足一个对齐单位的尾巴留在缓存开头
+static int sink_flush(FrameSink *sink) {
+    size_t len = sink->direct ? sink->buf_len & ~static_cast<size_t>(OUTBUF_ALIGN - 1) : sink->buf_len;
+
+    if (!len)
+        return 0;
+    if (write_all(sink->fd, sink->buf, len) < 0)
+        return -1;
+    sink->written += len;
+    sink->buf_len -= len;
+    if (sink->buf_len)
+        memmove(sink->buf, sink->buf + len, sink->buf_len);
+    return 0;
+}
+
+static int sink_append(FrameSink *sink, const uint8_t *data, size_t size) {
+    while (size > 0) {
+        size_t n = FFMIN(size, sink->buf_size - sink->buf_len);
+        memcpy(sink->buf + sink->buf_len, data, n);
+        sink->buf_len += n;
+        data += n;
+        size -= n;
+        if (sink->buf_len == sink->buf_size && sink_flush(sink) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sink_write_frame(FrameSink *sink, const AVFrame *frame, int frame_number) {
+    char header[256];
+    int len, y;
+
+    if (sink->mode == OUTPUT_PGM) {
+        // 文件名可能很长，不用 header 这块暂存区，避免截断后不同的帧写进同一个文件
+        std::string name = std::string(sink->filename) + "-" + std::to_string(frame_number);
+        pgm_save(frame->data[0], frame->linesize[0],
+                 frame->width, frame->height, name.c_str());
+        return 0;
+    }
+
+    if (sink->mode == OUTPUT_Y4M) {
+        if (!sink->header_written) {
+            sink->width = frame->width;
+            sink->height = frame->height;
+            // 裸码流中通常拿不到帧率，默认使用25fps
+            if (sink->framerate.num <= 0 || sink->framerate.den <= 0)
+                sink->framerate = (AVRational) {25, 1};
+            len = snprintf(header, sizeof(header), "YUV4MPEG2 W%d H%d F%d:%d Ip A0:0 Cmono\n",
+                           sink->width, sink->height, sink->framerate.num, sink->framerate.den);
+            if (sink_append(sink, reinterpret_cast<uint8_t *>(header), len) < 0)
+                return -1;
+            sink->header_written = 1;
+        } else if (frame->width != sink->width || frame->height != sink->height) {
+            fprintf(stderr, "Resolution changed to %dx%d, which Y4M output cannot store\n",
+                    frame->width, frame->height);
+            return -1;
+        }
+        if (sink_append(sink, reinterpret_cast<const uint8_t *>("FRAME\n"), 6) < 0)
+            return -1;
+    }
+
+    // 逐行去掉 linesize 的对齐填充，紧凑地追加到批量缓存中
+    for (y = 0; y < frame->height; y++) {
+        if (sink_append(sink, frame->data[0] + y * frame->linesize[0], frame->width) < 0)
+            return -1;
+    }
+    return 0;
+}
+
+static int sink_close(FrameSink *sink) {
+    int ret = 0;
+
+    if (sink->fd >= 0) {
+        if (sink_flush(sink) < 0)
+            ret = -1;
+#ifdef O_DIRECT
+        // O_DIRECT 下最后不足一个对齐单位的数据补齐后写出，再截断回真实长度
+        if (!ret && sink->buf_len) {
+            size_t tail = sink->buf_len;
+            memset(sink->buf + tail, 0, OUTBUF_ALIGN - tail);
+            if (write_all(sink->fd, sink->buf, OUTBUF_ALIGN) < 0 ||
+                ftruncate(sink->fd, sink->written + static_cast<off_t>(tail)) < 0)
+                ret = -1;
+            sink->written += tail;
+            sink->buf_len = 0;
         }
+#endif
+        close(sink->fd);
+        sink->fd = -1;
+    }
+    av_freep(&sink->buf_mem);
+    return ret;
+}
 
-        printf("saving frame %3d\n", dec_ctx->frame_number);
-        fflush(stdout);
+// 各阶段耗时统计
+static LatencyHistogram parse_latency("parse");
+static LatencyHistogram send_latency("send_packet");
+static LatencyHistogram receive_latency("receive_frame");
+static LatencyHistogram postproc_latency("postproc");
+static LatencyHistogram write_latency("fwrite");
+static LatencyHistogram *const stats_stages[] = {&parse_latency, &send_latency, &receive_latency, &postproc_latency,
+                                                 &write_latency};
+#define NB_STATS_STAGES static_cast<int>(sizeof(stats_stages) / sizeof(stats_stages[0]))
 
+// 输出哪些帧，以及实际写出的帧数
+static FrameSelect frame_select = {};
+static int64_t frames_output = 0;
+
+// --crop、--downscale 时写出之前的后处理，只在写出帧的线程上使用
+static PostprocConfig postproc_cfg = {};
+static Postproc *postproc = NULL;
+
+// 后处理一帧，frame 的数据被替换成处理后的结果
+static int postproc_run(AVFrame *frame) {
+    int64_t t;
+    int ret;
+
+    if (!postproc)
+        return 0;
+    t = stats_now();
+    if ((ret = postproc_frame(postproc, frame, 1)) < 0)
+        fprintf(stderr, "Error while post-processing a frame\n");
+    latency_record(&postproc_latency, t);
+    return ret;
+}
+
+/*
+ * 裸码流没有时间戳，送进解码器的压缩包以解码顺序的包序号作为 pts，
+ * 解码帧按 1/帧率 换算成秒；有 B 帧时与显示时间相差重排序的几帧。
+ */
+static double frame_time(const AVFrame *frame, AVRational time_base) {
+    if (frame->pts == AV_NOPTS_VALUE || time_base.num <= 0 || time_base.den <= 0)
+        return -1;
+    return frame->pts * av_q2d(time_base);
+}
+
+static AVRational stream_time_base(const AVCodecContext *c) {
+    return c->framerate.num > 0 && c->framerate.den > 0 ? av_inv_q(c->framerate) : av_make_q(1, 25);
+}
+
+static const CodecTimers decode_timers = {&send_latency, &receive_latency};
+
+// 把压缩包送进解码器，选中的解码帧写到 sink 中；pkt 为空时清空解码器
+static int decode(AVCodecContext *dec_ctx, AVFrame *frame, const AVPacket *pkt, FrameSink *sink) {
+    return core_decode(dec_ctx, pkt, frame, [dec_ctx, sink](AVFrame *f) {
         /* the picture is allocated by the decoder. no need to free it */
-        snprintf(buf, sizeof(buf), "%s-%d", filename, dec_ctx->frame_number);
-        pgm_save(frame->data[0], frame->linesize[0],
-                 frame->width, frame->height, buf);
+        // 解码出第一帧之后解码上下文里才有码流中的帧率信息
+        if (!sink->header_written)
+            sink->framerate = dec_ctx->framerate;
+        if (!frame_select_want(&frame_select, f, frame_time(f, stream_time_base(dec_ctx))))
+            return 0;
+        int ret = postproc_run(f);
+        if (ret < 0)
+            return ret;
+        int64_t t = stats_now();
+        if (sink_write_frame(sink, f, dec_ctx->frame_number) < 0) {
+            fprintf(stderr, "Error writing frame to %s\n", sink->filename);
+            return AVERROR(EIO);
+        }
+        latency_record(&write_latency, t);
+        frames_output++;
+        stats_report_periodic(&stats_reporter, "video_decode", dec_ctx->frame_number, stats_stages, NB_STATS_STAGES);
+        return 0;
+    }, &decode_timers);
+}
+
+/*
+ * 预扫描：用 parser 把整个输入切成压缩包，建立关键帧索引，不做解码。
+ * 索引只记录位置，不保存压缩数据，解码时再按位置从输入中取出。
+ * parser 输出的压缩包首尾相接，依次累加包长就是每个包在输入中的字节偏移；裸码流没有时间戳，pts 记为包序号，
+ * time_base 取 parser 从码流头部得到的帧率，拿不到时按 25fps。
+ * 解析完成后 parser 和输入都停在文件末尾，不能再用于顺序解码。
+ */
+static int index_build(AVCodecParserContext *parser, AVCodecContext *c, InputSource *in, PacketIndex *index) {
+    const uint8_t *data;
+    size_t data_size;
+    uint8_t *out;
+    int64_t offset = 0, t;
+    int out_size, ret;
+    bool eof = false;
+
+    if (index_reset(index, in->filename, av_make_q(1, 25), 0) < 0)
+        return AVERROR(errno);
+
+    while (!eof) {
+        // 读到文件末尾后再用空输入调用一次，取出 parser 中的最后一个压缩包
+        if (!(data_size = input_read(in, &data))) {
+            data = NULL;
+            eof = true;
+        }
+        do {
+            t = stats_now();
+            ret = av_parser_parse2(parser, c, &out, &out_size,
+                                   data, static_cast<int>(data_size), AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+            if (ret < 0)
+                return ret;
+            latency_record(&parse_latency, t);
+            if (data) {
+                data += ret;
+                data_size -= ret;
+            }
+            if (out_size) {
+                // 没有实现 key_frame 的 parser 保持 -1，这时以 I 帧作为关键帧
+                int key = parser->key_frame == 1 || (parser->key_frame < 0 && parser->pict_type == AV_PICTURE_TYPE_I);
+                index_add(index, offset, static_cast<int64_t>(index->entries.size()), out_size, key);
+                offset += out_size;
+            }
+        } while (data_size > 0);
     }
+    if (c->framerate.num > 0 && c->framerate.den > 0)
+        index->time_base = av_inv_q(c->framerate);
+    return 0;
+}
+
+// 一段从一个关键帧开始、到下一段的关键帧之前结束，由一个线程独立解码
+typedef struct Segment {
+    // 在索引中的下标范围 [first, last)
+    size_t first, last;
+    // 只输出段内第 pick 帧（按显示顺序），-1 表示输出整段；number 为该帧在整个码流中的帧序号
+    int64_t pick;
+    int64_t number;
+    // 按显示顺序解码出的帧，写出后释放
+    std::vector<AVFrame *> frames;
+    AVRational framerate;
+    bool done;
+} Segment;
+
+static Segment segment_make(size_t first, size_t last, int64_t pick, int64_t number) {
+    return {first, last, pick, number, {}, {0, 1}, false};
+}
+
+struct SegmentDecoder {
+    // 每段从池中取出一个已打开的解码上下文，解完清空后归还给下一段，不用每段都 avcodec_open2()
+    ContextPool *pool;
+    ContextKey key;
+    const InputSource *in;
+    const std::vector<IndexEntry> *index;
+    AVRational time_base;
+    std::vector<Segment> segments;
+    // 同时解码的线程数
+    int jobs;
+    // 解码线程最多领先写出进度 window 段
+    size_t window;
+
+    // 下一个待领取的段，空闲的线程从这里取走下一段，快的线程自然多解几段
+    std::atomic<size_t> next{0};
+    std::mutex lock;
+    std::condition_variable cond;
+    // 已经写出的段数，受 lock 保护
+    size_t written = 0;
+    std::atomic<bool> abort{false};
+    // 第一个出错的解码线程或者写出时的错误码，受 lock 保护
+    int error = 0;
+};
+
+// 记录第一个错误并让所有线程停下
+static void segments_fail(SegmentDecoder *d, int err) {
+    {
+        std::lock_guard<std::mutex> guard(d->lock);
+        if (!d->error)
+            d->error = err;
+    }
+    d->abort = true;
+    d->cond.notify_all();
+}
+
+// 每个解码线程各自的耗时统计，结束后合并
+struct SegmentWorker {
+    SegmentDecoder *d;
+    // fread 模式下从文件中取段数据所用的文件流和缓存
+    FILE *f = NULL;
+    std::vector<uint8_t> buf;
+    std::vector<uint8_t> prime_buf;
+    // 从解码器取帧用的临时帧，要保留的帧移到新的 AVFrame 里
+    FramePtr frame = core_frame_alloc();
+    LatencyHistogram send_latency{"send_packet"};
+    LatencyHistogram receive_latency{"receive_frame"};
+};
+
+/*
+ * 取得输入中 [offset, offset + size) 的数据。
+ * mmap 模式下直接指向映射区域；fread 模式下读入 buf，后面补上 PADDING。
+ */
+static const uint8_t *segment_data(SegmentWorker *w, std::vector<uint8_t> *buf, int64_t offset, size_t size) {
+    const InputSource *in = w->d->in;
+
+    if (in->mode == INPUT_MMAP)
+        return in->map + offset;
+    if (!w->f && !(w->f = fopen(in->filename, "rb")))
+        return NULL;
+    buf->assign(size + AV_INPUT_BUFFER_PADDING_SIZE, 0);
+#ifdef _WIN32
+    if (_fseeki64(w->f, offset, SEEK_SET) < 0)
+#else
+    if (fseeko(w->f, offset, SEEK_SET) < 0)
+#endif
+        return NULL;
+    if (fread(buf->data(), 1, size, w->f) != size)
+        return NULL;
+    return buf->data();
+}
+
+// 把压缩包送进解码器并取出全部可用的帧；frames 为空时丢弃解码帧
+static int segment_decode_packet(SegmentWorker *w, AVCodecContext *ctx, const AVPacket *pkt,
+                                 std::vector<AVFrame *> *frames) {
+    const CodecTimers timers = {&w->send_latency, &w->receive_latency};
+
+    return core_decode(ctx, pkt, w->frame.get(), [frames](AVFrame *frame) {
+        AVFrame *out;
+        if (!frames)
+            return 0;
+        if (!(out = av_frame_alloc()))
+            return AVERROR(ENOMEM);
+        av_frame_move_ref(out, frame);
+        frames->push_back(out);
+        return 0;
+    }, &timers);
+}
+
+/*
+ * 用一个独立的解码上下文解码一段，正常解完的上下文归还到池中。
+ * 不是从第一个包开始的段，先解码一次整个码流的第一个压缩包再清空解码器：
+ * 很多码流只在开头带有 SPS/PPS、序列头等参数集，后面的关键帧单独无法解码。
+ */
+static int segment_decode(SegmentWorker *w, Segment *seg) {
+    SegmentDecoder *d = w->d;
+    const std::vector<IndexEntry> &index = *d->index;
+    const IndexEntry &first = index[seg->first], &last = index[seg->last - 1];
+    const uint8_t *data;
+    WarmContext warm;
+    AVCodecContext *ctx;
+    PacketPtr pkt = core_packet_alloc();
+    int ret;
+
+    if (!w->frame || !pkt)
+        return AVERROR(ENOMEM);
+    if ((ret = context_pool_get(d->pool, &d->key, &warm)) < 0)
+        return ret;
+    ctx = warm.ctx.get();
+    // 抽帧需要目标之前的每一帧，只有整段输出时才让解码器丢帧
+    if (seg->pick < 0)
+        frame_select_apply(&frame_select, ctx);
+
+    if (seg->first > 0) {
+        if (!(data = segment_data(w, &w->prime_buf, index[0].offset, index[0].size)))
+            return AVERROR(EIO);
+        pkt->data = const_cast<uint8_t *>(data);
+        pkt->size = index[0].size;
+        if ((ret = segment_decode_packet(w, ctx, pkt.get(), NULL)) < 0)
+            return ret;
+        avcodec_flush_buffers(ctx);
+    }
+
+    // 一段在输入中是连续的，一次取出
+    if (!(data = segment_data(w, &w->buf, first.offset, last.offset + last.size - first.offset)))
+        return AVERROR(EIO);
+    for (size_t i = seg->first; i < seg->last; i++) {
+        pkt->data = const_cast<uint8_t *>(data + (index[i].offset - first.offset));
+        pkt->size = index[i].size;
+        pkt->pts = index[i].pts;
+        if ((ret = segment_decode_packet(w, ctx, pkt.get(), &seg->frames)) < 0)
+            return ret;
+        if (d->abort.load())
+            return 0;
+    }
+    // 清空解码器，段内最后几帧也要输出
+    ret = segment_decode_packet(w, ctx, NULL, &seg->frames);
+    seg->framerate = ctx->framerate;
+    if (ret >= 0)
+        context_pool_put(d->pool, &warm);
+    return ret;
+}
+
+static void segment_thread(SegmentWorker *w) {
+    SegmentDecoder *d = w->d;
+    size_t k;
+    int ret;
+
+    trace_thread_name("segment");
+    while ((k = d->next.fetch_add(1)) < d->segments.size()) {
+        {
+            // 写出进度落后太多时先等待，避免解码帧堆积在内存中
+            std::unique_lock<std::mutex> guard(d->lock);
+            d->cond.wait(guard, [&] { return k < d->written + d->window || d->abort.load(); });
+        }
+        if (d->abort.load())
+            break;
+        if ((ret = segment_decode(w, &d->segments[k])) < 0) {
+            char errbuf[AV_ERROR_MAX_STRING_SIZE];
+            fprintf(stderr, "Error decoding segment %zu: %s\n", k, av_make_error_string(errbuf, sizeof(errbuf), ret));
+            segments_fail(d, ret);
+        }
+        {
+            std::lock_guard<std::mutex> guard(d->lock);
+            d->segments[k].done = true;
+        }
+        d->cond.notify_all();
+    }
+    if (w->f)
+        fclose(w->f);
+}
+
+/*
+ * 在 jobs 个线程上解码 d->segments 中的各段，当前线程按段的顺序写出解码帧。
+ * 返回写出的帧数，出错时返回负的错误码，由调用方关闭输出。
+ */
+static int64_t segments_run(SegmentDecoder *d, FrameSink *sink) {
+    int64_t frame_number = 0, t;
+    int ret;
+    int jobs = static_cast<int>(FFMIN(static_cast<size_t>(FFMAX(d->jobs, 1)), d->segments.size()));
+
+    d->window = static_cast<size_t>(jobs) * SEGMENT_WINDOW;
+    std::vector<std::unique_ptr<SegmentWorker>> workers;
+    std::vector<std::thread> threads;
+    for (int i = 0; i < jobs; i++) {
+        workers.emplace_back(new SegmentWorker);
+        workers.back()->d = d;
+        threads.emplace_back(segment_thread, workers.back().get());
+    }
+
+    for (size_t k = 0; k < d->segments.size(); k++) {
+        Segment *seg = &d->segments[k];
+        {
+            std::unique_lock<std::mutex> guard(d->lock);
+            d->cond.wait(guard, [&] { return seg->done || d->abort.load(); });
+        }
+        if (d->abort.load())
+            break;
+        for (size_t i = 0; i < seg->frames.size(); i++) {
+            AVFrame *frame = seg->frames[i];
+            int number = static_cast<int>(seg->pick >= 0 ? seg->number : frame_number + 1);
+            if (seg->pick >= 0 && static_cast<int64_t>(i) != seg->pick)
+                continue;
+            if (seg->pick < 0 && !frame_select_want(&frame_select, frame, frame_time(frame, d->time_base)))
+                continue;
+            if (!sink->header_written)
+                sink->framerate = seg->framerate;
+            if ((ret = postproc_run(frame)) < 0) {
+                segments_fail(d, ret);
+                break;
+            }
+            t = stats_now();
+            if (sink_write_frame(sink, frame, number) < 0) {
+                fprintf(stderr, "Error writing frame to %s\n", sink->filename);
+                segments_fail(d, AVERROR(EIO));
+                break;
+            }
+            latency_record(&write_latency, t);
+            frame_number++;
+            stats_report_periodic(&stats_reporter, "video_decode", frame_number, stats_stages, NB_STATS_STAGES);
+        }
+        if (seg->pick >= static_cast<int64_t>(seg->frames.size()))
+            fprintf(stderr, "Frame %lld could not be decoded\n", static_cast<long long>(seg->number));
+        for (AVFrame *frame : seg->frames)
+            av_frame_free(&frame);
+        seg->frames.clear();
+        {
+            std::lock_guard<std::mutex> guard(d->lock);
+            d->written++;
+        }
+        d->cond.notify_all();
+    }
+    d->cond.notify_all();
+    for (auto &th : threads)
+        th.join();
+
+    for (auto &w : workers) {
+        latency_merge(&send_latency, &w->send_latency);
+        latency_merge(&receive_latency, &w->receive_latency);
+    }
+    for (auto &seg : d->segments) {
+        for (AVFrame *frame : seg.frames)
+            av_frame_free(&frame);
+    }
+    return d->error < 0 ? d->error : frame_number;
+}
+
+/*
+ * 分段并行解码：按关键帧索引把码流切成若干段，每段用独立的解码上下文在线程池中解码，
+ * 再按段的顺序写出，输出与顺序解码一致。
+ * 要求码流是封闭 GOP，开放 GOP 中引用前一段参考帧的 B 帧在段开头无法正确解码。
+ */
+static int64_t decode_segments(SegmentDecoder *d, const PacketIndex *index, FrameSink *sink) {
+    size_t start = 0, keyframes = 0;
+
+    if (index->entries.empty())
+        return 0;
+    // 在关键帧处切段，每段至少 SEGMENT_MIN_PACKETS 个包
+    for (size_t i = 0; i < index->entries.size(); i++) {
+        if (!(index->entries[i].flags & INDEX_FLAG_KEY))
+            continue;
+        keyframes++;
+        if (i - start >= SEGMENT_MIN_PACKETS) {
+            d->segments.push_back(segment_make(start, i, -1, 0));
+            start = i;
+        }
+    }
+    d->segments.push_back(segment_make(start, index->entries.size(), -1, 0));
+    fprintf(stderr, "indexed %zu packets, %zu keyframes, %zu segments\n",
+            index->entries.size(), keyframes, d->segments.size());
+
+    // 只按时间段输出时，不和任何时间段重叠的段整段跳过，不解码
+    if (!frame_select.ranges.empty()) {
+        double tb = av_q2d(index->time_base);
+        std::vector<Segment> needed;
+        for (Segment &seg : d->segments) {
+            // 段尾多算重排序的几帧，段内按显示顺序最后的帧的时间可能晚于最后一个包
+            double start_time = index->entries[seg.first].pts * tb;
+            double end_time = (index->entries[seg.last - 1].pts + EXTRACT_REORDER_PACKETS) * tb;
+            for (const FrameRange &r : frame_select.ranges) {
+                if (start_time <= r.end && end_time >= r.start) {
+                    needed.push_back(std::move(seg));
+                    break;
+                }
+            }
+        }
+        fprintf(stderr, "decoding %zu of %zu segments for the selected ranges\n", needed.size(), d->segments.size());
+        d->segments.swap(needed);
+    }
+    return segments_run(d, sink);
+}
+
+/*
+ * 稀疏抽帧：每个时间点从索引中找到之前最近的关键帧，只解码从这个关键帧到目标帧的压缩包。
+ * 封闭 GOP 中关键帧最先显示，所以目标帧就是这一段按显示顺序的第 (目标序号 - 关键帧序号) 帧；
+ * 段尾多送 EXTRACT_REORDER_PACKETS 个包，保证显示顺序在目标帧之前的帧都已经解码出来。
+ */
+static int64_t extract_frames(SegmentDecoder *d, const PacketIndex *index, const std::vector<double> &times,
+                              FrameSink *sink) {
+    const std::vector<IndexEntry> &entries = index->entries;
+
+    for (double time : times) {
+        int64_t target = llrint(time / av_q2d(index->time_base));
+        int64_t key = index_seek_key(index, target);
+        if (key < 0 || target >= static_cast<int64_t>(entries.size())) {
+            fprintf(stderr, "No frame at %.3f s\n", time);
+            continue;
+        }
+        size_t last = static_cast<size_t>(FFMIN(target + 1 + EXTRACT_REORDER_PACKETS,
+                                                static_cast<int64_t>(entries.size())));
+        d->segments.push_back(segment_make(static_cast<size_t>(key), last, target - entries[key].pts, target + 1));
+    }
+    return segments_run(d, sink);
 }
 
 int main(int argc, char **argv) {
     if (argc <= 3) {
-        fprintf(stderr, "Usage: %s <input file> <output file> <codec name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <input file> <output file> <codec name> [options]\n"
+                        "  --input fread|mmap   input mode (default: fread)\n"
+                        "  --window <bytes>     bytes handed to the parser per call\n"
+                        "                       (default: %d for fread, %d for mmap)\n"
+                        "  --output y4m|raw|pgm luma output format (default: y4m);\n"
+                        "                       pgm writes one <output file>-N file per frame\n"
+                        "  --write-batch <bytes> output write batch size (default: %d)\n"
+                        "  --direct             open the output with O_DIRECT\n"
+                        "  --threads <n|auto|numa> decoder threads; auto uses every usable CPU,\n"
+                        "                       numa binds to the current NUMA node first\n"
+                        "  --thread-type frame|slice|both decoder threading method\n"
+                        "  --parallel-gops <n|auto|numa> index the keyframes first, then decode closed-GOP\n"
+                        "                       segments on n threads with one context each; --threads\n"
+                        "                       then applies to every segment context (default: 1)\n"
+                        "  --index              keep the keyframe index in <input file>%s and reuse it\n"
+                        "                       while the input is unchanged\n"
+                        FRAME_SELECT_OPTIONS_HELP
+                        POSTPROC_OPTIONS_HELP
+                        "  --extract <t,...>    only decode the frames at these times (seconds), starting\n"
+                        "                       each one at the preceding keyframe in the index\n"
+                        STATS_OPTIONS_HELP,
+                argv[0], INBUF_SIZE, MMAP_WINDOW_SIZE, OUTBUF_SIZE, INDEX_SUFFIX);
         exit(0);
     }
     const char *filename = argv[1];
     const char *outfilename = argv[2];
     const char *codec_name = argv[3];
 
+    enum InputMode input_mode = INPUT_FREAD;
+    size_t window = 0;
+    enum OutputMode output_mode = OUTPUT_Y4M;
+    size_t write_batch = OUTBUF_SIZE;
+    int direct = 0;
+    const char *threads = NULL;
+    int thread_type = 0;
+    const char *parallel_gops = NULL;
+    int use_index = 0;
+    std::vector<double> extract_times;
+    for (int i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "fread"))
+                input_mode = INPUT_FREAD;
+            else if (!strcmp(mode, "mmap"))
+                input_mode = INPUT_MMAP;
+            else {
+                fprintf(stderr, "Unknown input mode '%s'\n", mode);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--window") && i + 1 < argc) {
+            window = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--output") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "y4m"))
+                output_mode = OUTPUT_Y4M;
+            else if (!strcmp(mode, "raw"))
+                output_mode = OUTPUT_RAW;
+            else if (!strcmp(mode, "pgm"))
+                output_mode = OUTPUT_PGM;
+            else {
+                fprintf(stderr, "Unknown output mode '%s'\n", mode);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--write-batch") && i + 1 < argc) {
+            write_batch = strtoul(argv[++i], NULL, 0);
+        } else if (!strcmp(argv[i], "--direct")) {
+            direct = 1;
+        } else if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = argv[++i];
+        } else if (!strcmp(argv[i], "--thread-type") && i + 1 < argc) {
+            if ((thread_type = parse_thread_type(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown thread type '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--parallel-gops") && i + 1 < argc) {
+            parallel_gops = argv[++i];
+        } else if (!strcmp(argv[i], "--index")) {
+            use_index = 1;
+        } else if (!strcmp(argv[i], "--extract") && i + 1 < argc) {
+            if (index_parse_times(argv[++i], &extract_times) < 0) {
+                fprintf(stderr, "Invalid time list '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (frame_select_parse_option(argc, argv, &i, &frame_select)) {
+        } else if (postproc_parse_option(argc, argv, &i, &postproc_cfg)) {
+        } else if (stats_parse_option(argc, argv, &i)) {
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    // av_parser_parse2() 的输入长度是 int
+    if (!window || window > INT_MAX - AV_INPUT_BUFFER_PADDING_SIZE)
+        window = input_mode == INPUT_MMAP ? MMAP_WINDOW_SIZE : INBUF_SIZE;
+
     /* 根据名称查询解码器 */
-    AVCodec *codec = avcodec_find_decoder_by_name(codec_name);
-    if (!codec) {
+    const AVCodec *codec;
+    if (core_find_codec(codec_name, false, &codec) < 0) {
         fprintf(stderr, "Codec '%s' not found\n", codec_name);
         exit(1);
     }
@@ -89,96 +954,206 @@ int main(int argc, char **argv) {
         exit(1);
     }
 
+    /*
+     * 多线程解码配置，必须在 avcodec_open2() 之前设置。
+     * 帧级多线程同时解码多帧，会增加 thread_count 帧的延迟；片级多线程只对多 slice 的码流有效。
+     * 分段解码（并行解码和抽帧）时这个上下文只供 parser 使用，线程配置交给各段的解码上下文。
+     */
+    bool segmented = parallel_gops || !extract_times.empty();
+    int jobs = parallel_gops ? resolve_thread_count(parallel_gops) : 1;
+    int thread_count = threads ? resolve_thread_count(threads) : 0;
+    if (thread_type && !thread_type_supported(codec, thread_type))
+        fprintf(stderr, "Decoder %s does not support %s threading\n", codec->name, thread_type_name(thread_type));
+
     /*
      * 根据解码器创建解码上下文
      * 某些解码器（如：msmpeg4和mpeg4）必须初始化图像分辨率信息，
      * 因为它们的数据流中没有保存分辨率信息
      */
-    AVCodecContext *c = avcodec_alloc_context3(codec);
-    if (!c) {
+    CodecContextPtr c;
+    if (core_decoder_alloc(&c, codec, segmented ? 1 : thread_count, segmented ? 0 : thread_type) < 0) {
         fprintf(stderr, "Could not allocate video codec context\n");
         exit(1);
     }
+    if (!segmented)
+        frame_select_apply(&frame_select, c.get());
 
     // 初始化AVFrame，解码时，不需要配置分辨率，也不需要申请帧数据内存空间
-    AVFrame *frame = av_frame_alloc();
+    FramePtr frame = core_frame_alloc();
     if (!frame) {
         fprintf(stderr, "Could not allocate video frame\n");
         exit(1);
     }
 
     // 初始化AVPacket
-    AVPacket *pkt = av_packet_alloc();
+    PacketPtr pkt = core_packet_alloc();
     if (!pkt)
         exit(1);
 
     // 打开解码上下文
-    if (avcodec_open2(c, codec, NULL) < 0) {
+    if (avcodec_open2(c.get(), codec, NULL) < 0) {
         fprintf(stderr, "Could not open codec\n");
         exit(1);
     }
 
-    // 打开待解码视频的文件流
-    FILE *f = fopen(filename, "rb");
-    if (!f) {
+    // 打开待解码视频的输入源
+    InputSource in;
+    if (input_open(&in, filename, input_mode, window) < 0) {
         fprintf(stderr, "Could not open %s\n", filename);
         exit(1);
     }
 
-    // 输入缓存，除了指定缓冲区大小，还要多加一个PADDING_SIZE的大小（av_parser_parse2()函数的输入数组需要腾出这个空间）
-    uint8_t inbuf[INBUF_SIZE + AV_INPUT_BUFFER_PADDING_SIZE];
-    // 对 PADDING 部分的缓存值都置为0，避免数据干扰
-    memset(inbuf + INBUF_SIZE, 0, AV_INPUT_BUFFER_PADDING_SIZE);
-    // 作为inbuf数组上的游标指针使用
-    uint8_t *data;
-    // 用于记录fread()函数返回值
+    if (postproc_enabled(&postproc_cfg) && postproc_alloc(&postproc, &postproc_cfg) < 0) {
+        fprintf(stderr, "Could not allocate the post-processing stage\n");
+        exit(1);
+    }
+    if (postproc)
+        fprintf(stderr, "post-processing with %s kernels\n", postproc_impl());
+
+    // 打开解码帧的输出
+    FrameSink sink;
+    if (sink_open(&sink, outfilename, output_mode, write_batch, direct) < 0) {
+        fprintf(stderr, "Could not open %s\n", outfilename);
+        exit(1);
+    }
+
+    // 统计解码吞吐量
+    int64_t start_time = av_gettime_relative();
+    stats_init();
+    clock_t start_cpu = clock();
+
+    // 作为输入数据上的游标指针使用
+    const uint8_t *data;
+    // 用于记录input_read()函数返回值
     size_t data_size;
     // 用于记录av_parser_parse2()函数返回值
     int ret;
 
-    // 开始对视频进行解码
-    while (!feof(f)) {
-        // 从视频文件流中读取裸数据到缓存中
-        data_size = fread(inbuf, 1, INBUF_SIZE, f);
-        if (!data_size)
-            break;
+    if (segmented) {
+        PacketIndex index;
+        std::string index_file = index_path(filename);
+        SegmentDecoder d;
+        int64_t frames;
+
+        // 输入没有变化时直接读取上次保存的索引，不再从头解析整个文件
+        if (!use_index || index_load(&index, index_file.c_str(), filename) < 0) {
+            if (index_build(parser, c.get(), &in, &index) < 0) {
+                fprintf(stderr, "Error while parsing\n");
+                exit(1);
+            }
+            if (use_index && index_save(&index, index_file.c_str()) < 0)
+                fprintf(stderr, "Could not write index %s\n", index_file.c_str());
+        }
 
-        data = inbuf;
-        while (data_size > 0) {
+        // 每个线程同时只用一个上下文，池中最多留 jobs 个
+        context_pool_alloc(&d.pool, static_cast<size_t>(FFMAX(jobs, 1)));
+        d.key = decoder_key(codec->name, false, thread_count > 0 ? thread_count : 1, thread_type);
+        d.in = &in;
+        d.index = &index.entries;
+        d.time_base = index.time_base;
+        d.jobs = jobs;
+        if (!extract_times.empty())
+            frames = extract_frames(&d, &index, extract_times, &sink);
+        else
+            frames = decode_segments(&d, &index, &sink);
+        if (frames < 0) {
+            // 先关闭输出（O_DIRECT 时补齐并截断尾部）和输入，再退出
+            char errbuf[AV_ERROR_MAX_STRING_SIZE];
+            fprintf(stderr, "Error during decoding: %s\n",
+                    av_make_error_string(errbuf, sizeof(errbuf), static_cast<int>(frames)));
+            context_pool_free(&d.pool);
+            input_close(&in);
+            sink_close(&sink);
+            av_parser_close(parser);
+            postproc_free(&postproc);
+            exit(1);
+        }
+        double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+        double cpu = static_cast<double>(clock() - start_cpu) / CLOCKS_PER_SEC;
+        fprintf(stderr, "decoded %lld frames in %.3f s (%.2f fps), cpu %.3f s (%.0f%%), %d segment threads\n",
+                static_cast<long long>(frames), elapsed, elapsed > 0 ? frames / elapsed : 0.0,
+                cpu, elapsed > 0 ? cpu * 100 / elapsed : 0.0, jobs);
+        context_pool_report(d.pool, "video_decode");
+        context_pool_free(&d.pool);
+
+        input_close(&in);
+        if (sink_close(&sink) < 0) {
+            fprintf(stderr, "Error writing %s\n", outfilename);
+            exit(1);
+        }
+        StatsReport report = {"video_decode", frames, sink.written, elapsed, stats_stages, NB_STATS_STAGES};
+        stats_finish(&report, NULL, 0);
+
+        av_parser_close(parser);
+        postproc_free(&postproc);
+        return 0;
+    }
+
+    // 开始对视频进行解码
+    int64_t t;
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    // 过了最后一个时间段就不再读取输入
+    int64_t packet_number = 0;
+    while (!frame_select.finished && (data_size = input_read(&in, &data)) > 0) {
+        while (data_size > 0 && !frame_select.finished) {
             /*
              * 使用parser将缓存中的裸数据切分成若干压缩包。
              * pkt->size为0时，说明当前解码器缓冲区中的压缩编码数据不足以形成一个压缩包进行解码，还需要读更多的压缩编码数据。
              * 与编码过程相反，编码时需要足够多的帧填满缓冲区再压缩成压缩包，这里需要足够多的压缩编码数据形成一个压缩包。
              */
-            ret = av_parser_parse2(parser, c, &pkt->data, &pkt->size,
-                                   data, data_size, AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
+            t = stats_now();
+            ret = av_parser_parse2(parser, c.get(), &pkt->data, &pkt->size,
+                                   data, static_cast<int>(data_size), AV_NOPTS_VALUE, AV_NOPTS_VALUE, 0);
             if (ret < 0) {
                 fprintf(stderr, "Error while parsing\n");
                 exit(1);
             }
+            latency_record(&parse_latency, t);
             data += ret;
             data_size -= ret;
 
             /*
              * 若足够形成压缩包，则对压缩包中的压缩编码数据进行解码。
-             * 把解码后的每帧数据输出到 "outfilename-{idx}" 文件中，idx 指帧位置下标。
+             * 把解码后的每帧亮度数据输出到 sink 中（PGM 模式下为 "outfilename-{idx}" 文件，idx 指帧位置下标）。
              */
-            if (pkt->size)
-                decode(c, frame, pkt, outfilename);
+            if (pkt->size) {
+                pkt->pts = packet_number++;
+                if ((ret = decode(c.get(), frame.get(), pkt.get(), &sink)) < 0) {
+                    fprintf(stderr, "Error during decoding: %s\n", av_make_error_string(errbuf, sizeof(errbuf), ret));
+                    exit(1);
+                }
+            }
         }
     }
 
     // 向解码器发送一个 NULL 压缩包，表示告知解码器要清空缓冲区，把还未解码的压缩包一并解码返回，然后发送EOS信号。
-    decode(c, frame, NULL, outfilename);
+    if ((ret = decode(c.get(), frame.get(), NULL, &sink)) < 0) {
+        fprintf(stderr, "Error during decoding: %s\n", av_make_error_string(errbuf, sizeof(errbuf), ret));
+        exit(1);
+    }
 
-    // 关闭视频文件流
-    fclose(f);
+    double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    double cpu = static_cast<double>(clock() - start_cpu) / CLOCKS_PER_SEC;
+    fprintf(stderr, "decoded %d frames in %.3f s (%.2f fps), cpu %.3f s (%.0f%%), threads=%d type=%s\n",
+            c->frame_number, elapsed, elapsed > 0 ? c->frame_number / elapsed : 0.0,
+            cpu, elapsed > 0 ? cpu * 100 / elapsed : 0.0,
+            c->thread_count, thread_type_name(c->active_thread_type));
+    if (frame_select_active(&frame_select))
+        fprintf(stderr, "wrote %lld of the decoded frames\n", static_cast<long long>(frames_output));
+
+    // 关闭输入源，写出剩余的输出数据
+    input_close(&in);
+    if (sink_close(&sink) < 0) {
+        fprintf(stderr, "Error writing %s\n", outfilename);
+        exit(1);
+    }
+
+    StatsReport report = {"video_decode", c->frame_number, sink.written, elapsed, stats_stages, NB_STATS_STAGES};
+    stats_finish(&report, NULL, 0);
 
-    // 释放资源
+    // 释放资源，解码上下文、帧和包离开作用域时释放
     av_parser_close(parser);
-    avcodec_free_context(&c);
-    av_frame_free(&frame);
-    av_packet_free(&pkt);
+    postproc_free(&postproc);
 
     return 0;
 }
@@ -0,0 +1,304 @@
+/**
+ * @file
+ * synthetic test pattern generators for video_encode
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <vector>
+
+#include "cpu_dispatch.h"
+#include "test_pattern.h"
+
+// 噪声由 4 路独立的 xorshift64 生成，每轮输出 32 字节
+#define NOISE_LANES 4
+#define NOISE_BLOCK (NOISE_LANES * 8)
+
+/*
+ * 与 CPU 相关的内核。
+ * ramp:  dst[x] = start + x（按 256 取模）
+ * noise: 从 state 继续生成 n 个字节的噪声，n 不足 NOISE_BLOCK 的尾部由调用方处理
+ */
+typedef struct PatternDSP {
+    const char *name;
+    int cpu_flags;
+    void (*ramp)(uint8_t *dst, int n, uint8_t start);
+    int (*noise)(uint8_t *dst, int n, uint64_t state[NOISE_LANES]);
+} PatternDSP;
+
+static inline uint64_t xorshift64(uint64_t x) {
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return x;
+}
+
+static inline uint64_t splitmix64(uint64_t x) {
+    x += 0x9e3779b97f4a7c15ULL;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    return x ^ (x >> 31);
+}
+
+static void ramp_c(uint8_t *dst, int n, uint8_t start) {
+    for (int x = 0; x < n; x++)
+        dst[x] = static_cast<uint8_t>(start + x);
+}
+
+// 返回已经写入的字节数（NOISE_BLOCK 的整数倍）
+static int noise_c(uint8_t *dst, int n, uint64_t state[NOISE_LANES]) {
+    int x;
+
+    for (x = 0; x + NOISE_BLOCK <= n; x += NOISE_BLOCK) {
+        for (int l = 0; l < NOISE_LANES; l++) {
+            state[l] = xorshift64(state[l]);
+            memcpy(dst + x + l * 8, &state[l], 8);
+        }
+    }
+    return x;
+}
+
+#ifdef HAVE_AVX2_KERNELS
+__attribute__((target("avx2")))
+static void ramp_avx2(uint8_t *dst, int n, uint8_t start) {
+    const __m256i step = _mm256_set1_epi8(32);
+    __m256i v = _mm256_add_epi8(_mm256_setr_epi8(0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15,
+                                                 16, 17, 18, 19, 20, 21, 22, 23, 24, 25, 26, 27, 28, 29, 30, 31),
+                                _mm256_set1_epi8(static_cast<char>(start)));
+    int x;
+
+    for (x = 0; x + 32 <= n; x += 32) {
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), v);
+        v = _mm256_add_epi8(v, step);
+    }
+    ramp_c(dst + x, n - x, static_cast<uint8_t>(start + x));
+}
+
+__attribute__((target("avx2")))
+static int noise_avx2(uint8_t *dst, int n, uint64_t state[NOISE_LANES]) {
+    __m256i s = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(state));
+    int x;
+
+    for (x = 0; x + NOISE_BLOCK <= n; x += NOISE_BLOCK) {
+        s = _mm256_xor_si256(s, _mm256_slli_epi64(s, 13));
+        s = _mm256_xor_si256(s, _mm256_srli_epi64(s, 7));
+        s = _mm256_xor_si256(s, _mm256_slli_epi64(s, 17));
+        _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + x), s);
+    }
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(state), s);
+    return x;
+}
+#endif
+
+#ifdef HAVE_NEON_KERNELS
+static void ramp_neon(uint8_t *dst, int n, uint8_t start) {
+    static const uint8_t base[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    const uint8x16_t step = vdupq_n_u8(16);
+    uint8x16_t v = vaddq_u8(vld1q_u8(base), vdupq_n_u8(start));
+    int x;
+
+    for (x = 0; x + 16 <= n; x += 16) {
+        vst1q_u8(dst + x, v);
+        v = vaddq_u8(v, step);
+    }
+    ramp_c(dst + x, n - x, static_cast<uint8_t>(start + x));
+}
+
+static inline uint64x2_t xorshift64x2(uint64x2_t s) {
+    s = veorq_u64(s, vshlq_n_u64(s, 13));
+    s = veorq_u64(s, vshrq_n_u64(s, 7));
+    return veorq_u64(s, vshlq_n_u64(s, 17));
+}
+
+static int noise_neon(uint8_t *dst, int n, uint64_t state[NOISE_LANES]) {
+    uint64x2_t s0 = vld1q_u64(state), s1 = vld1q_u64(state + 2);
+    int x;
+
+    for (x = 0; x + NOISE_BLOCK <= n; x += NOISE_BLOCK) {
+        s0 = xorshift64x2(s0);
+        s1 = xorshift64x2(s1);
+        vst1q_u8(dst + x, vreinterpretq_u8_u64(s0));
+        vst1q_u8(dst + x + 16, vreinterpretq_u8_u64(s1));
+    }
+    vst1q_u64(state, s0);
+    vst1q_u64(state + 2, s1);
+    return x;
+}
+#endif
+
+static const PatternDSP pattern_dsps[] = {
+#ifdef HAVE_AVX2_KERNELS
+    {"avx2", AV_CPU_FLAG_AVX2, ramp_avx2, noise_avx2},
+#endif
+#ifdef HAVE_NEON_KERNELS
+    {"neon", AV_CPU_FLAG_NEON, ramp_neon, noise_neon},
+#endif
+    {"c", 0, ramp_c, noise_c},
+};
+
+static const PatternDSP *pattern_dsp(void) {
+    static const PatternDSP *dsp = cpu_dispatch(pattern_dsps);
+    return dsp;
+}
+
+// 把 plane 的第一行复制到其余各行
+static void replicate_row(uint8_t *plane, int linesize, int width, int height) {
+    for (int y = 1; y < height; y++)
+        memcpy(plane + y * linesize, plane, width);
+}
+
+static void fill_gradient(AVFrame *frame, int i) {
+    const PatternDSP *dsp = pattern_dsp();
+    int cw = frame->width / 2, ch = frame->height / 2;
+    int y;
+
+    /* Y: 每一行都是从 y + 3i 开始逐像素加一的斜坡 */
+    for (y = 0; y < frame->height; y++)
+        dsp->ramp(frame->data[0] + y * frame->linesize[0], frame->width, static_cast<uint8_t>(y + i * 3));
+
+    /* Cb 每一行是常数，Cr 每一行都相同 */
+    for (y = 0; y < ch; y++)
+        memset(frame->data[1] + y * frame->linesize[1], static_cast<uint8_t>(128 + y + i * 2), cw);
+    dsp->ramp(frame->data[2], cw, static_cast<uint8_t>(64 + i * 5));
+    replicate_row(frame->data[2], frame->linesize[2], cw, ch);
+}
+
+static void fill_bars(AVFrame *frame, int i) {
+    // 75% 彩条（BT.601）：白、黄、青、绿、品红、红、蓝、黑
+    static const uint8_t bars[8][3] = {
+            {180, 128, 128}, {162, 44, 142}, {131, 156, 44}, {112, 72, 58},
+            {84, 184, 198}, {65, 100, 212}, {35, 212, 114}, {16, 128, 128},
+    };
+    int w = frame->width, cw = frame->width / 2, ch = frame->height / 2;
+    // 每帧向左移动 4 个像素
+    int shift = i * 4;
+    int x;
+
+    for (x = 0; x < w; x++)
+        frame->data[0][x] = bars[(static_cast<int64_t>(x + shift) % w) * 8 / w][0];
+    for (x = 0; x < cw; x++) {
+        int bar = static_cast<int>((static_cast<int64_t>(2 * x + shift) % w) * 8 / w);
+        frame->data[1][x] = bars[bar][1];
+        frame->data[2][x] = bars[bar][2];
+    }
+    replicate_row(frame->data[0], frame->linesize[0], w, frame->height);
+    replicate_row(frame->data[1], frame->linesize[1], cw, ch);
+    replicate_row(frame->data[2], frame->linesize[2], cw, ch);
+}
+
+static void fill_noise_plane(uint8_t *plane, int linesize, int width, int height, uint64_t seed) {
+    const PatternDSP *dsp = pattern_dsp();
+    uint64_t state[NOISE_LANES];
+    uint8_t tail[NOISE_BLOCK];
+
+    for (int l = 0; l < NOISE_LANES; l++)
+        state[l] = splitmix64(seed * NOISE_LANES + l) | 1;
+    for (int y = 0; y < height; y++) {
+        uint8_t *row = plane + y * linesize;
+        int x = dsp->noise(row, width, state);
+        // 行尾不足一个块的部分先生成到临时缓存中，保证各实现输出一致
+        if (x < width) {
+            noise_c(tail, NOISE_BLOCK, state);
+            memcpy(row + x, tail, width - x);
+        }
+    }
+}
+
+static void fill_noise(AVFrame *frame, int i) {
+    // 噪声只由帧序号决定，重复运行得到相同的输入
+    for (int p = 0; p < 3; p++) {
+        int shift = p ? 1 : 0;
+        fill_noise_plane(frame->data[p], frame->linesize[p], frame->width >> shift,
+                         frame->height >> shift, static_cast<uint64_t>(i) * 3 + p);
+    }
+}
+
+int test_pattern_from_name(const char *name) {
+    if (!strcmp(name, "gradient"))
+        return PATTERN_GRADIENT;
+    if (!strcmp(name, "bars"))
+        return PATTERN_BARS;
+    if (!strcmp(name, "noise"))
+        return PATTERN_NOISE;
+    return -1;
+}
+
+const char *test_pattern_name(enum TestPattern pattern) {
+    switch (pattern) {
+    case PATTERN_BARS:
+        return "bars";
+    case PATTERN_NOISE:
+        return "noise";
+    default:
+        return "gradient";
+    }
+}
+
+const char *test_pattern_impl(void) {
+    return pattern_dsp()->name;
+}
+
+void test_pattern_fill(AVFrame *frame, enum TestPattern pattern, int i) {
+    switch (pattern) {
+    case PATTERN_BARS:
+        fill_bars(frame, i);
+        break;
+    case PATTERN_NOISE:
+        fill_noise(frame, i);
+        break;
+    default:
+        fill_gradient(frame, i);
+        break;
+    }
+}
+
+// 对比一个版本和 C 版本在 n 个字节上的输出，n 之后的字节也不能被改写
+static bool check_kernels(const PatternDSP *dsp, const PatternDSP *ref, int n) {
+    std::vector<uint8_t> a(n + 64), b;
+    uint64_t sa[NOISE_LANES], sb[NOISE_LANES];
+    int xa, xb;
+    bool ok = true;
+
+    for (int start : {0, 1, 200, 255}) {
+        cpu_check_fill(a.data(), a.size(), static_cast<uint64_t>(n));
+        b = a;
+        ref->ramp(a.data(), n, static_cast<uint8_t>(start));
+        dsp->ramp(b.data(), n, static_cast<uint8_t>(start));
+        ok = ok && a == b;
+    }
+
+    // 写入的字节数和之后的状态也要相同，行尾由调用方接着用 C 版本生成
+    for (int l = 0; l < NOISE_LANES; l++)
+        sa[l] = sb[l] = splitmix64(static_cast<uint64_t>(n) * NOISE_LANES + l) | 1;
+    cpu_check_fill(a.data(), a.size(), ~static_cast<uint64_t>(n));
+    b = a;
+    xa = ref->noise(a.data(), n, sa);
+    xb = dsp->noise(b.data(), n, sb);
+    return ok && xa == xb && a == b && !memcmp(sa, sb, sizeof(sa));
+}
+
+int test_pattern_check_kernels(void) {
+    const PatternDSP *ref = &pattern_dsps[FF_ARRAY_ELEMS(pattern_dsps) - 1];
+    static const int widths[] = {176, 351, 352, 353, 639, 640, 641, 959, 960, 961, 1279, 1280, 1919, 1920};
+    int failed = 0;
+
+    for (const PatternDSP &dsp : pattern_dsps) {
+        int bad = 0;
+        if (&dsp == ref)
+            continue;
+        if (!cpu_dispatch_usable(dsp)) {
+            fprintf(stderr, "test_pattern: %s kernels not supported by this CPU, skipped\n", dsp.name);
+            continue;
+        }
+        // 所有短于一轮 SIMD 的尾巴和奇数宽度
+        for (int n = 0; n <= 100; n++)
+            bad += !check_kernels(&dsp, ref, n);
+        for (int n : widths)
+            bad += !check_kernels(&dsp, ref, n);
+        fprintf(stderr, "test_pattern: %s kernels %s the C kernels\n", dsp.name, bad ? "differ from" : "match");
+        failed += bad != 0;
+    }
+    return failed;
+}
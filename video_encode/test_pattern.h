@@ -0,0 +1,39 @@
+/**
+ * @file
+ * synthetic test pattern generators for video_encode
+ */
+
+#ifndef VIDEO_ENCODE_TEST_PATTERN_H
+#define VIDEO_ENCODE_TEST_PATTERN_H
+
+extern "C" {
+#include <libavutil/frame.h>
+}
+
+enum TestPattern {
+    // 原来的渐变图案：Y = x + y + 3i，Cb = 128 + y + 2i，Cr = 64 + x + 5i
+    PATTERN_GRADIENT,
+    // 随帧水平移动的 75% 彩条
+    PATTERN_BARS,
+    // 每帧不同的伪随机噪声，编码器最难压缩的输入
+    PATTERN_NOISE,
+};
+
+// 根据名称查找图案，找不到时返回 -1
+int test_pattern_from_name(const char *name);
+
+const char *test_pattern_name(enum TestPattern pattern);
+
+// 当前 CPU 上使用的实现："avx2"、"neon" 或 "c"
+const char *test_pattern_impl(void);
+
+/*
+ * 对比当前 CPU 能运行的每个 SIMD 版本和 C 版本的输出，返回输出不同的版本个数。
+ * 各版本逐字节相同时，同一个图案在任何机器上编码出相同的码流。
+ */
+int test_pattern_check_kernels(void);
+
+// 把第 i 帧的图案写入已经分配好缓存的 YUV420P 帧
+void test_pattern_fill(AVFrame *frame, enum TestPattern pattern, int i);
+
+#endif // VIDEO_ENCODE_TEST_PATTERN_H
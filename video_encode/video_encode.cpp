@@ -5,104 +5,971 @@
  * @example video_encode.cpp
  */
 
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "async_writer.h"
+#include "core.h"
+#include "spsc_queue.h"
+#include "stats.h"
+#include "test_pattern.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 
 /* C++编译时要添加 extern "C" */
 extern "C" {
 #include <libavcodec/avcodec.h>
-#include <libavutil/opt.h>
+#include <libavformat/avformat.h>
+#include <libavutil/imgutils.h>
+#include <libavutil/time.h>
+#include <libswscale/swscale.h>
+}
+
+// 输入文件默认预读的帧数
+#define READAHEAD_FRAMES 8
+// 生产者与编码器之间轮转使用的帧数
+#define FRAME_RING_SIZE 4
+// 合成测试图案的默认帧数（25fps 下一秒钟）
+#define TEST_PATTERN_FRAMES 25
+// 压缩包攒够多少 KiB 再写出
+#define WRITE_BATCH_KB 4096
+// 封装格式输出时 AVIOContext 的缓存大小，--write-batch 为 0 时使用
+#define MUX_IO_BUFFER_KB 1024
+// 除主输出之外最多的码率档位个数
+#define MAX_RENDITIONS 16
+// 每个档位统计的阶段：缩放、送帧、取包、写出、帧在编码器中的延迟
+#define NB_RENDITION_STAGES 5
+
+/*
+ * 原始 YUV420P / Y4M 输入。
+ * 普通文件整个映射到内存，每帧的 AVFrame 通过 av_buffer_create() 直接引用映射区域，没有任何拷贝；
+ * 管道等无法映射的输入逐帧读入 AVBufferPool 中复用的缓存。
+ */
+typedef struct FrameReader {
+    int y4m;
+    int width, height;
+    AVRational framerate;
+    // 一帧 YUV420P 数据的字节数
+    size_t frame_size;
+    // 预读的帧数
+    int readahead;
+
+    // mmap 方式：map_ref 持有整个映射区域，每个帧缓存再各自持有 map_ref 的一个引用
+    AVBufferRef *map_ref;
+    const uint8_t *map;
+    size_t map_size;
+    size_t pos;
+
+    // 流式读取方式
+    FILE *f;
+    AVBufferPool *pool;
+} FrameReader;
+
+/*
+ * 解析 Y4M 文件头，例如 "YUV4MPEG2 W352 H288 F25:1 Ip A1:1 C420jpeg"。
+ * 只支持 4:2:0 8bit 的色彩空间，其余参数（隔行、宽高比等）忽略。
+ */
+static int parse_y4m_header(FrameReader *r, const char *header) {
+    const char *p = header + 9;
+
+    r->width = r->height = 0;
+    while (*p == ' ') {
+        const char *tag = ++p;
+        switch (*tag) {
+        case 'W':
+            r->width = atoi(tag + 1);
+            break;
+        case 'H':
+            r->height = atoi(tag + 1);
+            break;
+        case 'F':
+            if (sscanf(tag + 1, "%d:%d", &r->framerate.num, &r->framerate.den) != 2)
+                return -1;
+            break;
+        case 'C':
+            if (strncmp(tag + 1, "420", 3) || (tag[4] != ' ' && tag[4] != '\n' && strncmp(tag + 4, "jpeg", 4) &&
+                                               strncmp(tag + 4, "mpeg2", 5) && strncmp(tag + 4, "paldv", 5))) {
+                fprintf(stderr, "Unsupported Y4M colorspace, only 8-bit 4:2:0 input is supported\n");
+                return -1;
+            }
+            break;
+        }
+        while (*p && *p != ' ' && *p != '\n')
+            p++;
+    }
+    return r->width > 0 && r->height > 0 && r->framerate.num > 0 && r->framerate.den > 0 ? 0 : -1;
+}
+
+#ifndef _WIN32
+static void map_free(void *opaque, uint8_t *data) {
+    munmap(data, reinterpret_cast<uintptr_t>(opaque));
+}
+
+static int reader_map(FrameReader *r, const char *filename) {
+    struct stat st;
+    void *map;
+    int fd;
+
+    if ((fd = open(filename, O_RDONLY)) < 0)
+        return -1;
+    if (fstat(fd, &st) < 0 || !S_ISREG(st.st_mode) || st.st_size == 0) {
+        close(fd);
+        return -1;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return -1;
+    madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+    // 映射区域可能超过 int 的范围，AVBufferRef 的 size 不使用，映射长度通过 opaque 传给 map_free()
+    r->map_ref = av_buffer_create(static_cast<uint8_t *>(map), 0, map_free,
+                                  reinterpret_cast<void *>(static_cast<uintptr_t>(st.st_size)), AV_BUFFER_FLAG_READONLY);
+    if (!r->map_ref) {
+        munmap(map, st.st_size);
+        return -1;
+    }
+    r->map = static_cast<const uint8_t *>(map);
+    r->map_size = static_cast<size_t>(st.st_size);
+    r->pos = 0;
+    return 0;
+}
+#endif
+
+// 读取一行 Y4M 头（文件头或帧头），不包含结尾的换行符
+static int reader_read_line(FrameReader *r, char *line, size_t size) {
+    size_t n = 0;
+
+    if (r->map) {
+        const uint8_t *end = static_cast<const uint8_t *>(memchr(r->map + r->pos, '\n', r->map_size - r->pos));
+        if (!end)
+            return -1;
+        n = FFMIN(static_cast<size_t>(end - (r->map + r->pos)), size - 1);
+        memcpy(line, r->map + r->pos, n);
+        r->pos = end - r->map + 1;
+    } else {
+        int ch;
+        while ((ch = fgetc(r->f)) != '\n') {
+            if (ch == EOF)
+                return -1;
+            if (n < size - 1)
+                line[n++] = static_cast<char>(ch);
+        }
+    }
+    line[n] = 0;
+    return 0;
+}
+
+static int reader_open(FrameReader *r, const char *filename, int width, int height,
+                       AVRational framerate, int readahead) {
+    char header[256];
+
+    memset(r, 0, sizeof(*r));
+    r->width = width;
+    r->height = height;
+    r->framerate = framerate;
+    r->readahead = readahead;
+
+#ifndef _WIN32
+    if (strcmp(filename, "-") && reader_map(r, filename) < 0)
+        fprintf(stderr, "Could not mmap %s, reading it as a stream\n", filename);
+#endif
+    if (!r->map) {
+        r->f = strcmp(filename, "-") ? fopen(filename, "rb") : stdin;
+        if (!r->f)
+            return -1;
+    }
+
+    // Y4M 文件以 "YUV4MPEG2 " 开头，否则按照原始 YUV420P 数据处理
+    if (r->map) {
+        r->y4m = r->map_size >= 10 && !memcmp(r->map, "YUV4MPEG2 ", 10);
+    } else if (r->width <= 0) {
+        // 流式输入只能回退一个字节，指定了 --size 时始终按原始数据处理
+        int ch = fgetc(r->f);
+        r->y4m = ch == 'Y';
+        ungetc(ch, r->f);
+    }
+    if (r->y4m) {
+        if (reader_read_line(r, header, sizeof(header) - 1) < 0 || strncmp(header, "YUV4MPEG2 ", 10)) {
+            fprintf(stderr, "Invalid Y4M header\n");
+            return -1;
+        }
+        strcat(header, "\n");
+        if (parse_y4m_header(r, header) < 0) {
+            fprintf(stderr, "Invalid Y4M header: %s", header);
+            return -1;
+        }
+    } else if (r->width <= 0 || r->height <= 0) {
+        fprintf(stderr, "Raw YUV input needs --size <width>x<height>\n");
+        return -1;
+    }
+
+    r->frame_size = static_cast<size_t>(av_image_get_buffer_size(AV_PIX_FMT_YUV420P, r->width, r->height, 1));
+    if (!r->map) {
+        r->pool = av_buffer_pool_init(static_cast<int>(r->frame_size), av_buffer_alloc);
+        if (!r->pool)
+            return -1;
+    }
+    return 0;
+}
+
+static void reader_buffer_free(void *opaque, uint8_t *data) {
+    AVBufferRef *map_ref = static_cast<AVBufferRef *>(opaque);
+    av_buffer_unref(&map_ref);
+}
+
+/*
+ * 读出下一帧，frame 中的数据只读。
+ * 返回 AVERROR_EOF 表示已经读完，文件末尾不完整的帧被丢弃。
+ */
+static int reader_read(FrameReader *r, AVFrame *frame) {
+    char header[256];
+    const uint8_t *data;
+    AVBufferRef *map_ref;
+
+    if (r->y4m) {
+        if (reader_read_line(r, header, sizeof(header)) < 0)
+            return AVERROR_EOF;
+        if (strncmp(header, "FRAME", 5)) {
+            fprintf(stderr, "Invalid Y4M frame header\n");
+            return AVERROR_INVALIDDATA;
+        }
+    }
+
+    if (r->map) {
+        if (r->map_size - r->pos < r->frame_size)
+            return AVERROR_EOF;
+        data = r->map + r->pos;
+        if (!(map_ref = av_buffer_ref(r->map_ref)))
+            return AVERROR(ENOMEM);
+        frame->buf[0] = av_buffer_create(const_cast<uint8_t *>(data), static_cast<int>(r->frame_size),
+                                         reader_buffer_free, map_ref, AV_BUFFER_FLAG_READONLY);
+        if (!frame->buf[0]) {
+            av_buffer_unref(&map_ref);
+            return AVERROR(ENOMEM);
+        }
+        r->pos += r->frame_size;
+#ifndef _WIN32
+        // 提前把后面 readahead 帧的数据读入页缓存
+        if (r->pos < r->map_size) {
+            size_t start = r->pos & ~static_cast<size_t>(sysconf(_SC_PAGESIZE) - 1);
+            madvise(const_cast<uint8_t *>(r->map) + start,
+                    FFMIN(r->frame_size * r->readahead, r->map_size - start), MADV_WILLNEED);
+        }
+#endif
+    } else {
+        if (!(frame->buf[0] = av_buffer_pool_get(r->pool)))
+            return AVERROR(ENOMEM);
+        if (fread(frame->buf[0]->data, 1, r->frame_size, r->f) != r->frame_size) {
+            av_buffer_unref(&frame->buf[0]);
+            return AVERROR_EOF;
+        }
+        data = frame->buf[0]->data;
+    }
+
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = r->width;
+    frame->height = r->height;
+    av_image_fill_arrays(frame->data, frame->linesize, data, AV_PIX_FMT_YUV420P, r->width, r->height, 1);
+    return 0;
+}
+
+static void reader_close(FrameReader *r) {
+    // 编码器仍然引用着的帧会在释放时才真正解除映射
+    av_buffer_unref(&r->map_ref);
+    av_buffer_pool_uninit(&r->pool);
+    if (r->f && r->f != stdin)
+        fclose(r->f);
+}
+
+/*
+ * 生产测试图案的第 i 帧。
+ * 每帧的数据缓存都来自 AVBufferPool：编码器仍持有上一轮缓存的引用时，池中会给出另一块缓存，
+ * 编码器释放引用后缓存自动回到池中，因此填充时不会改写编码器还在使用的数据。
+ */
+static int fill_test_pattern(AVFrame *frame, AVBufferPool *pool, enum TestPattern pattern,
+                             int width, int height, int i) {
+    int ret;
+
+    if (!(frame->buf[0] = av_buffer_pool_get(pool)))
+        return AVERROR(ENOMEM);
+    frame->format = AV_PIX_FMT_YUV420P;
+    frame->width = width;
+    frame->height = height;
+    if ((ret = av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data,
+                                    AV_PIX_FMT_YUV420P, width, height, 32)) < 0)
+        return ret;
+
+    /* prepare a dummy image */
+    test_pattern_fill(frame, pattern, i);
+    return 0;
+}
+
+/*
+ * 帧生产者：在单独的线程上读取输入或生成测试图案，与编码并行进行。
+ * 固定数量的 AVFrame 在 free_frames 和 ready_frames 两个队列之间轮转，ready_frames 中的空指针表示输入结束。
+ */
+struct FrameProducer {
+    explicit FrameProducer(int ring_size) : free_frames(ring_size), ready_frames(ring_size) {}
+
+    // 为 NULL 时生成测试图案
+    FrameReader *reader = NULL;
+    AVBufferPool *pool = NULL;
+    enum TestPattern pattern = PATTERN_GRADIENT;
+    int nb_frames = 0;
+    int width = 0, height = 0;
+
+    SpscQueue<AVFrame *> free_frames;
+    SpscQueue<AVFrame *> ready_frames;
+    std::atomic<bool> abort{false};
+    // 读取输入出错时的返回值
+    int error = 0;
+};
+
+// 各阶段耗时统计；produce_latency 只由生产者线程写入，其余只由编码线程写入
+static LatencyHistogram produce_latency("produce");
+static LatencyHistogram send_latency("send_frame");
+static LatencyHistogram receive_latency("receive_packet");
+// 交给写入器的耗时；异步写入时只包含排队，等待在途写完成的时间也算在内
+static LatencyHistogram write_latency("fwrite");
+// 每一帧从送进编码器到对应的压缩包出来的时间，按 pts 配对
+static PtsLatency frame_latency("frame_latency");
+static LatencyHistogram *const stats_stages[] = {&produce_latency, &send_latency, &receive_latency, &write_latency,
+                                                 &frame_latency.hist};
+#define NB_STATS_STAGES static_cast<int>(sizeof(stats_stages) / sizeof(stats_stages[0]))
+static StatsCounter bytes_written{0};
+
+/*
+ * 把压缩包拷贝到只追加的大块缓存里，攒满后整块交给写入器。
+ * 低码率时每个包只有几百字节，逐包写文件几乎全是系统调用的开销。
+ * 缓存块来自缓存池，写入器写完释放引用后就回到池里，不会每块都重新申请。
+ */
+typedef struct PacketArena {
+    AsyncWriter *writer;
+    // 为空时不攒包，每个包单独写出
+    AVBufferPool *pool;
+    AVBufferRef *buf;
+    int size;
+    int used;
+    // 交给写入器的写请求个数
+    int64_t writes;
+} PacketArena;
+
+static int arena_init(PacketArena *a, AsyncWriter *writer, int size) {
+    memset(a, 0, sizeof(*a));
+    a->writer = writer;
+    a->size = size;
+    if (size > 0 && !(a->pool = av_buffer_pool_init(size, av_buffer_alloc)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+// 把已经攒下的数据写出
+static int arena_flush(PacketArena *a) {
+    int ret = 0;
+
+    if (a->buf && a->used > 0) {
+        ret = writer_write_buffer(a->writer, a->buf, a->buf->data, a->used);
+        a->writes++;
+    }
+    av_buffer_unref(&a->buf);
+    a->used = 0;
+    return ret;
+}
+
+static int arena_append(PacketArena *a, const uint8_t *data, int size) {
+    int ret;
+
+    if (a->buf && a->used + size > a->size && (ret = arena_flush(a)) < 0)
+        return ret;
+    if (!a->buf && !(a->buf = av_buffer_pool_get(a->pool)))
+        return AVERROR(ENOMEM);
+    memcpy(a->buf->data + a->used, data, size);
+    a->used += size;
+    return 0;
+}
+
+static int arena_write_packet(PacketArena *a, const AVPacket *pkt) {
+    int ret;
+
+    // 超过缓存块四分之一的大包不值得拷贝：先写出攒下的数据保证顺序，再直接引用包的缓存写出
+    if (!a->pool || pkt->size > a->size / 4) {
+        if ((ret = arena_flush(a)) < 0)
+            return ret;
+        a->writes++;
+        return writer_write_packet(a->writer, pkt);
+    }
+    return arena_append(a, pkt->data, pkt->size);
+}
+
+// 写出一块调用方不保留的数据：小块追加到缓存块里，大块先写出攒下的数据再拷贝一份单独写出
+static int arena_write_data(PacketArena *a, const uint8_t *data, int size) {
+    int ret;
+
+    if (a->pool && size <= a->size / 4)
+        return arena_append(a, data, size);
+    if ((ret = arena_flush(a)) < 0)
+        return ret;
+    a->writes++;
+    return writer_write_data(a->writer, data, size);
+}
+
+// 写出剩余的数据，data 非空时先追加到末尾（如 MPEG 结束序列码）
+static int arena_finish(PacketArena *a, const uint8_t *data, int size) {
+    int ret;
+
+    if (data && a->pool) {
+        if ((ret = arena_append(a, data, size)) < 0)
+            return ret;
+    } else if (data) {
+        a->writes++;
+        if ((ret = writer_write_data(a->writer, data, size)) < 0)
+            return ret;
+    }
+    return arena_flush(a);
+}
+
+static void arena_uninit(PacketArena *a) {
+    av_buffer_unref(&a->buf);
+    av_buffer_pool_uninit(&a->pool);
+}
+
+/*
+ * 封装格式输出（MP4、分片 MP4、MPEG-TS 等），不再输出裸码流再另外转封装一遍。
+ * libavformat 经过自定义的 AVIOContext 写出：AVIOContext 的缓存攒满后整块交给写入器；
+ * MP4 要回头改写文件头，seek 回调先写出攒下的数据，再把写入器移到新的位置。
+ */
+typedef struct MuxOutput {
+    AVFormatContext *oc;
+    AVStream *st;
+    AVDictionary *opts;
+} MuxOutput;
+
+static int mux_write(void *opaque, uint8_t *buf, int size) {
+    int ret = arena_write_data(static_cast<PacketArena *>(opaque), buf, size);
+    return ret < 0 ? ret : size;
+}
+
+static int64_t mux_seek(void *opaque, int64_t offset, int whence) {
+    PacketArena *a = static_cast<PacketArena *>(opaque);
+    int ret;
+
+    // avio_seek() 总是换算成 SEEK_SET 再调用，不支持查询文件大小
+    if ((whence & ~AVSEEK_FORCE) != SEEK_SET)
+        return AVERROR(ENOSYS);
+    if ((ret = arena_flush(a)) < 0 || (ret = writer_seek(a->writer, offset)) < 0)
+        return ret;
+    return offset;
+}
+
+/*
+ * 按格式名创建封装上下文，必须在打开编码器之前调用：有的格式要求编码器输出全局头。
+ * fmp4 是带 frag_keyframe+empty_moov 的 MP4，可以写到管道等不可定位的输出。
+ */
+static int mux_alloc(MuxOutput *m, const char *format, const char *filename, AVCodecContext *c) {
+    const char *name = format;
+    int ret;
+
+    memset(m, 0, sizeof(*m));
+    if (!strcmp(format, "fmp4")) {
+        name = "mp4";
+        av_dict_set(&m->opts, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    }
+    if ((ret = avformat_alloc_output_context2(&m->oc, NULL, name, filename)) < 0)
+        return ret;
+    if (m->oc->oformat->flags & AVFMT_GLOBALHEADER)
+        c->flags |= AV_CODEC_FLAG_GLOBAL_HEADER;
+    return 0;
+}
+
+// 编码器打开之后添加视频流，经过 a 写出文件头
+static int mux_start(MuxOutput *m, const AVCodecContext *c, PacketArena *a, int buffer_size) {
+    bool seekable = a->writer->offset >= 0;
+    const char *name = m->oc->oformat->name;
+    uint8_t *buf;
+    int ret;
+
+    if (!(m->st = avformat_new_stream(m->oc, NULL)))
+        return AVERROR(ENOMEM);
+    if ((ret = avcodec_parameters_from_context(m->st->codecpar, c)) < 0)
+        return ret;
+    m->st->time_base = c->time_base;
+
+    if (!(buf = static_cast<uint8_t *>(av_malloc(buffer_size))))
+        return AVERROR(ENOMEM);
+    // 没有 seek 回调时 AVIOContext 按不可定位处理，不可定位的输出只能用 fmp4、mpegts 这类流式格式
+    m->oc->pb = avio_alloc_context(buf, buffer_size, 1, a, NULL, mux_write, seekable ? mux_seek : NULL);
+    if (!m->oc->pb) {
+        av_free(buf);
+        return AVERROR(ENOMEM);
+    }
+    // 普通文件输出的 MP4 把 moov 移到文件开头，边下载边播放，不需要再处理一遍
+    if (seekable && !m->opts && (!strcmp(name, "mp4") || !strcmp(name, "mov")))
+        av_dict_set(&m->opts, "movflags", "+faststart", 0);
+    return avformat_write_header(m->oc, &m->opts);
+}
+
+static int mux_write_packet(MuxOutput *m, AVPacket *pkt, AVRational time_base) {
+    av_packet_rescale_ts(pkt, time_base, m->st->time_base);
+    pkt->stream_index = m->st->index;
+    return av_write_frame(m->oc, pkt);
+}
+
+// 写出文件尾和 AVIOContext 中剩余的数据，之后由调用方写出缓存块中的数据
+static int mux_finish(MuxOutput *m) {
+    int ret = av_write_trailer(m->oc);
+
+    avio_flush(m->oc->pb);
+    return ret < 0 ? ret : m->oc->pb->error;
 }
 
-static void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt,
-                   FILE *outfile) {
+static void mux_free(MuxOutput *m) {
+    if (m->oc && m->oc->pb) {
+        av_freep(&m->oc->pb->buffer);
+        avio_context_free(&m->oc->pb);
+    }
+    avformat_free_context(m->oc);
+    m->oc = NULL;
+    av_dict_free(&m->opts);
+}
+
+static void produce_thread(FrameProducer *p) {
+    AVFrame *frame;
+    int64_t t;
+    int i, ret;
+
+    trace_thread_name("produce");
+    for (i = 0; p->free_frames.pop(&frame, p->abort); i++) {
+        // 解除上一轮的引用，缓存由编码器或缓存池自行回收
+        av_frame_unref(frame);
+        t = stats_now();
+        if (p->reader)
+            ret = reader_read(p->reader, frame);
+        else
+            ret = i < p->nb_frames ? fill_test_pattern(frame, p->pool, p->pattern, p->width, p->height, i)
+                                   : AVERROR_EOF;
+        if (ret < 0) {
+            if (ret != AVERROR_EOF)
+                p->error = ret;
+            av_frame_free(&frame);
+            break;
+        }
+        latency_record(&produce_latency, t);
+        // 帧位置，该帧的播放时间为：pts * time_base
+        frame->pts = i;
+        p->ready_frames.push(frame, p->abort);
+    }
+    p->ready_frames.push(NULL, p->abort);
+}
+
+static const CodecTimers encode_timers = {&send_latency, &receive_latency};
+
+/*
+ * 送一帧进编码器，得到的压缩包攒到缓存块里写入文件，mux 不为空时先经过封装；frame 为空时清空编码器
+ */
+static int encode(AVCodecContext *enc_ctx, const AVFrame *frame, AVPacket *pkt, PacketArena *out, MuxOutput *mux) {
+    if (frame)
+        pts_latency_in(&frame_latency, frame->pts);
+    return core_encode(enc_ctx, frame, pkt, [enc_ctx, out, mux](AVPacket *p) {
+        // 包的数据已经拷贝到缓存块，或者被写入器引用着，回调返回后就可以解除引用
+        int64_t t = stats_now();
+        int ret, size = p->size;
+        pts_latency_out(&frame_latency, p->pts);
+        ret = mux ? mux_write_packet(mux, p, enc_ctx->time_base) : arena_write_packet(out, p);
+        latency_record(&write_latency, t);
+        if (ret < 0)
+            return ret;
+        stats_count(&bytes_written, size);
+        return 0;
+    }, &encode_timers);
+}
+
+/*
+ * 多码率（ABR 阶梯）输出中的一个档位，主输出之外每个 --rendition 一个。
+ * 每个档位在自己的线程上缩放和编码，源帧只增加引用计数交给各档位，不拷贝像素数据；
+ * 源帧只读，各档位缩放到自己的缓存中，分辨率与源相同的档位直接编码源帧。
+ */
+struct Rendition {
+    explicit Rendition(int queue_size) : frames(queue_size) {}
+
+    std::string name;
+    int width = 0, height = 0;
+    int64_t bit_rate = 0;
+    const char *filename = NULL;
+
+    CodecContextPtr c;
+    PacketPtr pkt;
+    FILE *f = NULL;
+    AsyncWriter *writer = NULL;
+    PacketArena arena = {};
+    // 封装格式输出，oc 为空时输出裸码流
+    MuxOutput mux = {};
+    struct SwsContext *sws = NULL;
+    // 缩放后的帧缓存，编码器还引用着的缓存不会被下一帧改写
+    AVBufferPool *pool = NULL;
+
+    // 源帧的引用，空指针表示输入结束
+    SpscQueue<AVFrame *> frames;
+    std::thread thread;
+    int frames_encoded = 0;
+    int64_t bytes = 0;
+    int error = 0;
+
+    // 各档位自己的耗时统计，只由档位线程写入
+    LatencyHistogram scale_latency{"scale"};
+    LatencyHistogram send_latency{"send_frame"};
+    LatencyHistogram receive_latency{"receive_packet"};
+    LatencyHistogram write_latency{"fwrite"};
+    PtsLatency frame_latency{"frame_latency"};
+    LatencyHistogram *const stages[NB_RENDITION_STAGES] = {&scale_latency, &send_latency, &receive_latency,
+                                                           &write_latency, &frame_latency.hist};
+};
+
+// 解析 "<w>x<h>:<kbps>:<file>"
+static int rendition_parse(Rendition *r, const char *arg) {
+    int kbps, n = 0;
+
+    if (sscanf(arg, "%dx%d:%d:%n", &r->width, &r->height, &kbps, &n) != 3 || !n || !arg[n] ||
+        r->width <= 0 || r->height <= 0 || kbps <= 0)
+        return -1;
+    r->bit_rate = static_cast<int64_t>(kbps) * 1000;
+    r->filename = arg + n;
+    r->name = std::to_string(r->width) + "x" + std::to_string(r->height) + "@" + std::to_string(kbps) + "k";
+    return 0;
+}
+
+// 打开档位的编码器、缩放上下文和输出，编码参数除分辨率和码率外与主输出相同
+static int rendition_open(Rendition *r, const AVCodec *codec, const AVCodecContext *src, bool low_latency,
+                          const char *format, const WriterConfig *writer_cfg, int write_batch) {
     int ret;
 
-    /* send the frame to the encoder */
+    if ((ret = core_encoder_alloc(&r->c, codec, r->width, r->height, src->framerate)) < 0)
+        return ret;
+    if (format && (ret = mux_alloc(&r->mux, format, r->filename, r->c.get())) < 0)
+        return ret;
+    if (low_latency)
+        encoder_set_low_latency(r->c.get(), codec);
+    r->c->bit_rate = r->bit_rate;
+    r->c->pix_fmt = src->pix_fmt;
+    r->c->thread_count = src->thread_count;
+    r->c->thread_type = src->thread_type;
+    if ((ret = avcodec_open2(r->c.get(), codec, NULL)) < 0)
+        return ret;
+    if (!(r->pkt = core_packet_alloc()))
+        return AVERROR(ENOMEM);
+
+    if (r->width != src->width || r->height != src->height) {
+        r->sws = sws_getContext(src->width, src->height, src->pix_fmt, r->width, r->height, r->c->pix_fmt,
+                                SWS_BICUBIC, NULL, NULL, NULL);
+        r->pool = av_buffer_pool_init(av_image_get_buffer_size(r->c->pix_fmt, r->width, r->height, 32),
+                                      av_buffer_alloc);
+        if (!r->sws || !r->pool)
+            return AVERROR(ENOMEM);
+    }
+
+    if (!(r->f = fopen(r->filename, "wb")))
+        return AVERROR(errno);
+    if ((ret = writer_open(&r->writer, r->f, writer_cfg)) < 0)
+        return ret;
+    if ((ret = arena_init(&r->arena, r->writer, write_batch * 1024)) < 0)
+        return ret;
+    if (r->mux.oc)
+        return mux_start(&r->mux, r->c.get(), &r->arena, write_batch > 0 ? write_batch * 1024 : MUX_IO_BUFFER_KB * 1024);
+    return 0;
+}
+
+// 把源帧缩放到缓存池中的一块新缓存里
+static int rendition_scale(Rendition *r, const AVFrame *src, AVFrame *dst) {
+    int ret;
+
+    if (!(dst->buf[0] = av_buffer_pool_get(r->pool)))
+        return AVERROR(ENOMEM);
+    dst->format = r->c->pix_fmt;
+    dst->width = r->width;
+    dst->height = r->height;
+    if ((ret = av_image_fill_arrays(dst->data, dst->linesize, dst->buf[0]->data,
+                                    r->c->pix_fmt, r->width, r->height, 32)) < 0)
+        return ret;
+    sws_scale(r->sws, src->data, src->linesize, 0, src->height, dst->data, dst->linesize);
+    dst->pts = src->pts;
+    return 0;
+}
+
+static int rendition_encode(Rendition *r, const AVFrame *frame) {
+    const CodecTimers timers = {&r->send_latency, &r->receive_latency};
+
     if (frame)
-        printf("Send frame %I64d\n", frame->pts);
+        pts_latency_in(&r->frame_latency, frame->pts);
+    return core_encode(r->c.get(), frame, r->pkt.get(), [r](AVPacket *p) {
+        int64_t t = stats_now();
+        int ret, size = p->size;
+        pts_latency_out(&r->frame_latency, p->pts);
+        ret = r->mux.oc ? mux_write_packet(&r->mux, p, r->c->time_base) : arena_write_packet(&r->arena, p);
+        latency_record(&r->write_latency, t);
+        if (ret < 0)
+            return ret;
+        r->bytes += size;
+        return 0;
+    }, &timers);
+}
+
+// 档位线程：逐帧缩放并编码，输入结束后清空编码器；出错时置位 abort，让整条流水线停下来
+static void rendition_thread(Rendition *r, std::atomic<bool> *abort) {
+    FramePtr scaled = core_frame_alloc();
+    AVFrame *src;
+    int64_t t;
+    int ret = scaled ? 0 : AVERROR(ENOMEM);
 
-    // 发送帧到编码器
-    ret = avcodec_send_frame(enc_ctx, frame);
+    trace_thread_name("rendition");
+    while (ret >= 0 && r->frames.pop(&src, *abort) && src) {
+        const AVFrame *frame = src;
+        if (r->sws) {
+            t = stats_now();
+            av_frame_unref(scaled.get());
+            ret = rendition_scale(r, src, scaled.get());
+            latency_record(&r->scale_latency, t);
+            frame = scaled.get();
+        }
+        if (ret >= 0 && (ret = rendition_encode(r, frame)) >= 0)
+            r->frames_encoded++;
+        av_frame_free(&src);
+    }
+    if (ret >= 0 && !abort->load())
+        ret = rendition_encode(r, NULL);
     if (ret < 0) {
-        fprintf(stderr, "Error sending a frame for encoding\n");
-        exit(1);
+        r->error = ret;
+        *abort = true;
     }
+}
 
-    while (ret >= 0) {
-        /*
-         * 当函数返回 0，表示编码成功，此时pkt中存储了压缩帧数据，过后通过fwrite把数据写入文件。
-         * 当函数返回 AVERROR(EAGAIN)，表示编码器需要接收更多的输入帧以填满缓冲区为止，再对缓冲区进行压缩
-         * 当函数返回 AVERROR_EOF，表示到达了数据流末尾，没有可编码的数据了
-         */
-        ret = avcodec_receive_packet(enc_ctx, pkt);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            return;
-        else if (ret < 0) {
-            fprintf(stderr, "Error during encoding\n");
-            exit(1);
-        }
+// 写出文件尾（裸码流时为结束序列码）和剩余数据，等待全部写完
+static int rendition_close(Rendition *r, const uint8_t *endcode, int size) {
+    int ret;
 
-        printf("Write packet %I64d (size=%5d)\n", pkt->pts, pkt->size);
-        fwrite(pkt->data, 1, pkt->size, outfile);
-        av_packet_unref(pkt);
+    if (r->mux.oc) {
+        ret = mux_finish(&r->mux);
+        ret = ret < 0 ? ret : arena_finish(&r->arena, NULL, 0);
+    } else {
+        ret = arena_finish(&r->arena, endcode, size);
+        r->bytes += size;
     }
+    if ((ret = ret < 0 ? ret : writer_close(&r->writer)) < 0)
+        return ret;
+    return fclose(r->f) ? AVERROR(errno) : 0;
+}
+
+static void rendition_free(Rendition *r) {
+    AVFrame *frame;
+
+    while (r->frames.try_pop(&frame))
+        av_frame_free(&frame);
+    r->c.reset();
+    sws_freeContext(r->sws);
+    av_buffer_pool_uninit(&r->pool);
+    mux_free(&r->mux);
+    arena_uninit(&r->arena);
 }
 
 int main(int argc, char **argv) {
     const char *filename, *codec_name;
     const AVCodec *codec;
-    AVCodecContext *c = NULL;
-    int i, ret, x, y;
+    CodecContextPtr c;
+    PacketPtr pkt;
+    int i, ret;
     FILE *f;
+    AsyncWriter *writer;
+    PacketArena arena;
     AVFrame *frame;
-    AVPacket *pkt;
     uint8_t endcode[] = {0, 0, 1, 0xb7};
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    const char *threads = NULL;
+    int thread_type = 0;
+    const char *input = NULL;
+    int width = 0, height = 0;
+    AVRational framerate = {25, 1};
+    int readahead = READAHEAD_FRAMES;
+    int ring_size = FRAME_RING_SIZE;
+    int pattern = PATTERN_GRADIENT;
+    int nb_frames = TEST_PATTERN_FRAMES;
+    int write_batch = WRITE_BATCH_KB;
+    bool low_latency = false;
+    // 为空时输出裸码流
+    const char *format = NULL;
+    MuxOutput mux = {};
+    FrameReader reader;
+    WriterConfig writer_cfg = {WRITER_URING, WRITER_DEFAULT_DEPTH};
+    std::vector<const char *> rendition_args;
+    std::vector<std::unique_ptr<Rendition>> renditions;
 
     if (argc <= 2) {
-        fprintf(stderr, "Usage: %s <output file> <codec name>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <output file> <codec name> [options]\n"
+                        "  --threads <n|auto|numa>        encoder threads; auto uses every usable CPU,\n"
+                        "                                 numa binds to the current NUMA node first\n"
+                        "  --thread-type frame|slice|both encoder threading method\n"
+                        "  --input <file|->               encode raw YUV420P or Y4M input instead of\n"
+                        "                                 the synthetic test pattern ('-' is stdin)\n"
+                        "  --size <w>x<h>                 raw YUV420P input or test pattern resolution\n"
+                        "                                 (test pattern default: 352x288)\n"
+                        "  --fps <num>[/<den>]            raw YUV420P input or test pattern frame rate (default: 25)\n"
+                        "  --pattern gradient|bars|noise  test pattern to encode without --input (default: gradient)\n"
+                        "  --frames <n>                   test pattern frames to encode (default: %d)\n"
+                        "  --readahead <frames>           frames of input to prefetch (default: %d)\n"
+                        "  --frame-ring <frames>          frames cycled between producer and encoder (default: %d)\n"
+                        "  --write-batch <KiB>            coalesce packets into chunks of this size before writing;\n"
+                        "                                 0 writes every packet on its own (default: %d)\n"
+                        "  --format <es|mp4|fmp4|mpegts|muxer> output container (default: es, the bare stream\n"
+                        "                                 followed by an MPEG end code); mp4 is written with\n"
+                        "                                 faststart, fmp4 is fragmented and can go to a pipe\n"
+                        "  --low-latency                  live profile: no B-frames or lookahead, slice threads,\n"
+                        "                                 zerolatency tune and intra refresh for H.264; also\n"
+                        "                                 measures how long every frame stays in the encoder\n"
+                        "  --rendition <w>x<h>:<kbps>:<file> also encode the input at this resolution and\n"
+                        "                                 bitrate into <file>, scaled and encoded on its own\n"
+                        "                                 thread; repeat for an ABR ladder (up to %d)\n"
+                        WRITER_OPTIONS_HELP
+                        STATS_OPTIONS_HELP,
+                argv[0], TEST_PATTERN_FRAMES, READAHEAD_FRAMES, FRAME_RING_SIZE, WRITE_BATCH_KB, MAX_RENDITIONS);
         exit(0);
     }
     filename = argv[1];
     codec_name = argv[2];
 
+    for (i = 3; i < argc; i++) {
+        if (!strcmp(argv[i], "--threads") && i + 1 < argc) {
+            threads = argv[++i];
+        } else if (!strcmp(argv[i], "--thread-type") && i + 1 < argc) {
+            if ((thread_type = parse_thread_type(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown thread type '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--input") && i + 1 < argc) {
+            input = argv[++i];
+        } else if (!strcmp(argv[i], "--size") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &width, &height) != 2 || width <= 0 || height <= 0) {
+                fprintf(stderr, "Invalid size '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--fps") && i + 1 < argc) {
+            framerate.den = 1;
+            if (sscanf(argv[++i], "%d/%d", &framerate.num, &framerate.den) < 1 ||
+                framerate.num <= 0 || framerate.den <= 0) {
+                fprintf(stderr, "Invalid frame rate '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--readahead") && i + 1 < argc) {
+            readahead = atoi(argv[++i]);
+            readahead = FFMAX(readahead, 1);
+        } else if (!strcmp(argv[i], "--pattern") && i + 1 < argc) {
+            if ((pattern = test_pattern_from_name(argv[++i])) < 0) {
+                fprintf(stderr, "Unknown pattern '%s'\n", argv[i]);
+                exit(1);
+            }
+        } else if (!strcmp(argv[i], "--frames") && i + 1 < argc) {
+            nb_frames = atoi(argv[++i]);
+            nb_frames = FFMAX(nb_frames, 0);
+        } else if (!strcmp(argv[i], "--frame-ring") && i + 1 < argc) {
+            ring_size = atoi(argv[++i]);
+            ring_size = FFMAX(ring_size, 2);
+        } else if (!strcmp(argv[i], "--write-batch") && i + 1 < argc) {
+            write_batch = atoi(argv[++i]);
+            write_batch = av_clip(write_batch, 0, INT_MAX / 1024);
+        } else if (!strcmp(argv[i], "--format") && i + 1 < argc) {
+            format = strcmp(argv[++i], "es") ? argv[i] : NULL;
+        } else if (!strcmp(argv[i], "--low-latency")) {
+            low_latency = true;
+        } else if (!strcmp(argv[i], "--rendition") && i + 1 < argc) {
+            rendition_args.push_back(argv[++i]);
+        } else if (writer_parse_option(argc, argv, &i, &writer_cfg)) {
+        } else if (stats_parse_option(argc, argv, &i)) {
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            exit(1);
+        }
+    }
+    if (static_cast<int>(rendition_args.size()) > MAX_RENDITIONS) {
+        fprintf(stderr, "At most %d renditions are supported\n", MAX_RENDITIONS);
+        exit(1);
+    }
+    // 每个档位的队列和帧环一样长，档位编码慢时生产者随之等待
+    for (const char *arg : rendition_args) {
+        renditions.emplace_back(new Rendition(ring_size));
+        if (rendition_parse(renditions.back().get(), arg) < 0) {
+            fprintf(stderr, "Invalid rendition '%s'\n", arg);
+            exit(1);
+        }
+    }
+
+    // 打开输入文件，分辨率和帧率以 Y4M 文件头为准
+    if (input) {
+        if (reader_open(&reader, input, width, height, framerate, readahead) < 0) {
+            fprintf(stderr, "Could not open %s\n", input);
+            exit(1);
+        }
+        width = reader.width;
+        height = reader.height;
+        framerate = reader.framerate;
+    } else if (width <= 0 || height <= 0) {
+        width = 352;
+        height = 288;
+    }
+
     /* 根据名称查询编码器 */
-    codec = avcodec_find_encoder_by_name(codec_name);
-    if (!codec) {
+    if (core_find_codec(codec_name, true, &codec) < 0) {
         fprintf(stderr, "Codec '%s' not found\n", codec_name);
         exit(1);
     }
 
-    // 通过编码器创建编码上下文
-    c = avcodec_alloc_context3(codec);
-    if (!c) {
+    // 通过编码器创建编码上下文，比特率、分辨率、帧率、GOP 等参数与 video_hw_decode 的转码模式共用
+    if (core_encoder_alloc(&c, codec, width, height, framerate) < 0) {
         fprintf(stderr, "Could not allocate video codec context\n");
         exit(1);
     }
-
-    /* 设置比特率 */
-    c->bit_rate = 400000;
-    /* 设置分辨率 */
-    c->width = 352;
-    c->height = 288;
-    // 设置fps，time_base 是 framerate 的倒数
-    c->time_base = (AVRational) {1, 25};
-    c->framerate = (AVRational) {25, 1};
-    // GOP大小
-    c->gop_size = 10;
-    // 两个非B帧之间的B帧最大数目（设为0表示不会有B帧）
-    c->max_b_frames = 0;
     // 帧采样格式
     c->pix_fmt = AV_PIX_FMT_YUV420P;
+    // 封装上下文要在打开编码器之前创建，MP4 等格式要求编码器输出全局头
+    if (format && (ret = mux_alloc(&mux, format, filename, c.get())) < 0) {
+        fprintf(stderr, "Could not create %s output: %s\n", format, av_make_error_string(errbuf, sizeof(errbuf), ret));
+        exit(1);
+    }
+    // 低延迟参数先设置，命令行指定的线程方式仍然可以覆盖
+    if (low_latency) {
+        encoder_set_low_latency(c.get(), codec);
+        // 低延迟模式总是统计每帧的延迟，不需要另外打开 --stats
+        stats_enabled = true;
+    }
 
-    // H264编码时还可以调节编码速度从而调整压缩质量，这里把编码速度设置为slow
-    if (codec->id == AV_CODEC_ID_H264)
-        av_opt_set(c->priv_data, "preset", "slow", 0);
+    /*
+     * 多线程编码配置，必须在 avcodec_open2() 之前设置。
+     * 帧级多线程会增加编码延迟，片级多线程会把每帧切成多个 slice，略微降低压缩率。
+     */
+    if (threads)
+        c->thread_count = resolve_thread_count(threads);
+    if (thread_type) {
+        if (!thread_type_supported(codec, thread_type))
+            fprintf(stderr, "Encoder %s does not support %s threading\n", codec->name, thread_type_name(thread_type));
+        c->thread_type = thread_type;
+    }
 
     // 打开编码上下文
-    ret = avcodec_open2(c, codec, NULL);
+    ret = avcodec_open2(c.get(), codec, NULL);
     if (ret < 0) {
-        fprintf(stderr, "Could not open codec: %s\n", av_err2str(ret));
+        // av_err2str() 使用了 C99 复合字面量，C++ 中不能使用
+        fprintf(stderr, "Could not open codec: %s\n", av_make_error_string(errbuf, sizeof(errbuf), ret));
         exit(1);
     }
 
@@ -112,69 +979,173 @@ int main(int argc, char **argv) {
         fprintf(stderr, "Could not open %s\n", filename);
         exit(1);
     }
-
-    // 创建维护缓冲区数据的AVPacket对象
-    pkt = av_packet_alloc();
-    if (!pkt)
+    // 压缩包由写入器异步写出，编码线程不等待磁盘
+    writer_open(&writer, f, &writer_cfg);
+    fprintf(stderr, "output writer: %s (depth %d)\n", writer_backend_name(writer->backend), writer_cfg.depth);
+    if (arena_init(&arena, writer, write_batch * 1024) < 0) {
+        fprintf(stderr, "Could not allocate the output buffer\n");
         exit(1);
-
-    // 创建维护帧元数据的AVFrame对象
-    frame = av_frame_alloc();
-    if (!frame) {
-        fprintf(stderr, "Could not allocate video frame\n");
+    }
+    if (mux.oc && (ret = mux_start(&mux, c.get(), &arena,
+                                   write_batch > 0 ? write_batch * 1024 : MUX_IO_BUFFER_KB * 1024)) < 0) {
+        fprintf(stderr, "Could not write the %s header: %s\n", format, av_make_error_string(errbuf, sizeof(errbuf), ret));
         exit(1);
     }
-    // 设置帧采样格式
-    frame->format = c->pix_fmt;
-    // 设置帧的分辨率
-    frame->width = c->width;
-    frame->height = c->height;
+    for (auto &r : renditions) {
+        if ((ret = rendition_open(r.get(), codec, c.get(), low_latency, format, &writer_cfg, write_batch)) < 0) {
+            fprintf(stderr, "Could not open rendition %s -> %s: %s\n", r->name.c_str(), r->filename,
+                    av_make_error_string(errbuf, sizeof(errbuf), ret));
+            exit(1);
+        }
+        fprintf(stderr, "rendition %s -> %s%s\n", r->name.c_str(), r->filename, r->sws ? "" : " (source size)");
+    }
 
-    // 根据AVFrame的设置分配对应大小的缓存空间
-    ret = av_frame_get_buffer(frame, 0);
-    if (ret < 0) {
-        fprintf(stderr, "Could not allocate the video frame data\n");
+    // 创建维护缓冲区数据的AVPacket对象
+    if (!(pkt = core_packet_alloc()))
         exit(1);
-    }
 
-    /* 编码一秒钟的视频(25fps) */
-    for (i = 0; i < 25; i++) {
-        /* prepare a dummy image */
-        /* Y */
-        for (y = 0; y < c->height; y++) {
-            for (x = 0; x < c->width; x++) {
-                frame->data[0][y * frame->linesize[0] + x] = x + y + i * 3;
-            }
+    // 只有合成测试图案时才需要自己分配帧缓存
+    FrameProducer producer(ring_size);
+    AVBufferPool *pool = NULL;
+    if (input) {
+        producer.reader = &reader;
+    } else {
+        pool = av_buffer_pool_init(av_image_get_buffer_size(c->pix_fmt, c->width, c->height, 32), av_buffer_alloc);
+        if (!pool) {
+            fprintf(stderr, "Could not allocate the video frame data\n");
+            exit(1);
         }
+        producer.pool = pool;
+        producer.pattern = static_cast<enum TestPattern>(pattern);
+        producer.nb_frames = nb_frames;
+        producer.width = c->width;
+        producer.height = c->height;
+        fprintf(stderr, "test pattern: %s (%s)\n", test_pattern_name(producer.pattern), test_pattern_impl());
+    }
 
-        /* Cb and Cr */
-        for (y = 0; y < c->height / 2; y++) {
-            for (x = 0; x < c->width / 2; x++) {
-                frame->data[1][y * frame->linesize[1] + x] = 128 + y + i * 2;
-                frame->data[2][y * frame->linesize[2] + x] = 64 + x + i * 5;
-            }
+    // 创建在生产者和编码器之间轮转的AVFrame对象
+    for (i = 0; i < ring_size; i++) {
+        if (!(frame = av_frame_alloc())) {
+            fprintf(stderr, "Could not allocate video frame\n");
+            exit(1);
         }
+        producer.free_frames.push(frame, producer.abort);
+    }
 
-        // 帧位置，该帧的播放时间为：pts * time_base
-        frame->pts = i;
+    // 统计编码吞吐量
+    int64_t start_time = av_gettime_relative();
+    stats_init();
+    clock_t start_cpu = clock();
 
+    /*
+     * 生产者线程准备第 i+1 帧的同时，编码器在当前线程上编码第 i 帧。
+     * avcodec_send_frame() 会自己引用帧数据，发送后 AVFrame 就可以还给生产者复用。
+     */
+    std::thread producer_thread(produce_thread, &producer);
+    for (auto &r : renditions)
+        r->thread = std::thread(rendition_thread, r.get(), &producer.abort);
+    for (i = 0; producer.ready_frames.pop(&frame, producer.abort) && frame; i++) {
+        // 先把源帧的引用交给各档位，档位线程缩放、编码的同时主输出在当前线程上编码
+        for (auto &r : renditions) {
+            AVFrame *ref = av_frame_clone(frame);
+            if (!ref) {
+                fprintf(stderr, "Could not reference video frame\n");
+                exit(1);
+            }
+            if (!r->frames.push(ref, producer.abort))
+                av_frame_free(&ref);
+        }
         // 编码本帧图片
-        encode(c, frame, pkt, f);
+        if ((ret = encode(c.get(), frame, pkt.get(), &arena, mux.oc ? &mux : NULL)) < 0) {
+            fprintf(stderr, "Error during encoding: %s\n", av_make_error_string(errbuf, sizeof(errbuf), ret));
+            exit(1);
+        }
+        producer.free_frames.push(frame, producer.abort);
+        stats_report_periodic(&stats_reporter, "video_encode", i + 1, stats_stages, NB_STATS_STAGES);
+    }
+    producer_thread.join();
+    for (auto &r : renditions) {
+        r->frames.push(NULL, producer.abort);
+        r->thread.join();
+        if (r->error < 0) {
+            fprintf(stderr, "Error encoding rendition %s: %s\n", r->name.c_str(),
+                    av_make_error_string(errbuf, sizeof(errbuf), r->error));
+            exit(1);
+        }
+    }
+    if (producer.error < 0) {
+        fprintf(stderr, "Error reading %s\n", input);
+        exit(1);
     }
 
     // 最后一帧设为NULL，表示到达流末端。这个操作会让编码上下文把剩余的缓存数据编码到文件中。
-    encode(c, NULL, pkt, f);
+    if ((ret = encode(c.get(), NULL, pkt.get(), &arena, mux.oc ? &mux : NULL)) < 0) {
+        fprintf(stderr, "Error during encoding: %s\n", av_make_error_string(errbuf, sizeof(errbuf), ret));
+        exit(1);
+    }
 
-    // 按照MPEG标准，需要在文件末尾添加结束序列码
-    fwrite(endcode, 1, sizeof(endcode), f);
+    /*
+     * 封装格式输出时写出文件尾；裸码流按照MPEG标准，需要在文件末尾添加结束序列码，随最后一块数据一起写出。
+     * 等在途的写全部完成后才算编码结束。
+     */
+    if (mux.oc) {
+        ret = mux_finish(&mux);
+        ret = ret < 0 ? ret : arena_finish(&arena, NULL, 0);
+    } else {
+        ret = arena_finish(&arena, endcode, sizeof(endcode));
+        stats_count(&bytes_written, sizeof(endcode));
+    }
+    if ((ret = ret < 0 ? ret : writer_close(&writer)) < 0) {
+        fprintf(stderr, "Error writing %s: %s\n", filename, av_make_error_string(errbuf, sizeof(errbuf), ret));
+        exit(1);
+    }
     fclose(f);
+    for (auto &r : renditions) {
+        if ((ret = rendition_close(r.get(), endcode, sizeof(endcode))) < 0) {
+            fprintf(stderr, "Error writing %s: %s\n", r->filename, av_make_error_string(errbuf, sizeof(errbuf), ret));
+            exit(1);
+        }
+    }
+
+    double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    double cpu = static_cast<double>(clock() - start_cpu) / CLOCKS_PER_SEC;
+    fprintf(stderr, "encoded %d frames in %.3f s (%.2f fps), cpu %.3f s (%.0f%%), threads=%d type=%s\n",
+            i, elapsed, elapsed > 0 ? i / elapsed : 0.0,
+            cpu, elapsed > 0 ? cpu * 100 / elapsed : 0.0,
+            c->thread_count, thread_type_name(c->active_thread_type));
+    fprintf(stderr, "wrote %lld bytes in %lld writes\n", static_cast<long long>(bytes_written.load()),
+            static_cast<long long>(arena.writes));
+    if (frame_latency.hist.count.load()) {
+        double ms_per_tick = stats_ns_per_tick() / 1000000.0;
+        fprintf(stderr, "frame latency: p50 %.2f ms, p99 %.2f ms, max %.2f ms, up to %lld frames in the encoder\n",
+                latency_percentile(&frame_latency.hist, 50) * ms_per_tick,
+                latency_percentile(&frame_latency.hist, 99) * ms_per_tick,
+                frame_latency.hist.max.load() * ms_per_tick, static_cast<long long>(frame_latency.max_in_flight));
+    }
+
+    // 各档位的结果单独列出，总体结果只统计主输出
+    std::vector<StatsReport> reports;
+    for (auto &r : renditions) {
+        fprintf(stderr, "rendition %s: %d frames, %lld bytes\n", r->name.c_str(), r->frames_encoded,
+                static_cast<long long>(r->bytes));
+        reports.push_back({r->name.c_str(), r->frames_encoded, r->bytes, elapsed, r->stages, NB_RENDITION_STAGES});
+    }
+
+    StatsReport report = {"video_encode", i, bytes_written.load(), elapsed, stats_stages, NB_STATS_STAGES};
+    stats_finish(&report, reports.data(), static_cast<int>(reports.size()));
 
     // 释放编码上下文
-    avcodec_free_context(&c);
-    // 释放帧对象
-    av_frame_free(&frame);
-    // 释放包
-    av_packet_free(&pkt);
+    c.reset();
+    for (auto &r : renditions)
+        rendition_free(r.get());
+    // 释放帧对象和缓存池，编码器已经释放了对缓存的全部引用
+    while (producer.free_frames.try_pop(&frame))
+        av_frame_free(&frame);
+    av_buffer_pool_uninit(&pool);
+    mux_free(&mux);
+    arena_uninit(&arena);
+    if (input)
+        reader_close(&reader);
 
     return 0;
 }
@@ -7,21 +7,93 @@
  * frames from the HW video surfaces.
  */
 
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
 #include <stdio.h>
+#include <string.h>
+
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "async_writer.h"
+#include "core.h"
+#include "frame_select.h"
+#include "packet_index.h"
+#include "packet_queue.h"
+#include "postproc.h"
+#include "prefetch_input.h"
+#include "spsc_queue.h"
+#include "stats.h"
 
 extern "C" {
 #include <libavcodec/avcodec.h>
+#include <libavfilter/avfilter.h>
+#include <libavfilter/buffersink.h>
+#include <libavfilter/buffersrc.h>
 #include <libavformat/avformat.h>
 #include <libavutil/pixdesc.h>
 #include <libavutil/imgutils.h>
+#include <libavutil/time.h>
 }
 
+/*
+ * 解码帧的输出方式：
+ * OUTPUT_COPY   下载到内存后用 av_image_copy_to_buffer() 拷贝成紧凑排列的缓存，再整块写入文件
+ * OUTPUT_DIRECT 下载到内存后直接按 data[]/linesize[] 把各平面写入文件，不做额外拷贝
+ * OUTPUT_MAP    不下载，用 av_hwframe_map() 把硬件帧映射到内存后直接写入文件
+ */
+enum OutputMode {
+    OUTPUT_COPY,
+    OUTPUT_DIRECT,
+    OUTPUT_MAP,
+};
+
+// 所有解码会话共用同一个硬件设备上下文，只在启动时创建一次
 static AVBufferRef *hw_device_ctx = NULL;
-static enum AVPixelFormat hw_pix_fmt;
-static FILE *output_file = NULL;
+static enum OutputMode output_mode = OUTPUT_COPY;
+/*
+ * 转码模式使用的编码器，为空时输出原始像素数据。
+ * 硬件编码器直接读取解码器硬件帧池中的表面，解码帧不再下载到内存。
+ */
+static const AVCodec *hw_encoder = NULL;
+// 解码器硬件帧池额外申请的表面个数，-1 表示按模式取默认值
+static int extra_hw_frames = -1;
+/*
+ * 快速启动：限制探测读取的数据量，容器头部已经给出视频流参数时跳过 avformat_find_stream_info()，
+ * 并且在后台线程上创建硬件设备，与打开和探测输入文件同时进行。
+ */
+static int fast_start = 0;
+static std::shared_future<int> hw_device_ready;
+// 首帧时间的起点，在创建硬件设备之前记录
+static int64_t launch_time = 0;
+// 是否在输入文件旁边保存和复用包索引，以及只抽取这些时间点（秒）的帧
+static int use_index = 0;
+static std::vector<double> extract_times;
+// 输出哪些帧，每个会话复制一份各自计数
+static FrameSelect frame_select = {};
+// 硬件解码失败时是否切换到软件解码，以及软件解码的线程数（0 表示自动）
+static int sw_fallback = 1;
+static int sw_threads = 0;
+// 每个会话的输出文件各有一个写入器
+static WriterConfig writer_cfg = {WRITER_URING, WRITER_DEFAULT_DEPTH};
+// 每个会话的输入各有一个预读线程，window 为 0 时由 libavformat 直接读取
+static PrefetchConfig prefetch_cfg = {0, PREFETCH_DEFAULT_CHUNK_KB * 1024, -1};
+/*
+ * 输出帧的尺寸和格式，0 和 AV_PIX_FMT_NONE 表示保持不变。
+ * 硬件帧在设备上缩放和转换格式之后再下载，只有缩小之后的帧经过 PCIe。
+ */
+static int scale_width = 0, scale_height = 0;
+static enum AVPixelFormat scale_format = AV_PIX_FMT_NONE;
+// 下载到内存之后、写出之前的 CPU 后处理，设备上没有可用的缩放滤镜时代替 --scale
+static PostprocConfig postproc_cfg = {};
 
-// 初始化硬加速设备类型，并把硬加速上下文装配到编解码上下文中
-static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type) {
+// 初始化硬加速设备
+static int hw_device_init(const enum AVHWDeviceType type) {
     int err = 0;
 
     if ((err = av_hwdevice_ctx_create(&hw_device_ctx, type,
@@ -29,144 +101,1224 @@ static int hw_decoder_init(AVCodecContext *ctx, const enum AVHWDeviceType type)
         fprintf(stderr, "Failed to create specified HW device.\n");
         return err;
     }
-    ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx);
-
     return err;
 }
 
-//static enum AVPixelFormat get_hw_format(AVCodecContext *ctx,
-//                                        const enum AVPixelFormat *pix_fmts) {
-//    const enum AVPixelFormat *p;
-//
-//    for (p = pix_fmts; *p != -1; p++) {
-//        if (*p == hw_pix_fmt)
-//            return *p;
-//    }
-//
-//    fprintf(stderr, "Failed to get HW surface format.\n");
-//    return AV_PIX_FMT_NONE;
-//}
-
-// 把解码压缩包，并把帧数据写入到output_file文件中
-static int decode_write(AVCodecContext *avctx, AVPacket *packet) {
-    AVFrame *frame = NULL, *sw_frame = NULL;
-    AVFrame *tmp_frame = NULL;
-    uint8_t *buffer = NULL;
+// 快速启动时设备在后台线程上创建，第一次用到时才等待
+static int hw_device_wait(void) {
+    return hw_device_ready.valid() ? hw_device_ready.get() : 0;
+}
+
+// 把共用的硬加速上下文装配到编解码上下文中
+static int hw_decoder_init(AVCodecContext *ctx) {
+    int ret;
+
+    if ((ret = hw_device_wait()) < 0)
+        return ret;
+    if (!(ctx->hw_device_ctx = av_buffer_ref(hw_device_ctx)))
+        return AVERROR(ENOMEM);
+    return 0;
+}
+
+// 流水线各级队列的默认深度
+#define PACKET_QUEUE_SIZE 32
+// 包队列默认最多缓存的字节数（MiB）
+#define PACKET_QUEUE_MB 16
+#define FRAME_QUEUE_SIZE 4
+#define WRITE_QUEUE_SIZE 4
+
+// 帧池中最多缓存的空闲 AVFrame 个数
+#define FRAME_POOL_SIZE 16
+
+// 转码模式下编码器持有的、尚未编码完成的表面个数
+#define ENCODER_HW_FRAMES 4
+
+// 快速启动时探测最多读取的字节数和时长（AV_TIME_BASE 单位）
+#define FAST_PROBE_SIZE "65536"
+#define FAST_ANALYZE_DURATION "100000"
+
+// 为软件解码回退最多缓存的压缩包个数，GOP 更长时回退后从下一个关键帧开始解码
+#define REPLAY_MAX_PACKETS 300
+
+/*
+ * AVFrame 池。
+ * 归还的帧只做 av_frame_unref()，AVFrame 结构体本身保留下来给下一次使用，避免每次循环都 av_frame_alloc()。
+ * 流水线模式下帧会在线程之间传递，取出和归还都需要加锁。
+ */
+typedef struct FramePool {
+    std::mutex lock;
+    AVFrame *frames[FRAME_POOL_SIZE];
+    int nb_free;
+} FramePool;
+
+/*
+ * 图像缓存池。
+ * 同一个 (format, width, height, align) 下缓存大小不变，用 AVBufferPool 反复复用已申请好的内存；
+ * 只有分辨率或像素格式变化时才重建缓存池。
+ */
+typedef struct ImagePool {
+    AVBufferPool *pool;
+    enum AVPixelFormat format;
+    int width, height;
+    int align;
     int size;
+} ImagePool;
+
+// 流水线各级队列的深度
+typedef struct PipelineConfig {
+    // 解复用 -> 解码，串行模式下使用解复用线程时也是这个队列
+    PacketQueueLimits packet_limits;
+    // 解码 -> 下载，队列中的帧占用硬件帧池中的表面
+    int frame_queue_size;
+    // 下载 -> 写文件
+    int write_queue_size;
+} PipelineConfig;
+
+/*
+ * 一路视频流的解码会话。
+ * 除了共用的硬件设备上下文和输出方式之外，解码一路流用到的状态都在这里，多个会话可以在各自的线程上并行解码。
+ */
+struct DecodeSession {
+    DecodeSession(int index, const char *input_filename, const char *output_filename)
+            : index(index), input_filename(input_filename), output_filename(output_filename) {
+        snprintf(name, sizeof(name), "stream%d", index);
+    }
+
+    int index;
+    char name[32];
+    const char *input_filename;
+    const char *output_filename;
+    // 为空时在当前线程上串行解码
+    const PipelineConfig *pipeline = NULL;
+    // 串行解码时在单独的线程上解复用，只使用其中的包队列上限
+    const PipelineConfig *demuxer = NULL;
+
+    AVFormatContext *input_ctx = NULL;
+    // --read-ahead 时输入经过预读线程，input_pb 是交给 input_ctx 的自定义 AVIOContext
+    PrefetchInput *prefetch = NULL;
+    AVIOContext *input_pb = NULL;
+    int video_stream = -1;
+    AVCodecContext *decoder_ctx = NULL;
+    // 硬件加速解码的帧格式，用来判断解码帧是否在硬件上
+    enum AVPixelFormat hw_pix_fmt = AV_PIX_FMT_NONE;
+    FILE *output_file = NULL;
+    // 输出文件的写入器，只由写文件的线程提交
+    AsyncWriter *writer = NULL;
+    // 硬件帧映射失败后不再尝试映射
+    int hw_map_failed = 0;
+    /*
+     * 软件解码回退的状态，只由调用解码器的线程访问。
+     * 硬件解码期间缓存自最近一个关键帧以来的压缩包，切换到软件解码器后从关键帧开始重放，
+     * 并丢弃时间戳不晚于硬件解码最后一帧的帧，输入文件不需要重新打开和探测。
+     */
+    int sw_decoding = 0;
+    std::vector<AVPacket *> replay_packets;
+    size_t replay_pos = 0;
+    // 缓存的压缩包超过上限，回退后要等到下一个关键帧
+    int replay_overflow = 0;
+    int wait_keyframe = 0;
+    // 已经向解码器发送了清空用的空包；回退时重放结束后需要重新发送
+    int draining = 0;
+    int replay_flush = 0;
+    int64_t last_pts = AV_NOPTS_VALUE;
+    int64_t resume_pts = AV_NOPTS_VALUE;
+
+    // 视频流的包索引；indexing 时边解复用边记录，解码完成后保存
+    PacketIndex packet_index{};
+    int indexing = 0;
+    // 抽帧状态：0 不抽帧，1 正在寻找 extract_pts 处的帧，2 这个时间点的帧已经输出
+    int extracting = 0;
+    int64_t extract_pts = AV_NOPTS_VALUE;
+    // 帧选择状态只由调用解码器的线程访问；过了最后一个时间段后 input_done 通知解复用停止读取
+    FrameSelect select{};
+    std::atomic<bool> input_done{false};
+
+    /*
+     * --scale 时的滤镜图，只由下载帧的线程访问。
+     * 输入帧的格式、尺寸或者硬件帧池变化时（如切换到软件解码）重新建立。
+     */
+    AVFilterGraph *scale_graph = NULL;
+    AVFilterContext *scale_src = NULL;
+    AVFilterContext *scale_sink = NULL;
+    int scale_in_format = AV_PIX_FMT_NONE;
+    int scale_in_width = 0, scale_in_height = 0;
+    const void *scale_in_frames = NULL;
+
+    // --crop、--downscale 的后处理，只由写文件的线程使用
+    Postproc *postproc = NULL;
+
+    // 写出第一帧的时间，-1 表示还没有输出；只由写文件的线程更新
+    int64_t first_frame_time = -1;
+
+    // 转码模式下的编码上下文，收到第一帧之后才打开
+    CodecContextPtr encoder_ctx;
+    PacketPtr encoder_pkt;
+
+    FramePool frame_pool{};
+    // 硬件帧下载到内存所用的缓存
+    ImagePool sw_image_pool{};
+    // 写文件前紧凑排列像素数据所用的缓存
+    ImagePool copy_image_pool{};
+
+    // 各阶段耗时统计；流水线模式下每个直方图只由对应一级的线程写入
+    LatencyHistogram demux_latency{"demux"};
+    LatencyHistogram send_latency{"send_packet"};
+    LatencyHistogram receive_latency{"receive_frame"};
+    LatencyHistogram transfer_latency{"hwframe_transfer"};
+    LatencyHistogram encode_latency{"encode"};
+    LatencyHistogram postproc_latency{"postproc"};
+    LatencyHistogram write_latency{"fwrite"};
+    // 预读线程每次从源读取一块的耗时，没有 --prefetch 时为空
+    LatencyHistogram prefetch_latency{"prefetch_read"};
+    LatencyHistogram *const stages[8] = {&demux_latency, &send_latency, &receive_latency, &transfer_latency,
+                                         &encode_latency, &postproc_latency, &write_latency, &prefetch_latency};
+    // 只由写文件的线程更新
+    StatsCounter frames_written{0};
+    StatsCounter bytes_written{0};
+    StatsReporter reporter{0, 0};
+
+    // 解码结果和耗时（秒）
+    int error = 0;
+    double elapsed = 0;
+};
+
+#define NB_SESSION_STAGES 8
+
+/*
+ * 解码器协商输出格式时只接受硬件加速格式。
+ * 设备处理不了这路流（如分辨率、profile 超出硬件限制）时返回失败，由会话切换到软件解码。
+ */
+static enum AVPixelFormat get_hw_format(AVCodecContext *ctx, const enum AVPixelFormat *pix_fmts) {
+    DecodeSession *s = static_cast<DecodeSession *>(ctx->opaque);
+    const enum AVPixelFormat *p;
+
+    for (p = pix_fmts; *p != AV_PIX_FMT_NONE; p++) {
+        if (*p == s->hw_pix_fmt)
+            return *p;
+    }
+
+    fprintf(stderr, "%s: failed to get HW surface format.\n", s->name);
+    return AV_PIX_FMT_NONE;
+}
+
+static AVFrame *frame_pool_get(FramePool *pool) {
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        if (pool->nb_free > 0)
+            return pool->frames[--pool->nb_free];
+    }
+    return av_frame_alloc();
+}
+
+static void frame_pool_put(FramePool *pool, AVFrame *frame) {
+    if (!frame)
+        return;
+    av_frame_unref(frame);
+    {
+        std::lock_guard<std::mutex> guard(pool->lock);
+        if (pool->nb_free < FRAME_POOL_SIZE) {
+            pool->frames[pool->nb_free++] = frame;
+            return;
+        }
+    }
+    av_frame_free(&frame);
+}
+
+static void frame_pool_uninit(FramePool *pool) {
+    while (pool->nb_free > 0)
+        av_frame_free(&pool->frames[--pool->nb_free]);
+}
+
+// 从缓存池中取出一块能容纳 format/width/height 图像的缓存，参数变化时先重建缓存池
+static AVBufferRef *image_pool_get(ImagePool *pool, enum AVPixelFormat format,
+                                   int width, int height, int align) {
+    if (!pool->pool || pool->format != format || pool->width != width ||
+        pool->height != height || pool->align != align) {
+        int size = av_image_get_buffer_size(format, width, height, align);
+        if (size < 0)
+            return NULL;
+        // 已经借出去的缓存在归还时由旧的缓存池释放
+        av_buffer_pool_uninit(&pool->pool);
+        pool->pool = av_buffer_pool_init(size, av_buffer_alloc);
+        if (!pool->pool)
+            return NULL;
+        pool->format = format;
+        pool->width = width;
+        pool->height = height;
+        pool->align = align;
+        pool->size = size;
+    }
+    return av_buffer_pool_get(pool->pool);
+}
+
+static void image_pool_uninit(ImagePool *pool) {
+    av_buffer_pool_uninit(&pool->pool);
+}
+
+/*
+ * 为硬件帧的下载准备内存帧，数据缓存取自 sw_image_pool。
+ * 与 av_hwframe_transfer_data() 内部自动分配时的做法一致，按硬件帧池的尺寸和 sw_format 分配。
+ */
+static int sw_frame_get_buffer(DecodeSession *s, AVFrame *sw_frame, const AVFrame *hw_frame) {
+    AVHWFramesContext *frames_ctx = reinterpret_cast<AVHWFramesContext *>(hw_frame->hw_frames_ctx->data);
+    int ret;
+
+    sw_frame->format = frames_ctx->sw_format;
+    sw_frame->width = frames_ctx->width;
+    sw_frame->height = frames_ctx->height;
+    sw_frame->buf[0] = image_pool_get(&s->sw_image_pool, frames_ctx->sw_format,
+                                      frames_ctx->width, frames_ctx->height, 32);
+    if (!sw_frame->buf[0])
+        return AVERROR(ENOMEM);
+
+    ret = av_image_fill_arrays(sw_frame->data, sw_frame->linesize, sw_frame->buf[0]->data,
+                               frames_ctx->sw_format, frames_ctx->width, frames_ctx->height, 32);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * 不经过中间缓存，直接把帧的各个平面交给写入器，输出内容与 av_image_copy_to_buffer(..., align = 1) 得到的数据一致。
+ * linesize 与平面的有效宽度相同时整个平面只占一个 iovec，否则每行一个 iovec 跳过行尾的对齐填充。
+ * 写入器引用帧的缓存，帧本身可以立即还给帧池。
+ */
+static int write_planes(AsyncWriter *w, const AVFrame *frame) {
+    enum AVPixelFormat format = static_cast<AVPixelFormat>(frame->format);
+    const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(format);
+    int bytewidth[4], height[4];
+    int nb_planes, i, y, ret;
+    WriteRequest *r;
+
+    if (!desc || desc->flags & AV_PIX_FMT_FLAG_HWACCEL)
+        return AVERROR(EINVAL);
+    if ((ret = av_image_fill_linesizes(bytewidth, format, frame->width)) < 0)
+        return ret;
+    nb_planes = av_pix_fmt_count_planes(format);
+    for (i = 0; i < nb_planes; i++) {
+        // 第1、2个平面是色度平面，高度按色度采样比例缩小
+        int shift = (i == 1 || i == 2) ? desc->log2_chroma_h : 0;
+        height[i] = -((-frame->height) >> shift);
+    }
+
+    if (!(r = writer_request(w)))
+        return writer_error(w);
+    if ((ret = writer_ref_frame(r, frame)) < 0) {
+        writer_submit(w, r);
+        return ret;
+    }
+    for (i = 0; i < nb_planes; i++) {
+        int rows = frame->linesize[i] == bytewidth[i] ? 1 : height[i];
+        size_t len = rows == 1 ? static_cast<size_t>(bytewidth[i]) * height[i] : bytewidth[i];
+        for (y = 0; y < rows; y++)
+            writer_add(r, frame->data[i] + static_cast<ptrdiff_t>(y) * frame->linesize[i], len);
+    }
+    return writer_submit(w, r);
+}
+
+/*
+ * 直接把硬件帧映射到内存中读取，省去一次下载。
+ * 不是所有硬件类型都支持映射，失败后记录下来，之后的帧都改为下载。
+ */
+static int map_hw_frame(DecodeSession *s, AVFrame *sw_frame, const AVFrame *hw_frame) {
+    AVHWFramesContext *frames_ctx = reinterpret_cast<AVHWFramesContext *>(hw_frame->hw_frames_ctx->data);
+    int ret;
+
+    sw_frame->format = frames_ctx->sw_format;
+    if ((ret = av_hwframe_map(sw_frame, hw_frame, AV_HWFRAME_MAP_READ)) < 0) {
+        fprintf(stderr, "%s: can not map hardware frame, falling back to transfer\n", s->name);
+        s->hw_map_failed = 1;
+        av_frame_unref(sw_frame);
+        return ret;
+    }
+    sw_frame->width = hw_frame->width;
+    sw_frame->height = hw_frame->height;
+    return 0;
+}
+
+/*
+ * 各类硬件设备上的缩放滤镜，按顺序取第一个编译进 libavfilter 的。
+ * FFmpeg 4.1 的 scale_cuda 只能缩放，需要转换格式时只能用 scale_npp。
+ */
+static const struct {
+    enum AVHWDeviceType type;
+    const char *name;
+    int format;
+} hw_scalers[] = {
+    {AV_HWDEVICE_TYPE_VAAPI, "scale_vaapi", 1},
+    {AV_HWDEVICE_TYPE_CUDA, "scale_npp", 1},
+    {AV_HWDEVICE_TYPE_CUDA, "scale_cuda", 0},
+    {AV_HWDEVICE_TYPE_QSV, "scale_qsv", 1},
+};
+
+/*
+ * 按输入帧生成缩放用的滤镜描述。
+ * 硬件帧交给设备上的缩放滤镜；设备没有可用的缩放滤镜时先 hwdownload 再用 swscale 缩放，
+ * 软件解码的帧直接用 swscale，保证回退前后输出的尺寸和格式一致。
+ */
+static int scale_filter_desc(DecodeSession *s, const AVFrame *frame, char *desc, size_t size) {
+    char w[16] = "iw", h[16] = "ih";
+    const char *format = scale_format != AV_PIX_FMT_NONE ? av_get_pix_fmt_name(scale_format) : NULL;
+    const AVHWFramesContext *frames;
+
+    if (scale_width > 0)
+        snprintf(w, sizeof(w), "%d", scale_width);
+    if (scale_height > 0)
+        snprintf(h, sizeof(h), "%d", scale_height);
+    if (!frame->hw_frames_ctx) {
+        snprintf(desc, size, "scale=w=%s:h=%s%s%s", w, h, format ? ",format=pix_fmts=" : "", format ? format : "");
+        return 0;
+    }
+
+    frames = reinterpret_cast<const AVHWFramesContext *>(frame->hw_frames_ctx->data);
+    for (const auto &scaler : hw_scalers) {
+        if (scaler.type != frames->device_ctx->type || (format && !scaler.format) || !avfilter_get_by_name(scaler.name))
+            continue;
+        snprintf(desc, size, "%s=w=%s:h=%s%s%s", scaler.name, w, h, format ? ":format=" : "", format ? format : "");
+        return 0;
+    }
+    // 硬件编码器需要留在设备上的帧
+    if (hw_encoder) {
+        fprintf(stderr, "%s: no %s for the %s device\n", s->name, format ? "format converting scaler" : "scaler",
+                av_hwdevice_get_type_name(frames->device_ctx->type));
+        return AVERROR(ENOSYS);
+    }
+    fprintf(stderr, "%s: no scaler for the %s device, scaling after download\n", s->name,
+            av_hwdevice_get_type_name(frames->device_ctx->type));
+    snprintf(desc, size, "hwdownload,format=pix_fmts=%s,scale=w=%s:h=%s%s%s", av_get_pix_fmt_name(frames->sw_format),
+             w, h, format ? ",format=pix_fmts=" : "", format ? format : "");
+    return 0;
+}
+
+// 按 frame 的格式和尺寸建立 buffer -> 缩放 -> buffersink 的滤镜图
+static int scale_graph_init(DecodeSession *s, const AVFrame *frame) {
+    AVRational time_base = s->input_ctx->streams[s->video_stream]->time_base;
+    AVRational sar = frame->sample_aspect_ratio.num ? frame->sample_aspect_ratio : AVRational{1, 1};
+    AVBufferSrcParameters *par;
+    AVFilterInOut *outputs = NULL, *inputs = NULL;
+    char args[256], desc[256];
+    int ret;
+
+    avfilter_graph_free(&s->scale_graph);
+    if ((ret = scale_filter_desc(s, frame, desc, sizeof(desc))) < 0)
+        return ret;
+    if (!(s->scale_graph = avfilter_graph_alloc()))
+        return AVERROR(ENOMEM);
+
+    snprintf(args, sizeof(args), "video_size=%dx%d:pix_fmt=%d:time_base=%d/%d:pixel_aspect=%d/%d",
+             frame->width, frame->height, frame->format, time_base.num, time_base.den, sar.num, sar.den);
+    if ((ret = avfilter_graph_create_filter(&s->scale_src, avfilter_get_by_name("buffer"), "in", args, NULL,
+                                            s->scale_graph)) < 0 ||
+        (ret = avfilter_graph_create_filter(&s->scale_sink, avfilter_get_by_name("buffersink"), "out", NULL, NULL,
+                                            s->scale_graph)) < 0)
+        return ret;
+    // 硬件帧的输入要带上解码器的硬件帧池，设备上的滤镜从中取得设备
+    if (frame->hw_frames_ctx) {
+        if (!(par = av_buffersrc_parameters_alloc()))
+            return AVERROR(ENOMEM);
+        par->hw_frames_ctx = frame->hw_frames_ctx;
+        ret = av_buffersrc_parameters_set(s->scale_src, par);
+        av_free(par);
+        if (ret < 0)
+            return ret;
+    }
+
+    if (!(outputs = avfilter_inout_alloc()) || !(inputs = avfilter_inout_alloc())) {
+        ret = AVERROR(ENOMEM);
+    } else {
+        outputs->name = av_strdup("in");
+        outputs->filter_ctx = s->scale_src;
+        inputs->name = av_strdup("out");
+        inputs->filter_ctx = s->scale_sink;
+        ret = avfilter_graph_parse_ptr(s->scale_graph, desc, &inputs, &outputs, NULL);
+    }
+    avfilter_inout_free(&inputs);
+    avfilter_inout_free(&outputs);
+    if (ret < 0)
+        return ret;
+
+    // 缩放之后的表面和解码器的表面一样，要留出流水线队列、写入器和编码器持有的余量
+    for (unsigned i = 0; i < s->scale_graph->nb_filters; i++)
+        s->scale_graph->filters[i]->extra_hw_frames = s->decoder_ctx->extra_hw_frames;
+    if ((ret = avfilter_graph_config(s->scale_graph, NULL)) < 0)
+        return ret;
+
+    s->scale_in_format = frame->format;
+    s->scale_in_width = frame->width;
+    s->scale_in_height = frame->height;
+    s->scale_in_frames = frame->hw_frames_ctx ? frame->hw_frames_ctx->data : NULL;
+    fprintf(stderr, "%s: scaling %dx%d %s with %s\n", s->name, frame->width, frame->height,
+            av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)), desc);
+    return 0;
+}
+
+// 缩放一帧，*out 是从帧池中取出的新帧，frame 不变
+static int scale_frame(DecodeSession *s, AVFrame *frame, AVFrame **out) {
+    const void *frames = frame->hw_frames_ctx ? frame->hw_frames_ctx->data : NULL;
+    AVFrame *scaled;
+    int ret;
+
+    if (!s->scale_graph || frame->format != s->scale_in_format || frame->width != s->scale_in_width ||
+        frame->height != s->scale_in_height || frames != s->scale_in_frames) {
+        if ((ret = scale_graph_init(s, frame)) < 0) {
+            fprintf(stderr, "%s: can not create the scaling filter graph\n", s->name);
+            avfilter_graph_free(&s->scale_graph);
+            return ret;
+        }
+    }
+    if (!(scaled = frame_pool_get(&s->frame_pool)))
+        return AVERROR(ENOMEM);
+    // 缩放滤镜一进一出，送入一帧之后立刻就能取出
+    if ((ret = av_buffersrc_add_frame_flags(s->scale_src, frame, AV_BUFFERSRC_FLAG_KEEP_REF)) < 0 ||
+        (ret = av_buffersink_get_frame(s->scale_sink, scaled)) < 0) {
+        fprintf(stderr, "%s: error while scaling\n", s->name);
+        frame_pool_put(&s->frame_pool, scaled);
+        return ret;
+    }
+    *out = scaled;
+    return 0;
+}
+
+/*
+ * 取回解码帧的像素数据。
+ * 硬件帧会被映射或下载到从帧池中取出的内存帧里；软件帧的数据本来就在内存中，*out 直接指向 frame。
+ * 需要缩放时先缩放再下载，*out 为缩放之后的帧。
+ * *out 与 frame 不同时，由调用方负责把它归还到帧池；出错时 *out 仍指向 frame。
+ */
+static int download_frame(DecodeSession *s, AVFrame *frame, AVFrame **out) {
+    AVFrame *src = frame, *scaled = NULL, *sw_frame;
+    int ret;
+
+    *out = frame;
+    if (scale_width > 0 || scale_height > 0 || scale_format != AV_PIX_FMT_NONE) {
+        if ((ret = scale_frame(s, frame, &scaled)) < 0)
+            return ret;
+        src = scaled;
+    }
+    // 只有硬件加速解码格式的帧才需要到对应的硬件设备上取回数据；转码时帧留在硬件上直接交给编码器
+    if (src->format != s->hw_pix_fmt || hw_encoder) {
+        *out = src;
+        return 0;
+    }
+
+    if (!(sw_frame = frame_pool_get(&s->frame_pool))) {
+        fprintf(stderr, "Can not alloc frame\n");
+        frame_pool_put(&s->frame_pool, scaled);
+        return AVERROR(ENOMEM);
+    }
+
+    // 映射持有源帧的引用，缩放之后的帧可以立刻归还
+    if (output_mode == OUTPUT_MAP && !s->hw_map_failed && map_hw_frame(s, sw_frame, src) == 0) {
+        frame_pool_put(&s->frame_pool, scaled);
+        *out = sw_frame;
+        return 0;
+    }
+
+    // 下载用的内存帧复用缓存池中的缓存，避免 av_hwframe_transfer_data() 每帧重新分配
+    if ((ret = sw_frame_get_buffer(s, sw_frame, src)) < 0) {
+        fprintf(stderr, "Can not alloc frame buffer\n");
+    } else if ((ret = av_hwframe_transfer_data(sw_frame, src, 0)) < 0) {
+        // 从硬加速设备上把数据提取到CPU
+        fprintf(stderr, "Error transferring the data to system memory\n");
+    }
+    if (ret < 0) {
+        frame_pool_put(&s->frame_pool, sw_frame);
+        frame_pool_put(&s->frame_pool, scaled);
+        return ret;
+    }
+    // 硬件帧池的尺寸可能大于实际图像尺寸，下载完成后还原成真实尺寸
+    sw_frame->width = src->width;
+    sw_frame->height = src->height;
+    frame_pool_put(&s->frame_pool, scaled);
+    *out = sw_frame;
+    return 0;
+}
+
+// 把内存帧的像素数据写入到会话的输出文件中
+static int write_frame(DecodeSession *s, const AVFrame *frame) {
+    AVBufferRef *buffer;
+    int size;
+    int ret;
+
+    /*
+     * 获取解码帧的原图尺寸。
+     * 刚解码出来的帧数据尺寸可能并不是真正原图的尺寸，比如在编码过程中采用了YUV4:2:0的帧取样格式，
+     * 这样编码所得到的数据帧尺寸与原图的尺寸是不同的，av_image_get_buffer_size() 函数是按照数据帧格式还原原图的尺寸。
+     */
+    size = av_image_get_buffer_size(static_cast<AVPixelFormat>(frame->format), frame->width,
+                                    frame->height, 1);
+
+    // 直接写各个平面，不再拷贝到中间缓存
+    if (output_mode != OUTPUT_COPY) {
+        if ((ret = write_planes(s->writer, frame)) < 0) {
+            fprintf(stderr, "Failed to dump raw data.\n");
+            return ret;
+        }
+        stats_count(&s->frames_written, 1);
+        stats_count(&s->bytes_written, size);
+        return 0;
+    }
+    // 从缓存池中取出保存原图数据的内存空间，分辨率不变时不会重新申请
+    buffer = image_pool_get(&s->copy_image_pool, static_cast<AVPixelFormat>(frame->format),
+                            frame->width, frame->height, 1);
+    if (!buffer) {
+        fprintf(stderr, "Can not alloc buffer\n");
+        return AVERROR(ENOMEM);
+    }
+    // 根据数据帧取样格式还原原图的像素数据
+    ret = av_image_copy_to_buffer(buffer->data, size,
+                                  (const uint8_t *const *) frame->data,
+                                  (const int *) frame->linesize, static_cast<AVPixelFormat>(frame->format),
+                                  frame->width, frame->height, 1);
+    if (ret < 0) {
+        fprintf(stderr, "Can not copy image to buffer\n");
+    } else if ((ret = writer_write_buffer(s->writer, buffer, buffer->data, size)) < 0) {
+        // 把原图的像素数据写入到文件中，写入器引用着缓存，写完之后缓存才回到缓存池
+        fprintf(stderr, "Failed to dump raw data.\n");
+    } else {
+        stats_count(&s->frames_written, 1);
+        stats_count(&s->bytes_written, size);
+    }
+    av_buffer_unref(&buffer);
+    return ret < 0 ? ret : 0;
+}
+
+/*
+ * 打开解码上下文。hw 为真时装配共用的硬件设备，否则按多线程软件解码打开。
+ * 参数都来自 session_open() 探测到的流信息，切换到软件解码时不需要重新探测。
+ */
+static int decoder_open(DecodeSession *s, const AVCodec *decoder, bool hw) {
+    AVStream *video = s->input_ctx->streams[s->video_stream];
+    int ret, extra;
+
+    // 通过解码器初始化解码上下文（AVCodecContext）
+    if (!(s->decoder_ctx = avcodec_alloc_context3(decoder)))
+        return AVERROR(ENOMEM);
+
+    // 通过流数据检测到的配置信息直接赋值给解码上下文
+    if ((ret = avcodec_parameters_to_context(s->decoder_ctx, video->codecpar)) < 0)
+        return ret;
+    s->decoder_ctx->pkt_timebase = video->time_base;
+    // 抽帧需要目标之前的每一帧，不让解码器丢帧
+    if (extract_times.empty())
+        frame_select_apply(&s->select, s->decoder_ctx);
+
+    if (hw) {
+        s->decoder_ctx->opaque = s;
+        s->decoder_ctx->get_format = get_hw_format;
+        // 把共用的硬加速上下文装配到编解码上下文中，所有会话的表面都从同一个设备上分配
+        if ((ret = hw_decoder_init(s->decoder_ctx)) < 0)
+            return ret;
+
+        /*
+         * 解码器之外还持有表面的地方，都要让解码器在硬件帧池中额外多申请，否则解码器会因为拿不到空闲表面而失败：
+         * 转码模式下编码器持有尚未编码完成的表面；
+         * 流水线模式下，队列中等待下载的帧（map 和转码模式下还有等待写文件的帧）也都占用着表面；
+         * map 模式下异步写入器还在写的帧同样持有映射的表面。
+         */
+        extra = extra_hw_frames >= 0 ? extra_hw_frames : hw_encoder ? ENCODER_HW_FRAMES : 0;
+        if (s->pipeline)
+            extra += s->pipeline->frame_queue_size + 1 +
+                     (output_mode == OUTPUT_MAP || hw_encoder ? s->pipeline->write_queue_size + 1 : 0);
+        if (output_mode == OUTPUT_MAP && !hw_encoder && writer_cfg.backend != WRITER_SYNC)
+            extra += writer_cfg.depth;
+        if (extra > 0)
+            s->decoder_ctx->extra_hw_frames = extra;
+    } else {
+        s->decoder_ctx->thread_count = sw_threads;
+        s->decoder_ctx->thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    }
+
+    // 打开编解码上下文
+    if ((ret = avcodec_open2(s->decoder_ctx, decoder, NULL)) < 0) {
+        fprintf(stderr, "%s: failed to open codec for stream #%u\n", s->name, s->video_stream);
+        return ret;
+    }
+    s->sw_decoding = !hw;
+    return 0;
+}
+
+static void replay_clear(DecodeSession *s) {
+    for (AVPacket *pkt : s->replay_packets)
+        av_packet_free(&pkt);
+    s->replay_packets.clear();
+    s->replay_pos = 0;
+}
+
+// 转码模式下硬件编码器只接受硬件帧，不能回退
+static bool can_fallback(const DecodeSession *s) {
+    return sw_fallback && !s->sw_decoding && !hw_encoder;
+}
+
+// 丢掉出错的硬件解码器，在同一个会话上换成软件解码器，重放缓存的压缩包
+static int switch_to_software(DecodeSession *s, int err) {
+    AVCodecContext *hw_ctx = s->decoder_ctx;
+    char errbuf[AV_ERROR_MAX_STRING_SIZE];
+    int ret;
+
+    fprintf(stderr, "%s: hardware decoding failed (%s), switching to software decoding\n",
+            s->name, av_make_error_string(errbuf, sizeof(errbuf), err));
+    s->decoder_ctx = NULL;
+    ret = decoder_open(s, hw_ctx->codec, false);
+    avcodec_free_context(&hw_ctx);
+    if (ret < 0)
+        return ret;
+
+    s->resume_pts = s->last_pts;
+    if (s->replay_overflow) {
+        replay_clear(s);
+        s->wait_keyframe = 1;
+    }
+    s->replay_pos = 0;
+    s->replay_flush = s->draining;
+    return 0;
+}
+
+// 向解码器发送压缩包，pkt 为空时清空解码器
+static int decoder_send_packet(DecodeSession *s, const AVPacket *pkt) {
+    int ret;
+
+    if (!pkt) {
+        s->draining = 1;
+    } else if (s->wait_keyframe) {
+        if (!(pkt->flags & AV_PKT_FLAG_KEY))
+            return 0;
+        s->wait_keyframe = 0;
+    }
+
+    if (can_fallback(s) && pkt) {
+        // 遇到关键帧就丢弃之前的缓存，缓存只覆盖当前 GOP
+        if (pkt->flags & AV_PKT_FLAG_KEY) {
+            replay_clear(s);
+            s->replay_overflow = 0;
+        }
+        if (!s->replay_overflow) {
+            AVPacket *copy;
+            if (s->replay_packets.size() >= REPLAY_MAX_PACKETS) {
+                replay_clear(s);
+                s->replay_overflow = 1;
+            } else if ((copy = av_packet_clone(pkt))) {
+                s->replay_packets.push_back(copy);
+            }
+        }
+    }
+
+    ret = avcodec_send_packet(s->decoder_ctx, pkt);
+    // 出错的压缩包已经在缓存中，切换后随缓存一起重放
+    if (ret < 0 && can_fallback(s))
+        ret = switch_to_software(s, ret);
+    return ret;
+}
+
+// 从解码器获取解码帧；切换到软件解码后先把缓存的压缩包重放完
+static int decoder_receive_frame(DecodeSession *s, AVFrame *frame) {
+    int64_t pts;
+    int ret;
+
+    while (true) {
+        ret = avcodec_receive_frame(s->decoder_ctx, frame);
+        if (ret == AVERROR(EAGAIN) && s->sw_decoding && (s->replay_pos < s->replay_packets.size() || s->replay_flush)) {
+            if (s->replay_pos < s->replay_packets.size()) {
+                ret = avcodec_send_packet(s->decoder_ctx, s->replay_packets[s->replay_pos++]);
+                if (s->replay_pos == s->replay_packets.size())
+                    replay_clear(s);
+            } else {
+                s->replay_flush = 0;
+                ret = avcodec_send_packet(s->decoder_ctx, NULL);
+            }
+            if (ret < 0)
+                return ret;
+            continue;
+        }
+        if (ret < 0 && ret != AVERROR(EAGAIN) && ret != AVERROR_EOF && can_fallback(s)) {
+            if ((ret = switch_to_software(s, ret)) < 0)
+                return ret;
+            continue;
+        }
+        if (ret < 0)
+            return ret;
+
+        pts = frame->best_effort_timestamp;
+        if (!s->sw_decoding) {
+            s->last_pts = pts;
+        } else if (s->resume_pts != AV_NOPTS_VALUE) {
+            // 重放的 GOP 中硬件已经输出过的帧不再输出；没有时间戳时无法判断，照常输出
+            if (pts != AV_NOPTS_VALUE && pts <= s->resume_pts) {
+                av_frame_unref(frame);
+                continue;
+            }
+            s->resume_pts = AV_NOPTS_VALUE;
+        }
+        return 0;
+    }
+}
+
+/*
+ * 按第一帧的像素格式和尺寸打开编码器。
+ * 硬件帧的 hw_frames_ctx 就是解码器的硬件帧池，编码器引用同一个帧池，表面在两者之间直接传递。
+ */
+static int encoder_open(DecodeSession *s, const AVFrame *frame) {
+    AVStream *video = s->input_ctx->streams[s->video_stream];
+    AVRational framerate = video->avg_frame_rate.num > 0 && video->avg_frame_rate.den > 0 ?
+                           video->avg_frame_rate : av_make_q(25, 1);
+    const enum AVPixelFormat *p;
+    int ret;
+
+    if (hw_encoder->pix_fmts) {
+        for (p = hw_encoder->pix_fmts; *p != AV_PIX_FMT_NONE && *p != frame->format; p++);
+        if (*p == AV_PIX_FMT_NONE) {
+            fprintf(stderr, "%s: encoder %s can not take %s frames, pick an encoder for the same device\n",
+                    s->name, hw_encoder->name, av_get_pix_fmt_name(static_cast<AVPixelFormat>(frame->format)));
+            return AVERROR(EINVAL);
+        }
+    }
+
+    if (!(s->encoder_pkt = core_packet_alloc()))
+        return AVERROR(ENOMEM);
+    if ((ret = core_encoder_alloc(&s->encoder_ctx, hw_encoder, frame->width, frame->height, framerate)) < 0)
+        return ret;
+    s->encoder_ctx->pix_fmt = static_cast<AVPixelFormat>(frame->format);
+    s->encoder_ctx->sample_aspect_ratio = frame->sample_aspect_ratio;
+    if (frame->hw_frames_ctx && !(s->encoder_ctx->hw_frames_ctx = av_buffer_ref(frame->hw_frames_ctx)))
+        return AVERROR(ENOMEM);
+
+    if ((ret = avcodec_open2(s->encoder_ctx.get(), hw_encoder, NULL)) < 0) {
+        fprintf(stderr, "%s: could not open encoder %s\n", s->name, hw_encoder->name);
+        return ret;
+    }
+    return 0;
+}
+
+/*
+ * 按帧选择判断是否输出这一帧，不输出的帧不下载、不写出。
+ * 过了最后一个时间段时通知解复用停止读取。
+ */
+static bool session_want_frame(DecodeSession *s, const AVFrame *frame) {
+    AVStream *video = s->input_ctx->streams[s->video_stream];
+    int64_t pts = frame->best_effort_timestamp;
+    double time = -1;
+
+    if (pts != AV_NOPTS_VALUE)
+        time = (pts - (video->start_time != AV_NOPTS_VALUE ? video->start_time : 0)) * av_q2d(video->time_base);
+    if (frame_select_want(&s->select, frame, time))
+        return true;
+    if (s->select.finished)
+        s->input_done = true;
+    return false;
+}
+
+// 把一帧送进编码器，并把得到的压缩包写入输出文件；frame 为空时清空编码器
+static int encode_frame(DecodeSession *s, AVFrame *frame) {
+    const CodecTimers timers = {&s->encode_latency, NULL};
+    int ret;
+
+    if (!s->encoder_ctx) {
+        if (!frame)
+            return 0;
+        if ((ret = encoder_open(s, frame)) < 0)
+            return ret;
+    }
+
+    // 与 video_encode 一样按帧序号设置 pts，不依赖输入流时间戳的连续性
+    if (frame)
+        frame->pts = s->frames_written.load();
+    ret = core_encode(s->encoder_ctx.get(), frame, s->encoder_pkt.get(), [s](AVPacket *pkt) {
+        int64_t t = stats_now();
+        int err = writer_write_packet(s->writer, pkt);
+        latency_record(&s->write_latency, t);
+        stats_count(&s->bytes_written, pkt->size);
+        if (err < 0)
+            fprintf(stderr, "%s: failed to write packet\n", s->name);
+        return err;
+    }, &timers);
+    if (ret < 0) {
+        fprintf(stderr, "%s: error during encoding\n", s->name);
+        return ret;
+    }
+    if (frame)
+        stats_count(&s->frames_written, 1);
+    return 0;
+}
+
+// 输出一帧：转码模式下编码，否则写出原始像素数据
+static int output_frame(DecodeSession *s, AVFrame *frame) {
+    int64_t t;
+    int ret;
+
+    if (hw_encoder) {
+        ret = encode_frame(s, frame);
+    } else {
+        // 映射的表面只适合顺序读取，处理结果写到新缓存中
+        if (s->postproc) {
+            t = stats_now();
+            ret = postproc_frame(s->postproc, frame, output_mode != OUTPUT_MAP);
+            latency_record(&s->postproc_latency, t);
+            if (ret < 0) {
+                fprintf(stderr, "%s: error while post-processing a frame\n", s->name);
+                return ret;
+            }
+        }
+        t = stats_now();
+        ret = write_frame(s, frame);
+        latency_record(&s->write_latency, t);
+    }
+    if (s->first_frame_time < 0 && s->frames_written.load() > 0)
+        s->first_frame_time = av_gettime_relative();
+    stats_report_periodic(&s->reporter, s->name, s->frames_written.load(), s->stages, NB_SESSION_STAGES);
+    return ret;
+}
+
+// 把解码压缩包，并把帧数据写入到会话的输出文件中
+static int decode_write(DecodeSession *s, AVPacket *packet) {
+    AVFrame *frame = NULL, *tmp_frame = NULL;
+    int64_t t;
     int ret = 0;
 
     // 向编解码上下文发送压缩包
-    ret = avcodec_send_packet(avctx, packet);
+    t = stats_now();
+    ret = decoder_send_packet(s, packet);
+    latency_record(&s->send_latency, t);
     if (ret < 0) {
         fprintf(stderr, "Error during decoding\n");
         return ret;
     }
 
     while (true) {
-        // 创建帧
-        if (!(frame = av_frame_alloc()) || !(sw_frame = av_frame_alloc())) {
+        // 从帧池中取出帧
+        if (!(frame = frame_pool_get(&s->frame_pool))) {
             fprintf(stderr, "Can not alloc frame\n");
-            ret = AVERROR(ENOMEM);
-            goto fail;
+            return AVERROR(ENOMEM);
         }
 
         // 尝试从编解码上下文中获取解码帧
-        ret = avcodec_receive_frame(avctx, frame);
+        t = stats_now();
+        ret = decoder_receive_frame(s, frame);
         if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF) {
-            av_frame_free(&frame);
-            av_frame_free(&sw_frame);
+            frame_pool_put(&s->frame_pool, frame);
             return 0;
         } else if (ret < 0) {
             fprintf(stderr, "Error while decoding\n");
-            goto fail;
+            frame_pool_put(&s->frame_pool, frame);
+            return ret;
         }
+        latency_record(&s->receive_latency, t);
 
-        // 如果返回的帧格式是硬件加速解码格式，则还需要到对应的硬件设备上取回数据
-        if (frame->format == hw_pix_fmt) {
-            // 从硬加速设备上把数据提取到CPU
-            if ((ret = av_hwframe_transfer_data(sw_frame, frame, 0)) < 0) {
-                fprintf(stderr, "Error transferring the data to system memory\n");
-                goto fail;
+        // 抽帧时目标之前的帧和已经取到目标之后的帧都不下载、不输出
+        if (s->extracting) {
+            int64_t pts = frame->best_effort_timestamp;
+            if (s->extracting == 2 || (pts != AV_NOPTS_VALUE && pts < s->extract_pts)) {
+                frame_pool_put(&s->frame_pool, frame);
+                continue;
             }
-            tmp_frame = sw_frame;
-        } else
-            tmp_frame = frame;
+            s->extracting = 2;
+        } else if (!session_want_frame(s, frame)) {
+            frame_pool_put(&s->frame_pool, frame);
+            continue;
+        }
 
-        /*
-         * 获取解码帧的原图尺寸。
-         * 刚解码出来的帧数据尺寸可能并不是真正原图的尺寸，比如在编码过程中采用了YUV4:2:0的帧取样格式，
-         * 这样编码所得到的数据帧尺寸与原图的尺寸是不同的，av_image_get_buffer_size() 函数是按照数据帧格式还原原图的尺寸。
-         */
-        size = av_image_get_buffer_size(static_cast<AVPixelFormat>(tmp_frame->format), tmp_frame->width,
-                                        tmp_frame->height, 1);
-        // 申请保存原图数据的内存空间
-        buffer = static_cast<uint8_t *>(av_malloc(static_cast<size_t>(size)));
-        if (!buffer) {
-            fprintf(stderr, "Can not alloc buffer\n");
+        t = stats_now();
+        ret = download_frame(s, frame, &tmp_frame);
+        latency_record(&s->transfer_latency, t);
+        if (ret == 0)
+            ret = output_frame(s, tmp_frame);
+
+        // 帧和缓存都归还到池中
+        if (tmp_frame != frame)
+            frame_pool_put(&s->frame_pool, tmp_frame);
+        frame_pool_put(&s->frame_pool, frame);
+        if (ret < 0)
+            return ret;
+    }
+}
+
+static void session_index_packet(DecodeSession *s, const AVPacket *pkt) {
+    if (s->indexing)
+        index_add(&s->packet_index, pkt->pos, pkt->pts, pkt->size, pkt->flags & AV_PKT_FLAG_KEY);
+}
+
+// 在 trace 中用 "<会话名> <阶段>" 标记当前线程
+static void session_thread_name(const DecodeSession *s, const char *stage) {
+    char name[64];
+
+    snprintf(name, sizeof(name), "%s %s", s->name, stage);
+    trace_thread_name(name);
+}
+
+/*
+ * 四级流水线：解复用、解码、下载、写文件分别在各自的线程上运行，各级之间用 PacketQueue 和 SpscQueue 传递所有权。
+ * 队列中的空指针表示流结束；任何一级出错都会置位 abort，其余各级随即退出。
+ */
+struct Pipeline {
+    Pipeline(DecodeSession *session, const PipelineConfig &cfg)
+            : session(session), frames(cfg.frame_queue_size), downloaded(cfg.write_queue_size) {
+        packet_queue_init(&packets, &cfg.packet_limits, session->input_ctx->streams[session->video_stream]->time_base);
+    }
+
+    DecodeSession *session;
+
+    PacketQueue packets;
+    // 解码得到的帧，可能仍在硬件上
+    SpscQueue<AVFrame *> frames;
+    // 已经可以在内存中读取的帧
+    SpscQueue<AVFrame *> downloaded;
+
+    std::atomic<bool> abort{false};
+    // 第一个出错的返回值
+    std::atomic<int> error{0};
+};
+
+static void pipeline_fail(Pipeline *p, int err) {
+    int expected = 0;
+    p->error.compare_exchange_strong(expected, err);
+    p->abort.store(true);
+    packet_queue_abort(&p->packets);
+}
+
+/*
+ * 读取下一个视频包，其他流的包直接丢弃。
+ * 串行、解复用线程和流水线三种方式共用这里的读取错误处理：读到文件末尾返回 AVERROR_EOF，由调用方清空解码器；
+ * 其他错误（截断或损坏的输入、I/O 或网络错误）输出后原样返回，这一路流解码失败。
+ */
+static int session_read_packet(DecodeSession *s, AVPacket *pkt) {
+    int64_t t;
+    int ret;
+
+    while (true) {
+        t = stats_now();
+        if ((ret = av_read_frame(s->input_ctx, pkt)) < 0) {
+            if (ret != AVERROR_EOF) {
+                char errbuf[AV_ERROR_MAX_STRING_SIZE];
+                fprintf(stderr, "%s: error reading input: %s\n", s->name,
+                        av_make_error_string(errbuf, sizeof(errbuf), ret));
+            }
+            return ret;
+        }
+        latency_record(&s->demux_latency, t);
+        if (pkt->stream_index == s->video_stream) {
+            session_index_packet(s, pkt);
+            return 0;
+        }
+        av_packet_unref(pkt);
+    }
+}
+
+/*
+ * 解复用线程：把视频流的包放进 q。
+ * 其他流在打开输入时已经设为 AVDISCARD_ALL，容器直接跳过它们的数据，这里读到的几乎都是视频包。
+ * 读到文件末尾或提前停下时放入空指针，解码端清空解码器；读取出错时中止队列并返回错误，解码端不再清空。
+ */
+static int demux_packets(DecodeSession *s, PacketQueue *q) {
+    AVPacket *pkt = NULL;
+    int ret = 0;
+
+    session_thread_name(s, "demux");
+    while (!s->input_done.load()) {
+        if (!pkt && !(pkt = av_packet_alloc())) {
             ret = AVERROR(ENOMEM);
-            goto fail;
+            break;
         }
-        // 根据数据帧取样格式还原原图的像素数据
-        ret = av_image_copy_to_buffer(buffer, size,
-                                      (const uint8_t *const *) tmp_frame->data,
-                                      (const int *) tmp_frame->linesize, static_cast<AVPixelFormat>(tmp_frame->format),
-                                      tmp_frame->width, tmp_frame->height, 1);
-        if (ret < 0) {
-            fprintf(stderr, "Can not copy image to buffer\n");
-            goto fail;
+        if ((ret = session_read_packet(s, pkt)) < 0) {
+            if (ret == AVERROR_EOF)
+                ret = 0;
+            break;
         }
-        // 把原图的像素数据写入到文件中
-        if ((ret = fwrite(buffer, 1, size, output_file)) < 0) {
-            fprintf(stderr, "Failed to dump raw data.\n");
-            goto fail;
+        if (!packet_queue_push(q, pkt))
+            break;
+        pkt = NULL;
+    }
+    av_packet_free(&pkt);
+    if (ret < 0)
+        packet_queue_abort(q);
+    else
+        packet_queue_push(q, NULL);
+    return ret;
+}
+
+static void demux_thread(Pipeline *p) {
+    int ret = demux_packets(p->session, &p->packets);
+
+    if (ret < 0)
+        pipeline_fail(p, ret);
+}
+
+static void decode_thread(Pipeline *p) {
+    DecodeSession *s = p->session;
+    AVPacket *pkt;
+    AVFrame *frame;
+    int64_t t;
+    int ret;
+
+    session_thread_name(s, "decode");
+    while (packet_queue_pop(&p->packets, &pkt)) {
+        // 空包表示清空解码器
+        bool flush = !pkt;
+
+        // 已经不需要后面的帧了，丢弃解复用停下之前送来的包，直到收到结束用的空包
+        if (s->input_done.load()) {
+            av_packet_free(&pkt);
+            if (flush)
+                break;
+            continue;
         }
 
-        fail:
-        av_frame_free(&frame);
-        av_frame_free(&sw_frame);
-        av_freep(&buffer);
-        if (ret < 0)
-            return ret;
+        t = stats_now();
+        ret = decoder_send_packet(s, pkt);
+        latency_record(&s->send_latency, t);
+        av_packet_free(&pkt);
+        if (ret < 0) {
+            fprintf(stderr, "Error during decoding\n");
+            pipeline_fail(p, ret);
+            break;
+        }
+
+        while (true) {
+            if (!(frame = frame_pool_get(&s->frame_pool))) {
+                fprintf(stderr, "Can not alloc frame\n");
+                pipeline_fail(p, AVERROR(ENOMEM));
+                break;
+            }
+            t = stats_now();
+            ret = decoder_receive_frame(s, frame);
+            if (ret < 0) {
+                frame_pool_put(&s->frame_pool, frame);
+                if (ret != AVERROR(EAGAIN) && ret != AVERROR_EOF) {
+                    fprintf(stderr, "Error while decoding\n");
+                    pipeline_fail(p, ret);
+                }
+                break;
+            }
+            latency_record(&s->receive_latency, t);
+            if (!session_want_frame(s, frame)) {
+                frame_pool_put(&s->frame_pool, frame);
+                continue;
+            }
+            if (!p->frames.push(frame, p->abort)) {
+                frame_pool_put(&s->frame_pool, frame);
+                break;
+            }
+        }
+        if (flush || p->abort.load())
+            break;
     }
+    p->frames.push(NULL, p->abort);
 }
 
-int main(int argc, char *argv[]) {
-    AVFormatContext *input_ctx = NULL;
-    int video_stream, ret;
-    AVStream *video = NULL;
-    AVCodecContext *decoder_ctx = NULL;
-    AVCodec *decoder = NULL;
-    AVPacket packet;
-    enum AVHWDeviceType type;
-    int i;
+static void download_thread(Pipeline *p) {
+    DecodeSession *s = p->session;
+    AVFrame *frame, *sw_frame;
+    int64_t t;
+    int ret;
 
-    if (argc < 4) {
-        fprintf(stderr, "Usage: %s <device type> <input file> <output file>\n", argv[0]);
-        return -1;
+    session_thread_name(s, "download");
+    while (p->frames.pop(&frame, p->abort) && frame) {
+        t = stats_now();
+        ret = download_frame(s, frame, &sw_frame);
+        latency_record(&s->transfer_latency, t);
+        // 下载完成后硬件帧立刻归还，让解码器可以复用它的表面
+        if (ret < 0 || sw_frame != frame)
+            frame_pool_put(&s->frame_pool, frame);
+        if (ret < 0) {
+            pipeline_fail(p, ret);
+            break;
+        }
+        if (!p->downloaded.push(sw_frame, p->abort)) {
+            frame_pool_put(&s->frame_pool, sw_frame);
+            break;
+        }
     }
+    p->downloaded.push(NULL, p->abort);
+}
 
-    // 通过名称获取硬件加速设备类型
-    type = av_hwdevice_find_type_by_name(argv[1]);
-    if (type == AV_HWDEVICE_TYPE_NONE) {
-        fprintf(stderr, "Device type %s is not supported.\n", argv[1]);
-        fprintf(stderr, "Available device types:");
-        // 遍历本地支持的所有硬件加速设备类型
-        while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
-            fprintf(stderr, " %s", av_hwdevice_get_type_name(type));
-        fprintf(stderr, "\n");
-        return -1;
+static void write_thread(Pipeline *p) {
+    DecodeSession *s = p->session;
+    AVFrame *frame;
+    int ret;
+
+    session_thread_name(s, "write");
+    while (p->downloaded.pop(&frame, p->abort) && frame) {
+        ret = output_frame(s, frame);
+        frame_pool_put(&s->frame_pool, frame);
+        if (ret < 0) {
+            pipeline_fail(p, ret);
+            break;
+        }
     }
+}
+
+// 以流水线方式完成解码，写文件在调用线程上进行
+static int decode_pipeline(DecodeSession *s, const PipelineConfig *cfg) {
+    Pipeline p(s, *cfg);
+    AVFrame *frame;
+
+    std::thread demuxer(demux_thread, &p);
+    std::thread decoder(decode_thread, &p);
+    std::thread downloader(download_thread, &p);
+    write_thread(&p);
+
+    downloader.join();
+    decoder.join();
+    demuxer.join();
+
+    // 出错退出时队列中可能还有没处理完的包和帧
+    packet_queue_uninit(&p.packets);
+    while (p.frames.try_pop(&frame))
+        frame_pool_put(&s->frame_pool, frame);
+    while (p.downloaded.try_pop(&frame))
+        frame_pool_put(&s->frame_pool, frame);
+
+    return p.error.load();
+}
+
+/*
+ * MP4、MKV 等容器的头部已经记录了编码格式和分辨率，解码器可以直接据此打开，不需要再读取压缩包探测。
+ * 裸码流和 MPEG-TS 之类没有完整头部的输入仍然走 avformat_find_stream_info()。
+ */
+static bool stream_header_complete(AVFormatContext *ctx) {
+    int index = av_find_best_stream(ctx, AVMEDIA_TYPE_VIDEO, -1, -1, NULL, 0);
+    const AVCodecParameters *par;
+
+    if (index < 0)
+        return false;
+    par = ctx->streams[index]->codecpar;
+    return par->codec_id != AV_CODEC_ID_NONE && par->width > 0 && par->height > 0;
+}
+
+/*
+ * 打开会话的输入、解码器和输出文件。
+ * 各个会话都可以在自己的线程上调用。快速启动时硬件设备可能还在创建，打开硬件解码器前才等待。
+ */
+static int session_open(DecodeSession *s, enum AVHWDeviceType type) {
+    AVCodec *decoder = NULL;
+    AVDictionary *opts = NULL;
+    int i, ret;
 
     // 打开视频文件，读取文件头部信息
-    if (avformat_open_input(&input_ctx, argv[2], NULL, NULL) != 0) {
-        fprintf(stderr, "Cannot open input file '%s'\n", argv[2]);
-        return -1;
+    if (fast_start) {
+        av_dict_set(&opts, "probesize", FAST_PROBE_SIZE, 0);
+        av_dict_set(&opts, "analyzeduration", FAST_ANALYZE_DURATION, 0);
+    }
+    // 对象存储、NFS 上的输入以大块连续读取，由预读线程提前放进内存，解复用不再等待每次读取的往返
+    if (prefetch_cfg.window > 0) {
+        if ((ret = prefetch_open(&s->prefetch, &s->input_pb, s->input_filename, &prefetch_cfg,
+                                 &s->prefetch_latency)) < 0 ||
+            !(s->input_ctx = avformat_alloc_context())) {
+            fprintf(stderr, "%s: cannot open input file '%s'\n", s->name, s->input_filename);
+            av_dict_free(&opts);
+            return ret < 0 ? ret : AVERROR(ENOMEM);
+        }
+        s->input_ctx->pb = s->input_pb;
+        s->input_ctx->flags |= AVFMT_FLAG_CUSTOM_IO;
+    }
+    ret = avformat_open_input(&s->input_ctx, s->input_filename, NULL, &opts);
+    av_dict_free(&opts);
+    if (ret != 0) {
+        fprintf(stderr, "%s: cannot open input file '%s'\n", s->name, s->input_filename);
+        return ret;
     }
 
     // 通过读取数据流的第一个压缩包识别视频流信息，对于某些没有头部的编码格式（如MPEG），用这个方法识别流信息非常好用
-    if (avformat_find_stream_info(input_ctx, NULL) < 0) {
-        fprintf(stderr, "Cannot find input stream information.\n");
-        return -1;
+    if (!(fast_start && stream_header_complete(s->input_ctx)) &&
+        (ret = avformat_find_stream_info(s->input_ctx, NULL)) < 0) {
+        fprintf(stderr, "%s: cannot find input stream information.\n", s->name);
+        return ret;
     }
 
     /*
@@ -174,12 +1326,16 @@ int main(int argc, char *argv[]) {
      * 一个视频文件中通常会有多个流同时存在，包括视频流、音频流、字幕等。
      * 这个方法就是在这么多的流中获取指定类型的流
      */
-    ret = av_find_best_stream(input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
+    ret = av_find_best_stream(s->input_ctx, AVMEDIA_TYPE_VIDEO, -1, -1, &decoder, 0);
     if (ret < 0) {
-        fprintf(stderr, "Cannot find a video stream in the input file\n");
-        return -1;
+        fprintf(stderr, "%s: cannot find a video stream in the input file\n", s->name);
+        return ret;
     }
-    video_stream = ret;
+    s->video_stream = ret;
+    // 只解码这一路视频流，其他流在容器层面就跳过，不再读成压缩包再丢弃
+    for (i = 0; i < static_cast<int>(s->input_ctx->nb_streams); i++)
+        if (i != s->video_stream)
+            s->input_ctx->streams[i]->discard = AVDISCARD_ALL;
 
     /*
      * 获取硬加速配置。
@@ -189,63 +1345,488 @@ int main(int argc, char *argv[]) {
     for (i = 0;; i++) {
         const AVCodecHWConfig *config = avcodec_get_hw_config(decoder, i);
         if (!config) {
-            fprintf(stderr, "Decoder %s does not support device type %s.\n",
-                    decoder->name, av_hwdevice_get_type_name(type));
-            return -1;
+            fprintf(stderr, "%s: decoder %s does not support device type %s.\n",
+                    s->name, decoder->name, av_hwdevice_get_type_name(type));
+            if (!can_fallback(s))
+                return AVERROR(ENOSYS);
+            break;
         }
         if (config->methods & AV_CODEC_HW_CONFIG_METHOD_HW_DEVICE_CTX &&
             config->device_type == type) {
             // 记录硬件加速解码的帧格式。
             // 解码时，通过帧格式判断解码帧是否由硬件加速解码，若遇到硬加速的帧需要从硬件中获取解码数据。
-            hw_pix_fmt = config->pix_fmt;
+            s->hw_pix_fmt = config->pix_fmt;
             break;
         }
     }
 
-    // 通过解码器初始化解码上下文（AVCodecContext）
-    if (!(decoder_ctx = avcodec_alloc_context3(decoder)))
-        return AVERROR(ENOMEM);
+    // 硬件解码器打不开时同样直接使用软件解码
+    ret = s->hw_pix_fmt != AV_PIX_FMT_NONE ? decoder_open(s, decoder, true) : AVERROR(ENOSYS);
+    if (ret < 0 && can_fallback(s)) {
+        avcodec_free_context(&s->decoder_ctx);
+        fprintf(stderr, "%s: using software decoding\n", s->name);
+        ret = decoder_open(s, decoder, false);
+    }
+    if (ret < 0)
+        return ret;
 
-    video = input_ctx->streams[video_stream];
-    // 通过流数据检测到的配置信息直接赋值给解码上下文
-    if (avcodec_parameters_to_context(decoder_ctx, video->codecpar) < 0)
+    // 打开输出文件流用于保存解码数据
+    if (!(s->output_file = fopen(s->output_filename, "w+"))) {
+        fprintf(stderr, "%s: cannot open output file '%s'\n", s->name, s->output_filename);
+        return AVERROR(errno);
+    }
+    if ((ret = writer_open(&s->writer, s->output_file, &writer_cfg)) < 0)
+        return ret;
+    if (postproc_enabled(&postproc_cfg) && (ret = postproc_alloc(&s->postproc, &postproc_cfg)) < 0)
+        return ret;
+    fprintf(stderr, "%s: output writer %s (depth %d)\n", s->name, writer_backend_name(s->writer->backend),
+            writer_cfg.depth);
+    return 0;
+}
+
+// 读取输入文件旁边的索引；没有或者已经过期时准备在这次解复用时重新建立
+static void session_index_open(DecodeSession *s) {
+    std::string path = index_path(s->input_filename);
+
+    if (use_index && index_load(&s->packet_index, path.c_str(), s->input_filename) == 0 &&
+        s->packet_index.stream_index == s->video_stream)
+        return;
+    if (index_reset(&s->packet_index, s->input_filename, s->input_ctx->streams[s->video_stream]->time_base,
+                    s->video_stream) == 0)
+        s->indexing = 1;
+}
+
+static void session_index_save(DecodeSession *s) {
+    std::string path = index_path(s->input_filename);
+
+    s->indexing = 0;
+    if (use_index && index_save(&s->packet_index, path.c_str()) < 0)
+        fprintf(stderr, "%s: could not write index %s\n", s->name, path.c_str());
+}
+
+// 解复用整个输入建立索引，不解码
+static int session_index_scan(DecodeSession *s) {
+    AVPacket packet;
+    int ret;
+
+    while ((ret = av_read_frame(s->input_ctx, &packet)) >= 0) {
+        if (packet.stream_index == s->video_stream)
+            session_index_packet(s, &packet);
+        av_packet_unref(&packet);
+    }
+    if (ret != AVERROR_EOF)
+        return ret;
+    session_index_save(s);
+    return 0;
+}
+
+/*
+ * 把输入定位到索引中 entry 所在的关键帧。
+ * 先按关键帧的时间戳定位：MP4、MKV、FLV 等容器有自己的定位实现，按字节定位会落到交错的音频数据或样本表之外。
+ * 解复用器没有定位实现（裸码流、MPEG-TS 等）时时间戳定位要在文件里二分查找，直接跳到关键帧的字节偏移；
+ * 时间戳定位失败时也退回到按字节定位。
+ */
+static int session_seek(DecodeSession *s, const IndexEntry *entry) {
+    const AVInputFormat *fmt = s->input_ctx->iformat;
+    bool byte_seek = !(fmt->flags & AVFMT_NO_BYTE_SEEK) && entry->offset >= 0;
+    int ret = -1;
+
+    if (entry->pts != AV_NOPTS_VALUE && (!byte_seek || fmt->read_seek || fmt->read_seek2))
+        ret = av_seek_frame(s->input_ctx, s->video_stream, entry->pts, AVSEEK_FLAG_BACKWARD);
+    if (ret < 0 && byte_seek)
+        ret = av_seek_frame(s->input_ctx, -1, entry->offset, AVSEEK_FLAG_BYTE);
+    if (ret < 0)
+        return ret;
+
+    // 清空解码器中定位之前的数据，软件解码回退的缓存也随之作废
+    avcodec_flush_buffers(s->decoder_ctx);
+    replay_clear(s);
+    s->replay_overflow = 0;
+    s->wait_keyframe = 0;
+    s->draining = 0;
+    s->last_pts = AV_NOPTS_VALUE;
+    s->resume_pts = AV_NOPTS_VALUE;
+    return 0;
+}
+
+/*
+ * 稀疏抽帧：每个时间点从索引中找到之前最近的关键帧，定位过去后只解码到目标帧为止。
+ * 目标帧之前的帧不下载、不输出。
+ */
+static int session_extract(DecodeSession *s) {
+    AVStream *video = s->input_ctx->streams[s->video_stream];
+    int64_t start = video->start_time != AV_NOPTS_VALUE ? video->start_time : 0;
+    AVPacket packet;
+    int ret;
+
+    if (s->indexing && (ret = session_index_scan(s)) < 0)
+        return ret;
+
+    for (double time : extract_times) {
+        int64_t target = start + av_rescale_q(llrint(time * AV_TIME_BASE), AV_TIME_BASE_Q, video->time_base);
+        int64_t key = index_seek_key(&s->packet_index, target);
+        if (key < 0 || (ret = session_seek(s, &s->packet_index.entries[key])) < 0) {
+            fprintf(stderr, "%s: can not seek to %.3f s\n", s->name, time);
+            continue;
+        }
+        s->extracting = 1;
+        s->extract_pts = target;
+        ret = 0;
+        while (ret >= 0 && s->extracting == 1 && (ret = av_read_frame(s->input_ctx, &packet)) >= 0) {
+            if (packet.stream_index == s->video_stream)
+                ret = decode_write(s, &packet);
+            av_packet_unref(&packet);
+        }
+        // 读到文件末尾还没取到时清空解码器，目标可能在最后几帧里
+        if (s->extracting == 1 && ret == AVERROR_EOF)
+            ret = decode_write(s, NULL);
+        if (ret < 0 && ret != AVERROR_EOF)
+            return ret;
+        if (s->extracting == 1)
+            fprintf(stderr, "%s: no frame at %.3f s\n", s->name, time);
+    }
+    s->extracting = 0;
+    return 0;
+}
+
+/*
+ * 串行解码，解复用交给单独的线程。
+ * 容器跳过交错的音频数据、磁盘读取变慢时，av_read_frame() 的停顿由包队列吸收，解码器不会跟着停下来。
+ */
+static int decode_demuxed(DecodeSession *s, const PipelineConfig *cfg) {
+    PacketQueue q;
+    AVPacket *pkt;
+    int demux_ret = 0, ret = 0;
+
+    packet_queue_init(&q, &cfg->packet_limits, s->input_ctx->streams[s->video_stream]->time_base);
+    std::thread demuxer([s, &q, &demux_ret] { demux_ret = demux_packets(s, &q); });
+
+    session_thread_name(s, "decode");
+    // 空包表示流结束，送给解码器清空
+    while (ret >= 0 && packet_queue_pop(&q, &pkt)) {
+        ret = decode_write(s, pkt);
+        if (!pkt)
+            break;
+        av_packet_free(&pkt);
+        // 已经不需要后面的帧了，decode_write() 置位 input_done 后解复用停止读取，这里直接清空解码器
+        if (s->input_done.load()) {
+            if (ret >= 0)
+                ret = decode_write(s, NULL);
+            break;
+        }
+    }
+    packet_queue_abort(&q);
+    demuxer.join();
+    packet_queue_uninit(&q);
+    return ret < 0 ? ret : demux_ret;
+}
+
+// 解码整路流，结果记录在 s->error 和 s->elapsed 中
+static void session_run(DecodeSession *s, enum AVHWDeviceType type) {
+    AVPacket packet;
+    int64_t start_time;
+    int ret, err;
+
+    if ((s->error = session_open(s, type)) < 0)
+        return;
+
+    if (use_index || !extract_times.empty())
+        session_index_open(s);
+
+    start_time = av_gettime_relative();
+    stats_reporter_init(&s->reporter);
+    if (!extract_times.empty()) {
+        // 抽帧需要反复定位和清空解码器，总是在当前线程上串行进行
+        session_thread_name(s, "extract");
+        ret = session_extract(s);
+    } else if (s->pipeline) {
+        // 各级在各自的线程上运行，内部会完成清空解码器的步骤
+        ret = decode_pipeline(s, s->pipeline);
+    } else if (s->demuxer) {
+        ret = decode_demuxed(s, s->demuxer);
+    } else {
+        session_thread_name(s, "decode");
+        // 在这一步真正开始解码，并把解码后的数据存入输出文件中。
+        ret = 0;
+        while (ret >= 0 && !s->input_done.load()) {
+            if ((ret = session_read_packet(s, &packet)) < 0) {
+                if (ret == AVERROR_EOF)
+                    ret = 0;
+                break;
+            }
+            ret = decode_write(s, &packet);
+            av_packet_unref(&packet);
+        }
+
+        // 读到文件末尾（或者提前停下）时清空解码器；解码或读取出错时保留第一个错误
+        if (ret >= 0) {
+            packet.data = NULL;
+            packet.size = 0;
+            ret = decode_write(s, &packet);
+            av_packet_unref(&packet);
+        }
+    }
+    // 清空编码器，写出剩余的压缩包
+    if (ret >= 0 && hw_encoder)
+        ret = encode_frame(s, NULL);
+    // 等在途的写全部完成，写入出错也算解码失败
+    if ((err = writer_close(&s->writer)) < 0 && ret >= 0) {
+        fprintf(stderr, "%s: failed to write output file\n", s->name);
+        ret = err;
+    }
+    // 完整解复用了一遍输入，索引已经齐全；按时间段提前停下时索引不完整，不保存
+    if (ret >= 0 && s->indexing && !s->input_done.load())
+        session_index_save(s);
+    s->elapsed = (av_gettime_relative() - start_time) / 1000000.0;
+    s->error = ret;
+}
+
+static void session_close(DecodeSession *s) {
+    writer_close(&s->writer);
+    if (s->output_file)
+        fclose(s->output_file);
+    s->encoder_ctx.reset();
+    s->encoder_pkt.reset();
+    avcodec_free_context(&s->decoder_ctx);
+    replay_clear(s);
+    avfilter_graph_free(&s->scale_graph);
+    postproc_free(&s->postproc);
+    avformat_close_input(&s->input_ctx);
+    if (s->prefetch)
+        fprintf(stderr, "%s: prefetched %lld bytes, %lld seeks in memory, %lld refetched\n", s->name,
+                static_cast<long long>(s->prefetch->bytes_fetched), static_cast<long long>(s->prefetch->seek_hits),
+                static_cast<long long>(s->prefetch->seek_misses));
+    prefetch_close(&s->prefetch, &s->input_pb);
+    frame_pool_uninit(&s->frame_pool);
+    image_pool_uninit(&s->sw_image_pool);
+    image_pool_uninit(&s->copy_image_pool);
+}
+
+int main(int argc, char *argv[]) {
+    enum AVHWDeviceType type;
+    int i, failed = 0;
+    int pipeline = 0, demuxer = 0;
+    const char *encoder_name = NULL;
+    int64_t start_time;
+    PipelineConfig pipeline_cfg = {{PACKET_QUEUE_SIZE, PACKET_QUEUE_MB * 1024 * 1024, 0}, FRAME_QUEUE_SIZE,
+                                   WRITE_QUEUE_SIZE};
+    std::vector<std::unique_ptr<DecodeSession>> sessions;
+
+    if (argc < 4) {
+        fprintf(stderr, "Usage: %s <device type> <input file> <output file> [options]\n"
+                        "  --stream <input> <output>      decode another input concurrently; may be repeated,\n"
+                        "                                 every stream shares the one hardware device\n"
+                        "  --output-mode copy|direct|map  how frames reach the output file (default: copy)\n"
+                        "      copy   transfer, pack with av_image_copy_to_buffer(), write\n"
+                        "      direct transfer, write planes straight from the frame\n"
+                        "      map    map the hardware surface with av_hwframe_map(), write planes\n"
+                        "  --pipeline                     run demux, decode, download and write on separate threads\n"
+                        "  --demux-thread                 without --pipeline, demux on a separate thread that\n"
+                        "                                 fills the packet queue ahead of the decoder\n"
+                        "  --packet-queue <n>             demux -> decode queue depth (default: %d)\n"
+                        "  --packet-queue-size <MiB>      bytes held in the packet queue (default: %d, 0 no limit)\n"
+                        "  --packet-queue-duration <s>    duration held in the packet queue (default: 0, no limit)\n"
+                        "  --frame-queue <n>              decode -> download queue depth (default: %d)\n"
+                        "  --write-queue <n>              download -> write queue depth (default: %d)\n"
+                        "  --encode <encoder>             transcode: hand hardware frames straight to a hardware\n"
+                        "                                 encoder for the same device (e.g. h264_vaapi, h264_nvenc)\n"
+                        "                                 and write its packets instead of raw frames\n"
+                        "  --fast-start                   limit probing, trust container headers and create the\n"
+                        "                                 device while the inputs are probed\n"
+                        "  --index                        keep a packet index in <input>%s and reuse it while the\n"
+                        "                                 input is unchanged\n"
+                        "  --extract <t,...>              only output the frames at these times (seconds), seeking\n"
+                        "                                 to the preceding keyframe through the index\n"
+                        FRAME_SELECT_OPTIONS_HELP
+                        "  --no-sw-fallback               fail instead of switching to software decoding when\n"
+                        "                                 the device can not decode a stream\n"
+                        "  --sw-threads <n>               software fallback decoder threads (default: 0, auto)\n"
+                        "  --extra-hw-frames <n>          extra surfaces in the decoder's hardware frames pool\n"
+                        "                                 (default: 0, %d with --encode; queue depths are added\n"
+                        "                                 in pipeline mode, and the write depth in map mode)\n"
+                        "  --scale <w>x<h>                scale output frames; hardware frames are scaled on the\n"
+                        "                                 device (scale_vaapi, scale_npp/scale_cuda, scale_qsv)\n"
+                        "                                 before download, a size of 0 keeps that dimension\n"
+                        "  --scale-format <pix_fmt>       convert output frames to this format, on the device when\n"
+                        "                                 its scaler can (e.g. nv12, bgra, yuv420p)\n"
+                        POSTPROC_OPTIONS_HELP
+                        WRITER_OPTIONS_HELP
+                        PREFETCH_OPTIONS_HELP
+                        STATS_OPTIONS_HELP,
+                argv[0], PACKET_QUEUE_SIZE, PACKET_QUEUE_MB, FRAME_QUEUE_SIZE, WRITE_QUEUE_SIZE, INDEX_SUFFIX, ENCODER_HW_FRAMES);
         return -1;
+    }
 
-    // 初始化硬加速设备类型，并把硬加速上下文装配到编解码上下文中
-    if (hw_decoder_init(decoder_ctx, type) < 0)
+    sessions.emplace_back(new DecodeSession(0, argv[2], argv[3]));
+    for (i = 4; i < argc; i++) {
+        if (!strcmp(argv[i], "--stream") && i + 2 < argc) {
+            sessions.emplace_back(new DecodeSession(static_cast<int>(sessions.size()), argv[i + 1], argv[i + 2]));
+            i += 2;
+        } else if (!strcmp(argv[i], "--output-mode") && i + 1 < argc) {
+            const char *mode = argv[++i];
+            if (!strcmp(mode, "copy"))
+                output_mode = OUTPUT_COPY;
+            else if (!strcmp(mode, "direct"))
+                output_mode = OUTPUT_DIRECT;
+            else if (!strcmp(mode, "map"))
+                output_mode = OUTPUT_MAP;
+            else {
+                fprintf(stderr, "Unknown output mode '%s'\n", mode);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--pipeline")) {
+            pipeline = 1;
+        } else if (!strcmp(argv[i], "--demux-thread")) {
+            demuxer = 1;
+        } else if (!strcmp(argv[i], "--packet-queue") && i + 1 < argc) {
+            pipeline_cfg.packet_limits.packets = atoi(argv[++i]);
+            pipeline_cfg.packet_limits.packets = FFMAX(pipeline_cfg.packet_limits.packets, 1);
+        } else if (!strcmp(argv[i], "--packet-queue-size") && i + 1 < argc) {
+            pipeline_cfg.packet_limits.bytes = static_cast<int64_t>(atof(argv[++i]) * 1024 * 1024);
+            pipeline_cfg.packet_limits.bytes = FFMAX(pipeline_cfg.packet_limits.bytes, 0);
+        } else if (!strcmp(argv[i], "--packet-queue-duration") && i + 1 < argc) {
+            pipeline_cfg.packet_limits.duration = llrint(atof(argv[++i]) * AV_TIME_BASE);
+            pipeline_cfg.packet_limits.duration = FFMAX(pipeline_cfg.packet_limits.duration, 0);
+        } else if (!strcmp(argv[i], "--frame-queue") && i + 1 < argc) {
+            pipeline_cfg.frame_queue_size = atoi(argv[++i]);
+            pipeline_cfg.frame_queue_size = FFMAX(pipeline_cfg.frame_queue_size, 1);
+        } else if (!strcmp(argv[i], "--write-queue") && i + 1 < argc) {
+            pipeline_cfg.write_queue_size = atoi(argv[++i]);
+            pipeline_cfg.write_queue_size = FFMAX(pipeline_cfg.write_queue_size, 1);
+        } else if (!strcmp(argv[i], "--encode") && i + 1 < argc) {
+            encoder_name = argv[++i];
+        } else if (!strcmp(argv[i], "--index")) {
+            use_index = 1;
+        } else if (!strcmp(argv[i], "--extract") && i + 1 < argc) {
+            if (index_parse_times(argv[++i], &extract_times) < 0) {
+                fprintf(stderr, "Invalid time list '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--fast-start")) {
+            fast_start = 1;
+        } else if (!strcmp(argv[i], "--no-sw-fallback")) {
+            sw_fallback = 0;
+        } else if (!strcmp(argv[i], "--sw-threads") && i + 1 < argc) {
+            sw_threads = atoi(argv[++i]);
+            sw_threads = FFMAX(sw_threads, 0);
+        } else if (!strcmp(argv[i], "--extra-hw-frames") && i + 1 < argc) {
+            extra_hw_frames = atoi(argv[++i]);
+            extra_hw_frames = FFMAX(extra_hw_frames, 0);
+        } else if (!strcmp(argv[i], "--scale") && i + 1 < argc) {
+            if (sscanf(argv[++i], "%dx%d", &scale_width, &scale_height) != 2 || scale_width < 0 ||
+                scale_height < 0) {
+                fprintf(stderr, "Invalid size '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (!strcmp(argv[i], "--scale-format") && i + 1 < argc) {
+            if ((scale_format = av_get_pix_fmt(argv[++i])) == AV_PIX_FMT_NONE) {
+                fprintf(stderr, "Unknown pixel format '%s'\n", argv[i]);
+                return -1;
+            }
+        } else if (frame_select_parse_option(argc, argv, &i, &frame_select)) {
+        } else if (postproc_parse_option(argc, argv, &i, &postproc_cfg)) {
+        } else if (writer_parse_option(argc, argv, &i, &writer_cfg)) {
+        } else if (prefetch_parse_option(argc, argv, &i, &prefetch_cfg)) {
+        } else if (stats_parse_option(argc, argv, &i)) {
+        } else {
+            fprintf(stderr, "Unknown option '%s'\n", argv[i]);
+            return -1;
+        }
+    }
+
+    // 通过名称获取硬件加速设备类型
+    type = av_hwdevice_find_type_by_name(argv[1]);
+    if (type == AV_HWDEVICE_TYPE_NONE) {
+        fprintf(stderr, "Device type %s is not supported.\n", argv[1]);
+        fprintf(stderr, "Available device types:");
+        // 遍历本地支持的所有硬件加速设备类型
+        while ((type = av_hwdevice_iterate_types(type)) != AV_HWDEVICE_TYPE_NONE)
+            fprintf(stderr, " %s", av_hwdevice_get_type_name(type));
+        fprintf(stderr, "\n");
         return -1;
+    }
 
-    // 打开编解码上下文
-    if ((ret = avcodec_open2(decoder_ctx, decoder, NULL)) < 0) {
-        fprintf(stderr, "Failed to open codec for stream #%u\n", video_stream);
+    if (encoder_name && core_find_codec(encoder_name, true, &hw_encoder) < 0) {
+        fprintf(stderr, "Encoder '%s' not found\n", encoder_name);
+        return -1;
+    }
+    // 转码时帧留在设备上，没有可以在 CPU 上处理的像素数据
+    if (hw_encoder && postproc_enabled(&postproc_cfg)) {
+        fprintf(stderr, "--crop, --downscale and --planar need raw output, use --scale with --encode\n");
         return -1;
     }
 
-    // 打开输出文件流用于保存解码数据
-    output_file = fopen(argv[3], "w+");
+    // 只创建一个硬件设备上下文，所有会话共用，避免每路流各自占用一份设备和显存
+    launch_time = av_gettime_relative();
+    if (fast_start)
+        hw_device_ready = std::async(std::launch::async, hw_device_init, type).share();
+    else if (hw_device_init(type) < 0)
+        return -1;
 
-    // 在这一步真正开始解码，并把解码后的数据存入输出文件中。
-    while (ret >= 0) {
-        if ((ret = av_read_frame(input_ctx, &packet)) < 0)
-            break;
+    for (auto &s : sessions) {
+        s->pipeline = pipeline ? &pipeline_cfg : NULL;
+        s->demuxer = demuxer ? &pipeline_cfg : NULL;
+        s->select = frame_select;
+    }
 
-        if (video_stream == packet.stream_index)
-            ret = decode_write(decoder_ctx, &packet);
+    start_time = av_gettime_relative();
+    stats_init();
+    if (sessions.size() == 1) {
+        session_run(sessions[0].get(), type);
+    } else {
+        // 每路流在自己的线程上打开和解码，--pipeline 时每路再各自起流水线线程
+        std::vector<std::thread> threads;
+        for (auto &s : sessions)
+            threads.emplace_back(session_run, s.get(), type);
+        for (auto &th : threads)
+            th.join();
+    }
+    double elapsed = (av_gettime_relative() - start_time) / 1000000.0;
 
-        av_packet_unref(&packet);
+    // 每路流各自的统计，以及全部流的汇总
+    LatencyHistogram total_demux("demux"), total_send("send_packet"), total_receive("receive_frame"),
+            total_transfer("hwframe_transfer"), total_encode("encode"), total_postproc("postproc"),
+            total_write("fwrite"), total_prefetch("prefetch_read");
+    LatencyHistogram *const total_stages[NB_SESSION_STAGES] = {&total_demux, &total_send, &total_receive,
+                                                               &total_transfer, &total_encode, &total_postproc,
+                                                               &total_write, &total_prefetch};
+    std::vector<StatsReport> reports;
+    int64_t total_frames = 0, total_bytes = 0;
+    double first_frame, total_first_frame = -1;
+    for (auto &s : sessions) {
+        int64_t frames = s->frames_written.load(), bytes = s->bytes_written.load();
+        if (s->error < 0)
+            failed++;
+        if (sessions.size() > 1)
+            fprintf(stderr, "%s %s: %lld frames in %.3f s (%.2f fps), %lld bytes%s\n", s->name, s->input_filename,
+                    static_cast<long long>(frames), s->elapsed, s->elapsed > 0 ? frames / s->elapsed : 0.0,
+                    static_cast<long long>(bytes), s->error < 0 ? ", failed" : "");
+        for (i = 0; i < NB_SESSION_STAGES; i++)
+            latency_merge(total_stages[i], s->stages[i]);
+        total_frames += frames;
+        total_bytes += bytes;
+        first_frame = s->first_frame_time < 0 ? -1 : (s->first_frame_time - launch_time) / 1000000.0;
+        if (first_frame >= 0) {
+            fprintf(stderr, "%s: first frame after %.1f ms\n", s->name, first_frame * 1000.0);
+            if (total_first_frame < 0 || first_frame < total_first_frame)
+                total_first_frame = first_frame;
+        }
+        reports.push_back({s->name, frames, bytes, s->elapsed, s->stages, NB_SESSION_STAGES, first_frame});
     }
+    if (sessions.size() > 1)
+        fprintf(stderr, "decoded %lld frames from %d streams in %.3f s (%.2f fps)\n",
+                static_cast<long long>(total_frames), static_cast<int>(sessions.size()), elapsed,
+                elapsed > 0 ? total_frames / elapsed : 0.0);
 
-    // 清空解码器
-    packet.data = NULL;
-    packet.size = 0;
-    ret = decode_write(decoder_ctx, &packet);
-    av_packet_unref(&packet);
+    StatsReport report = {"video_hw_decode", total_frames, total_bytes, elapsed, total_stages, NB_SESSION_STAGES,
+                          total_first_frame};
+    stats_finish(&report, reports.data(), sessions.size() > 1 ? static_cast<int>(reports.size()) : 0);
 
-    if (output_file)
-        fclose(output_file);
-    avcodec_free_context(&decoder_ctx);
-    avformat_close_input(&input_ctx);
+    for (auto &s : sessions)
+        session_close(s.get());
+    // 所有会话都没用到设备时，后台线程可能还在创建
+    hw_device_wait();
     av_buffer_unref(&hw_device_ctx);
 
-    return 0;
+    return failed ? -1 : 0;
 }